@@ -85,7 +85,16 @@ GLAPI struct gladGLversionStruct GLVersion;
 GLAPI int gladLoadGLLoader(GLADloadproc);
 
 
+/* Define GLAD_NO_DEBUG to call the GL functions directly, bypassing the
+   pre/post call callbacks. */
+#ifndef GLAD_NO_DEBUG
 #define GLAD_DEBUG
+#endif
+#ifdef GLAD_DEBUG
+#define GLAD_FUNCTION(name) glad_debug_##name
+#else
+#define GLAD_FUNCTION(name) glad_##name
+#endif
 typedef void (* GLADcallback)(const char *name, void *funcptr, int len_args, ...);
 
 GLAPI void glad_set_pre_callback(GLADcallback cb);
@@ -1013,195 +1022,195 @@ GLAPI int GLAD_GL_VERSION_1_0;
 typedef void (APIENTRYP PFNGLCULLFACEPROC)(GLenum mode);
 GLAPI PFNGLCULLFACEPROC glad_glCullFace;
 GLAPI PFNGLCULLFACEPROC glad_debug_glCullFace;
-#define glCullFace glad_debug_glCullFace
+#define glCullFace GLAD_FUNCTION(glCullFace)
 typedef void (APIENTRYP PFNGLFRONTFACEPROC)(GLenum mode);
 GLAPI PFNGLFRONTFACEPROC glad_glFrontFace;
 GLAPI PFNGLFRONTFACEPROC glad_debug_glFrontFace;
-#define glFrontFace glad_debug_glFrontFace
+#define glFrontFace GLAD_FUNCTION(glFrontFace)
 typedef void (APIENTRYP PFNGLHINTPROC)(GLenum target, GLenum mode);
 GLAPI PFNGLHINTPROC glad_glHint;
 GLAPI PFNGLHINTPROC glad_debug_glHint;
-#define glHint glad_debug_glHint
+#define glHint GLAD_FUNCTION(glHint)
 typedef void (APIENTRYP PFNGLLINEWIDTHPROC)(GLfloat width);
 GLAPI PFNGLLINEWIDTHPROC glad_glLineWidth;
 GLAPI PFNGLLINEWIDTHPROC glad_debug_glLineWidth;
-#define glLineWidth glad_debug_glLineWidth
+#define glLineWidth GLAD_FUNCTION(glLineWidth)
 typedef void (APIENTRYP PFNGLPOINTSIZEPROC)(GLfloat size);
 GLAPI PFNGLPOINTSIZEPROC glad_glPointSize;
 GLAPI PFNGLPOINTSIZEPROC glad_debug_glPointSize;
-#define glPointSize glad_debug_glPointSize
+#define glPointSize GLAD_FUNCTION(glPointSize)
 typedef void (APIENTRYP PFNGLPOLYGONMODEPROC)(GLenum face, GLenum mode);
 GLAPI PFNGLPOLYGONMODEPROC glad_glPolygonMode;
 GLAPI PFNGLPOLYGONMODEPROC glad_debug_glPolygonMode;
-#define glPolygonMode glad_debug_glPolygonMode
+#define glPolygonMode GLAD_FUNCTION(glPolygonMode)
 typedef void (APIENTRYP PFNGLSCISSORPROC)(GLint x, GLint y, GLsizei width, GLsizei height);
 GLAPI PFNGLSCISSORPROC glad_glScissor;
 GLAPI PFNGLSCISSORPROC glad_debug_glScissor;
-#define glScissor glad_debug_glScissor
+#define glScissor GLAD_FUNCTION(glScissor)
 typedef void (APIENTRYP PFNGLTEXPARAMETERFPROC)(GLenum target, GLenum pname, GLfloat param);
 GLAPI PFNGLTEXPARAMETERFPROC glad_glTexParameterf;
 GLAPI PFNGLTEXPARAMETERFPROC glad_debug_glTexParameterf;
-#define glTexParameterf glad_debug_glTexParameterf
+#define glTexParameterf GLAD_FUNCTION(glTexParameterf)
 typedef void (APIENTRYP PFNGLTEXPARAMETERFVPROC)(GLenum target, GLenum pname, const GLfloat *params);
 GLAPI PFNGLTEXPARAMETERFVPROC glad_glTexParameterfv;
 GLAPI PFNGLTEXPARAMETERFVPROC glad_debug_glTexParameterfv;
-#define glTexParameterfv glad_debug_glTexParameterfv
+#define glTexParameterfv GLAD_FUNCTION(glTexParameterfv)
 typedef void (APIENTRYP PFNGLTEXPARAMETERIPROC)(GLenum target, GLenum pname, GLint param);
 GLAPI PFNGLTEXPARAMETERIPROC glad_glTexParameteri;
 GLAPI PFNGLTEXPARAMETERIPROC glad_debug_glTexParameteri;
-#define glTexParameteri glad_debug_glTexParameteri
+#define glTexParameteri GLAD_FUNCTION(glTexParameteri)
 typedef void (APIENTRYP PFNGLTEXPARAMETERIVPROC)(GLenum target, GLenum pname, const GLint *params);
 GLAPI PFNGLTEXPARAMETERIVPROC glad_glTexParameteriv;
 GLAPI PFNGLTEXPARAMETERIVPROC glad_debug_glTexParameteriv;
-#define glTexParameteriv glad_debug_glTexParameteriv
+#define glTexParameteriv GLAD_FUNCTION(glTexParameteriv)
 typedef void (APIENTRYP PFNGLTEXIMAGE1DPROC)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLint border, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXIMAGE1DPROC glad_glTexImage1D;
 GLAPI PFNGLTEXIMAGE1DPROC glad_debug_glTexImage1D;
-#define glTexImage1D glad_debug_glTexImage1D
+#define glTexImage1D GLAD_FUNCTION(glTexImage1D)
 typedef void (APIENTRYP PFNGLTEXIMAGE2DPROC)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXIMAGE2DPROC glad_glTexImage2D;
 GLAPI PFNGLTEXIMAGE2DPROC glad_debug_glTexImage2D;
-#define glTexImage2D glad_debug_glTexImage2D
+#define glTexImage2D GLAD_FUNCTION(glTexImage2D)
 typedef void (APIENTRYP PFNGLDRAWBUFFERPROC)(GLenum buf);
 GLAPI PFNGLDRAWBUFFERPROC glad_glDrawBuffer;
 GLAPI PFNGLDRAWBUFFERPROC glad_debug_glDrawBuffer;
-#define glDrawBuffer glad_debug_glDrawBuffer
+#define glDrawBuffer GLAD_FUNCTION(glDrawBuffer)
 typedef void (APIENTRYP PFNGLCLEARPROC)(GLbitfield mask);
 GLAPI PFNGLCLEARPROC glad_glClear;
 GLAPI PFNGLCLEARPROC glad_debug_glClear;
-#define glClear glad_debug_glClear
+#define glClear GLAD_FUNCTION(glClear)
 typedef void (APIENTRYP PFNGLCLEARCOLORPROC)(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
 GLAPI PFNGLCLEARCOLORPROC glad_glClearColor;
 GLAPI PFNGLCLEARCOLORPROC glad_debug_glClearColor;
-#define glClearColor glad_debug_glClearColor
+#define glClearColor GLAD_FUNCTION(glClearColor)
 typedef void (APIENTRYP PFNGLCLEARSTENCILPROC)(GLint s);
 GLAPI PFNGLCLEARSTENCILPROC glad_glClearStencil;
 GLAPI PFNGLCLEARSTENCILPROC glad_debug_glClearStencil;
-#define glClearStencil glad_debug_glClearStencil
+#define glClearStencil GLAD_FUNCTION(glClearStencil)
 typedef void (APIENTRYP PFNGLCLEARDEPTHPROC)(GLdouble depth);
 GLAPI PFNGLCLEARDEPTHPROC glad_glClearDepth;
 GLAPI PFNGLCLEARDEPTHPROC glad_debug_glClearDepth;
-#define glClearDepth glad_debug_glClearDepth
+#define glClearDepth GLAD_FUNCTION(glClearDepth)
 typedef void (APIENTRYP PFNGLSTENCILMASKPROC)(GLuint mask);
 GLAPI PFNGLSTENCILMASKPROC glad_glStencilMask;
 GLAPI PFNGLSTENCILMASKPROC glad_debug_glStencilMask;
-#define glStencilMask glad_debug_glStencilMask
+#define glStencilMask GLAD_FUNCTION(glStencilMask)
 typedef void (APIENTRYP PFNGLCOLORMASKPROC)(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha);
 GLAPI PFNGLCOLORMASKPROC glad_glColorMask;
 GLAPI PFNGLCOLORMASKPROC glad_debug_glColorMask;
-#define glColorMask glad_debug_glColorMask
+#define glColorMask GLAD_FUNCTION(glColorMask)
 typedef void (APIENTRYP PFNGLDEPTHMASKPROC)(GLboolean flag);
 GLAPI PFNGLDEPTHMASKPROC glad_glDepthMask;
 GLAPI PFNGLDEPTHMASKPROC glad_debug_glDepthMask;
-#define glDepthMask glad_debug_glDepthMask
+#define glDepthMask GLAD_FUNCTION(glDepthMask)
 typedef void (APIENTRYP PFNGLDISABLEPROC)(GLenum cap);
 GLAPI PFNGLDISABLEPROC glad_glDisable;
 GLAPI PFNGLDISABLEPROC glad_debug_glDisable;
-#define glDisable glad_debug_glDisable
+#define glDisable GLAD_FUNCTION(glDisable)
 typedef void (APIENTRYP PFNGLENABLEPROC)(GLenum cap);
 GLAPI PFNGLENABLEPROC glad_glEnable;
 GLAPI PFNGLENABLEPROC glad_debug_glEnable;
-#define glEnable glad_debug_glEnable
+#define glEnable GLAD_FUNCTION(glEnable)
 typedef void (APIENTRYP PFNGLFINISHPROC)();
 GLAPI PFNGLFINISHPROC glad_glFinish;
 GLAPI PFNGLFINISHPROC glad_debug_glFinish;
-#define glFinish glad_debug_glFinish
+#define glFinish GLAD_FUNCTION(glFinish)
 typedef void (APIENTRYP PFNGLFLUSHPROC)();
 GLAPI PFNGLFLUSHPROC glad_glFlush;
 GLAPI PFNGLFLUSHPROC glad_debug_glFlush;
-#define glFlush glad_debug_glFlush
+#define glFlush GLAD_FUNCTION(glFlush)
 typedef void (APIENTRYP PFNGLBLENDFUNCPROC)(GLenum sfactor, GLenum dfactor);
 GLAPI PFNGLBLENDFUNCPROC glad_glBlendFunc;
 GLAPI PFNGLBLENDFUNCPROC glad_debug_glBlendFunc;
-#define glBlendFunc glad_debug_glBlendFunc
+#define glBlendFunc GLAD_FUNCTION(glBlendFunc)
 typedef void (APIENTRYP PFNGLLOGICOPPROC)(GLenum opcode);
 GLAPI PFNGLLOGICOPPROC glad_glLogicOp;
 GLAPI PFNGLLOGICOPPROC glad_debug_glLogicOp;
-#define glLogicOp glad_debug_glLogicOp
+#define glLogicOp GLAD_FUNCTION(glLogicOp)
 typedef void (APIENTRYP PFNGLSTENCILFUNCPROC)(GLenum func, GLint ref, GLuint mask);
 GLAPI PFNGLSTENCILFUNCPROC glad_glStencilFunc;
 GLAPI PFNGLSTENCILFUNCPROC glad_debug_glStencilFunc;
-#define glStencilFunc glad_debug_glStencilFunc
+#define glStencilFunc GLAD_FUNCTION(glStencilFunc)
 typedef void (APIENTRYP PFNGLSTENCILOPPROC)(GLenum fail, GLenum zfail, GLenum zpass);
 GLAPI PFNGLSTENCILOPPROC glad_glStencilOp;
 GLAPI PFNGLSTENCILOPPROC glad_debug_glStencilOp;
-#define glStencilOp glad_debug_glStencilOp
+#define glStencilOp GLAD_FUNCTION(glStencilOp)
 typedef void (APIENTRYP PFNGLDEPTHFUNCPROC)(GLenum func);
 GLAPI PFNGLDEPTHFUNCPROC glad_glDepthFunc;
 GLAPI PFNGLDEPTHFUNCPROC glad_debug_glDepthFunc;
-#define glDepthFunc glad_debug_glDepthFunc
+#define glDepthFunc GLAD_FUNCTION(glDepthFunc)
 typedef void (APIENTRYP PFNGLPIXELSTOREFPROC)(GLenum pname, GLfloat param);
 GLAPI PFNGLPIXELSTOREFPROC glad_glPixelStoref;
 GLAPI PFNGLPIXELSTOREFPROC glad_debug_glPixelStoref;
-#define glPixelStoref glad_debug_glPixelStoref
+#define glPixelStoref GLAD_FUNCTION(glPixelStoref)
 typedef void (APIENTRYP PFNGLPIXELSTOREIPROC)(GLenum pname, GLint param);
 GLAPI PFNGLPIXELSTOREIPROC glad_glPixelStorei;
 GLAPI PFNGLPIXELSTOREIPROC glad_debug_glPixelStorei;
-#define glPixelStorei glad_debug_glPixelStorei
+#define glPixelStorei GLAD_FUNCTION(glPixelStorei)
 typedef void (APIENTRYP PFNGLREADBUFFERPROC)(GLenum src);
 GLAPI PFNGLREADBUFFERPROC glad_glReadBuffer;
 GLAPI PFNGLREADBUFFERPROC glad_debug_glReadBuffer;
-#define glReadBuffer glad_debug_glReadBuffer
+#define glReadBuffer GLAD_FUNCTION(glReadBuffer)
 typedef void (APIENTRYP PFNGLREADPIXELSPROC)(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixels);
 GLAPI PFNGLREADPIXELSPROC glad_glReadPixels;
 GLAPI PFNGLREADPIXELSPROC glad_debug_glReadPixels;
-#define glReadPixels glad_debug_glReadPixels
+#define glReadPixels GLAD_FUNCTION(glReadPixels)
 typedef void (APIENTRYP PFNGLGETBOOLEANVPROC)(GLenum pname, GLboolean *data);
 GLAPI PFNGLGETBOOLEANVPROC glad_glGetBooleanv;
 GLAPI PFNGLGETBOOLEANVPROC glad_debug_glGetBooleanv;
-#define glGetBooleanv glad_debug_glGetBooleanv
+#define glGetBooleanv GLAD_FUNCTION(glGetBooleanv)
 typedef void (APIENTRYP PFNGLGETDOUBLEVPROC)(GLenum pname, GLdouble *data);
 GLAPI PFNGLGETDOUBLEVPROC glad_glGetDoublev;
 GLAPI PFNGLGETDOUBLEVPROC glad_debug_glGetDoublev;
-#define glGetDoublev glad_debug_glGetDoublev
+#define glGetDoublev GLAD_FUNCTION(glGetDoublev)
 typedef GLenum (APIENTRYP PFNGLGETERRORPROC)();
 GLAPI PFNGLGETERRORPROC glad_glGetError;
 GLAPI PFNGLGETERRORPROC glad_debug_glGetError;
-#define glGetError glad_debug_glGetError
+#define glGetError GLAD_FUNCTION(glGetError)
 typedef void (APIENTRYP PFNGLGETFLOATVPROC)(GLenum pname, GLfloat *data);
 GLAPI PFNGLGETFLOATVPROC glad_glGetFloatv;
 GLAPI PFNGLGETFLOATVPROC glad_debug_glGetFloatv;
-#define glGetFloatv glad_debug_glGetFloatv
+#define glGetFloatv GLAD_FUNCTION(glGetFloatv)
 typedef void (APIENTRYP PFNGLGETINTEGERVPROC)(GLenum pname, GLint *data);
 GLAPI PFNGLGETINTEGERVPROC glad_glGetIntegerv;
 GLAPI PFNGLGETINTEGERVPROC glad_debug_glGetIntegerv;
-#define glGetIntegerv glad_debug_glGetIntegerv
+#define glGetIntegerv GLAD_FUNCTION(glGetIntegerv)
 typedef const GLubyte * (APIENTRYP PFNGLGETSTRINGPROC)(GLenum name);
 GLAPI PFNGLGETSTRINGPROC glad_glGetString;
 GLAPI PFNGLGETSTRINGPROC glad_debug_glGetString;
-#define glGetString glad_debug_glGetString
+#define glGetString GLAD_FUNCTION(glGetString)
 typedef void (APIENTRYP PFNGLGETTEXIMAGEPROC)(GLenum target, GLint level, GLenum format, GLenum type, void *pixels);
 GLAPI PFNGLGETTEXIMAGEPROC glad_glGetTexImage;
 GLAPI PFNGLGETTEXIMAGEPROC glad_debug_glGetTexImage;
-#define glGetTexImage glad_debug_glGetTexImage
+#define glGetTexImage GLAD_FUNCTION(glGetTexImage)
 typedef void (APIENTRYP PFNGLGETTEXPARAMETERFVPROC)(GLenum target, GLenum pname, GLfloat *params);
 GLAPI PFNGLGETTEXPARAMETERFVPROC glad_glGetTexParameterfv;
 GLAPI PFNGLGETTEXPARAMETERFVPROC glad_debug_glGetTexParameterfv;
-#define glGetTexParameterfv glad_debug_glGetTexParameterfv
+#define glGetTexParameterfv GLAD_FUNCTION(glGetTexParameterfv)
 typedef void (APIENTRYP PFNGLGETTEXPARAMETERIVPROC)(GLenum target, GLenum pname, GLint *params);
 GLAPI PFNGLGETTEXPARAMETERIVPROC glad_glGetTexParameteriv;
 GLAPI PFNGLGETTEXPARAMETERIVPROC glad_debug_glGetTexParameteriv;
-#define glGetTexParameteriv glad_debug_glGetTexParameteriv
+#define glGetTexParameteriv GLAD_FUNCTION(glGetTexParameteriv)
 typedef void (APIENTRYP PFNGLGETTEXLEVELPARAMETERFVPROC)(GLenum target, GLint level, GLenum pname, GLfloat *params);
 GLAPI PFNGLGETTEXLEVELPARAMETERFVPROC glad_glGetTexLevelParameterfv;
 GLAPI PFNGLGETTEXLEVELPARAMETERFVPROC glad_debug_glGetTexLevelParameterfv;
-#define glGetTexLevelParameterfv glad_debug_glGetTexLevelParameterfv
+#define glGetTexLevelParameterfv GLAD_FUNCTION(glGetTexLevelParameterfv)
 typedef void (APIENTRYP PFNGLGETTEXLEVELPARAMETERIVPROC)(GLenum target, GLint level, GLenum pname, GLint *params);
 GLAPI PFNGLGETTEXLEVELPARAMETERIVPROC glad_glGetTexLevelParameteriv;
 GLAPI PFNGLGETTEXLEVELPARAMETERIVPROC glad_debug_glGetTexLevelParameteriv;
-#define glGetTexLevelParameteriv glad_debug_glGetTexLevelParameteriv
+#define glGetTexLevelParameteriv GLAD_FUNCTION(glGetTexLevelParameteriv)
 typedef GLboolean (APIENTRYP PFNGLISENABLEDPROC)(GLenum cap);
 GLAPI PFNGLISENABLEDPROC glad_glIsEnabled;
 GLAPI PFNGLISENABLEDPROC glad_debug_glIsEnabled;
-#define glIsEnabled glad_debug_glIsEnabled
+#define glIsEnabled GLAD_FUNCTION(glIsEnabled)
 typedef void (APIENTRYP PFNGLDEPTHRANGEPROC)(GLdouble near, GLdouble far);
 GLAPI PFNGLDEPTHRANGEPROC glad_glDepthRange;
 GLAPI PFNGLDEPTHRANGEPROC glad_debug_glDepthRange;
-#define glDepthRange glad_debug_glDepthRange
+#define glDepthRange GLAD_FUNCTION(glDepthRange)
 typedef void (APIENTRYP PFNGLVIEWPORTPROC)(GLint x, GLint y, GLsizei width, GLsizei height);
 GLAPI PFNGLVIEWPORTPROC glad_glViewport;
 GLAPI PFNGLVIEWPORTPROC glad_debug_glViewport;
-#define glViewport glad_debug_glViewport
+#define glViewport GLAD_FUNCTION(glViewport)
 #endif
 #ifndef GL_VERSION_1_1
 #define GL_VERSION_1_1 1
@@ -1209,55 +1218,55 @@ GLAPI int GLAD_GL_VERSION_1_1;
 typedef void (APIENTRYP PFNGLDRAWARRAYSPROC)(GLenum mode, GLint first, GLsizei count);
 GLAPI PFNGLDRAWARRAYSPROC glad_glDrawArrays;
 GLAPI PFNGLDRAWARRAYSPROC glad_debug_glDrawArrays;
-#define glDrawArrays glad_debug_glDrawArrays
+#define glDrawArrays GLAD_FUNCTION(glDrawArrays)
 typedef void (APIENTRYP PFNGLDRAWELEMENTSPROC)(GLenum mode, GLsizei count, GLenum type, const void *indices);
 GLAPI PFNGLDRAWELEMENTSPROC glad_glDrawElements;
 GLAPI PFNGLDRAWELEMENTSPROC glad_debug_glDrawElements;
-#define glDrawElements glad_debug_glDrawElements
+#define glDrawElements GLAD_FUNCTION(glDrawElements)
 typedef void (APIENTRYP PFNGLPOLYGONOFFSETPROC)(GLfloat factor, GLfloat units);
 GLAPI PFNGLPOLYGONOFFSETPROC glad_glPolygonOffset;
 GLAPI PFNGLPOLYGONOFFSETPROC glad_debug_glPolygonOffset;
-#define glPolygonOffset glad_debug_glPolygonOffset
+#define glPolygonOffset GLAD_FUNCTION(glPolygonOffset)
 typedef void (APIENTRYP PFNGLCOPYTEXIMAGE1DPROC)(GLenum target, GLint level, GLenum internalformat, GLint x, GLint y, GLsizei width, GLint border);
 GLAPI PFNGLCOPYTEXIMAGE1DPROC glad_glCopyTexImage1D;
 GLAPI PFNGLCOPYTEXIMAGE1DPROC glad_debug_glCopyTexImage1D;
-#define glCopyTexImage1D glad_debug_glCopyTexImage1D
+#define glCopyTexImage1D GLAD_FUNCTION(glCopyTexImage1D)
 typedef void (APIENTRYP PFNGLCOPYTEXIMAGE2DPROC)(GLenum target, GLint level, GLenum internalformat, GLint x, GLint y, GLsizei width, GLsizei height, GLint border);
 GLAPI PFNGLCOPYTEXIMAGE2DPROC glad_glCopyTexImage2D;
 GLAPI PFNGLCOPYTEXIMAGE2DPROC glad_debug_glCopyTexImage2D;
-#define glCopyTexImage2D glad_debug_glCopyTexImage2D
+#define glCopyTexImage2D GLAD_FUNCTION(glCopyTexImage2D)
 typedef void (APIENTRYP PFNGLCOPYTEXSUBIMAGE1DPROC)(GLenum target, GLint level, GLint xoffset, GLint x, GLint y, GLsizei width);
 GLAPI PFNGLCOPYTEXSUBIMAGE1DPROC glad_glCopyTexSubImage1D;
 GLAPI PFNGLCOPYTEXSUBIMAGE1DPROC glad_debug_glCopyTexSubImage1D;
-#define glCopyTexSubImage1D glad_debug_glCopyTexSubImage1D
+#define glCopyTexSubImage1D GLAD_FUNCTION(glCopyTexSubImage1D)
 typedef void (APIENTRYP PFNGLCOPYTEXSUBIMAGE2DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint x, GLint y, GLsizei width, GLsizei height);
 GLAPI PFNGLCOPYTEXSUBIMAGE2DPROC glad_glCopyTexSubImage2D;
 GLAPI PFNGLCOPYTEXSUBIMAGE2DPROC glad_debug_glCopyTexSubImage2D;
-#define glCopyTexSubImage2D glad_debug_glCopyTexSubImage2D
+#define glCopyTexSubImage2D GLAD_FUNCTION(glCopyTexSubImage2D)
 typedef void (APIENTRYP PFNGLTEXSUBIMAGE1DPROC)(GLenum target, GLint level, GLint xoffset, GLsizei width, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXSUBIMAGE1DPROC glad_glTexSubImage1D;
 GLAPI PFNGLTEXSUBIMAGE1DPROC glad_debug_glTexSubImage1D;
-#define glTexSubImage1D glad_debug_glTexSubImage1D
+#define glTexSubImage1D GLAD_FUNCTION(glTexSubImage1D)
 typedef void (APIENTRYP PFNGLTEXSUBIMAGE2DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXSUBIMAGE2DPROC glad_glTexSubImage2D;
 GLAPI PFNGLTEXSUBIMAGE2DPROC glad_debug_glTexSubImage2D;
-#define glTexSubImage2D glad_debug_glTexSubImage2D
+#define glTexSubImage2D GLAD_FUNCTION(glTexSubImage2D)
 typedef void (APIENTRYP PFNGLBINDTEXTUREPROC)(GLenum target, GLuint texture);
 GLAPI PFNGLBINDTEXTUREPROC glad_glBindTexture;
 GLAPI PFNGLBINDTEXTUREPROC glad_debug_glBindTexture;
-#define glBindTexture glad_debug_glBindTexture
+#define glBindTexture GLAD_FUNCTION(glBindTexture)
 typedef void (APIENTRYP PFNGLDELETETEXTURESPROC)(GLsizei n, const GLuint *textures);
 GLAPI PFNGLDELETETEXTURESPROC glad_glDeleteTextures;
 GLAPI PFNGLDELETETEXTURESPROC glad_debug_glDeleteTextures;
-#define glDeleteTextures glad_debug_glDeleteTextures
+#define glDeleteTextures GLAD_FUNCTION(glDeleteTextures)
 typedef void (APIENTRYP PFNGLGENTEXTURESPROC)(GLsizei n, GLuint *textures);
 GLAPI PFNGLGENTEXTURESPROC glad_glGenTextures;
 GLAPI PFNGLGENTEXTURESPROC glad_debug_glGenTextures;
-#define glGenTextures glad_debug_glGenTextures
+#define glGenTextures GLAD_FUNCTION(glGenTextures)
 typedef GLboolean (APIENTRYP PFNGLISTEXTUREPROC)(GLuint texture);
 GLAPI PFNGLISTEXTUREPROC glad_glIsTexture;
 GLAPI PFNGLISTEXTUREPROC glad_debug_glIsTexture;
-#define glIsTexture glad_debug_glIsTexture
+#define glIsTexture GLAD_FUNCTION(glIsTexture)
 #endif
 #ifndef GL_VERSION_1_2
 #define GL_VERSION_1_2 1
@@ -1265,19 +1274,19 @@ GLAPI int GLAD_GL_VERSION_1_2;
 typedef void (APIENTRYP PFNGLDRAWRANGEELEMENTSPROC)(GLenum mode, GLuint start, GLuint end, GLsizei count, GLenum type, const void *indices);
 GLAPI PFNGLDRAWRANGEELEMENTSPROC glad_glDrawRangeElements;
 GLAPI PFNGLDRAWRANGEELEMENTSPROC glad_debug_glDrawRangeElements;
-#define glDrawRangeElements glad_debug_glDrawRangeElements
+#define glDrawRangeElements GLAD_FUNCTION(glDrawRangeElements)
 typedef void (APIENTRYP PFNGLTEXIMAGE3DPROC)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXIMAGE3DPROC glad_glTexImage3D;
 GLAPI PFNGLTEXIMAGE3DPROC glad_debug_glTexImage3D;
-#define glTexImage3D glad_debug_glTexImage3D
+#define glTexImage3D GLAD_FUNCTION(glTexImage3D)
 typedef void (APIENTRYP PFNGLTEXSUBIMAGE3DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const void *pixels);
 GLAPI PFNGLTEXSUBIMAGE3DPROC glad_glTexSubImage3D;
 GLAPI PFNGLTEXSUBIMAGE3DPROC glad_debug_glTexSubImage3D;
-#define glTexSubImage3D glad_debug_glTexSubImage3D
+#define glTexSubImage3D GLAD_FUNCTION(glTexSubImage3D)
 typedef void (APIENTRYP PFNGLCOPYTEXSUBIMAGE3DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLint x, GLint y, GLsizei width, GLsizei height);
 GLAPI PFNGLCOPYTEXSUBIMAGE3DPROC glad_glCopyTexSubImage3D;
 GLAPI PFNGLCOPYTEXSUBIMAGE3DPROC glad_debug_glCopyTexSubImage3D;
-#define glCopyTexSubImage3D glad_debug_glCopyTexSubImage3D
+#define glCopyTexSubImage3D GLAD_FUNCTION(glCopyTexSubImage3D)
 #endif
 #ifndef GL_VERSION_1_3
 #define GL_VERSION_1_3 1
@@ -1285,39 +1294,39 @@ GLAPI int GLAD_GL_VERSION_1_3;
 typedef void (APIENTRYP PFNGLACTIVETEXTUREPROC)(GLenum texture);
 GLAPI PFNGLACTIVETEXTUREPROC glad_glActiveTexture;
 GLAPI PFNGLACTIVETEXTUREPROC glad_debug_glActiveTexture;
-#define glActiveTexture glad_debug_glActiveTexture
+#define glActiveTexture GLAD_FUNCTION(glActiveTexture)
 typedef void (APIENTRYP PFNGLSAMPLECOVERAGEPROC)(GLfloat value, GLboolean invert);
 GLAPI PFNGLSAMPLECOVERAGEPROC glad_glSampleCoverage;
 GLAPI PFNGLSAMPLECOVERAGEPROC glad_debug_glSampleCoverage;
-#define glSampleCoverage glad_debug_glSampleCoverage
+#define glSampleCoverage GLAD_FUNCTION(glSampleCoverage)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXIMAGE3DPROC)(GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXIMAGE3DPROC glad_glCompressedTexImage3D;
 GLAPI PFNGLCOMPRESSEDTEXIMAGE3DPROC glad_debug_glCompressedTexImage3D;
-#define glCompressedTexImage3D glad_debug_glCompressedTexImage3D
+#define glCompressedTexImage3D GLAD_FUNCTION(glCompressedTexImage3D)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXIMAGE2DPROC)(GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXIMAGE2DPROC glad_glCompressedTexImage2D;
 GLAPI PFNGLCOMPRESSEDTEXIMAGE2DPROC glad_debug_glCompressedTexImage2D;
-#define glCompressedTexImage2D glad_debug_glCompressedTexImage2D
+#define glCompressedTexImage2D GLAD_FUNCTION(glCompressedTexImage2D)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXIMAGE1DPROC)(GLenum target, GLint level, GLenum internalformat, GLsizei width, GLint border, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXIMAGE1DPROC glad_glCompressedTexImage1D;
 GLAPI PFNGLCOMPRESSEDTEXIMAGE1DPROC glad_debug_glCompressedTexImage1D;
-#define glCompressedTexImage1D glad_debug_glCompressedTexImage1D
+#define glCompressedTexImage1D GLAD_FUNCTION(glCompressedTexImage1D)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXSUBIMAGE3DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE3DPROC glad_glCompressedTexSubImage3D;
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE3DPROC glad_debug_glCompressedTexSubImage3D;
-#define glCompressedTexSubImage3D glad_debug_glCompressedTexSubImage3D
+#define glCompressedTexSubImage3D GLAD_FUNCTION(glCompressedTexSubImage3D)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC)(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC glad_glCompressedTexSubImage2D;
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC glad_debug_glCompressedTexSubImage2D;
-#define glCompressedTexSubImage2D glad_debug_glCompressedTexSubImage2D
+#define glCompressedTexSubImage2D GLAD_FUNCTION(glCompressedTexSubImage2D)
 typedef void (APIENTRYP PFNGLCOMPRESSEDTEXSUBIMAGE1DPROC)(GLenum target, GLint level, GLint xoffset, GLsizei width, GLenum format, GLsizei imageSize, const void *data);
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE1DPROC glad_glCompressedTexSubImage1D;
 GLAPI PFNGLCOMPRESSEDTEXSUBIMAGE1DPROC glad_debug_glCompressedTexSubImage1D;
-#define glCompressedTexSubImage1D glad_debug_glCompressedTexSubImage1D
+#define glCompressedTexSubImage1D GLAD_FUNCTION(glCompressedTexSubImage1D)
 typedef void (APIENTRYP PFNGLGETCOMPRESSEDTEXIMAGEPROC)(GLenum target, GLint level, void *img);
 GLAPI PFNGLGETCOMPRESSEDTEXIMAGEPROC glad_glGetCompressedTexImage;
 GLAPI PFNGLGETCOMPRESSEDTEXIMAGEPROC glad_debug_glGetCompressedTexImage;
-#define glGetCompressedTexImage glad_debug_glGetCompressedTexImage
+#define glGetCompressedTexImage GLAD_FUNCTION(glGetCompressedTexImage)
 #endif
 #ifndef GL_VERSION_1_4
 #define GL_VERSION_1_4 1
@@ -1325,39 +1334,39 @@ GLAPI int GLAD_GL_VERSION_1_4;
 typedef void (APIENTRYP PFNGLBLENDFUNCSEPARATEPROC)(GLenum sfactorRGB, GLenum dfactorRGB, GLenum sfactorAlpha, GLenum dfactorAlpha);
 GLAPI PFNGLBLENDFUNCSEPARATEPROC glad_glBlendFuncSeparate;
 GLAPI PFNGLBLENDFUNCSEPARATEPROC glad_debug_glBlendFuncSeparate;
-#define glBlendFuncSeparate glad_debug_glBlendFuncSeparate
+#define glBlendFuncSeparate GLAD_FUNCTION(glBlendFuncSeparate)
 typedef void (APIENTRYP PFNGLMULTIDRAWARRAYSPROC)(GLenum mode, const GLint *first, const GLsizei *count, GLsizei drawcount);
 GLAPI PFNGLMULTIDRAWARRAYSPROC glad_glMultiDrawArrays;
 GLAPI PFNGLMULTIDRAWARRAYSPROC glad_debug_glMultiDrawArrays;
-#define glMultiDrawArrays glad_debug_glMultiDrawArrays
+#define glMultiDrawArrays GLAD_FUNCTION(glMultiDrawArrays)
 typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSPROC)(GLenum mode, const GLsizei *count, GLenum type, const void *const*indices, GLsizei drawcount);
 GLAPI PFNGLMULTIDRAWELEMENTSPROC glad_glMultiDrawElements;
 GLAPI PFNGLMULTIDRAWELEMENTSPROC glad_debug_glMultiDrawElements;
-#define glMultiDrawElements glad_debug_glMultiDrawElements
+#define glMultiDrawElements GLAD_FUNCTION(glMultiDrawElements)
 typedef void (APIENTRYP PFNGLPOINTPARAMETERFPROC)(GLenum pname, GLfloat param);
 GLAPI PFNGLPOINTPARAMETERFPROC glad_glPointParameterf;
 GLAPI PFNGLPOINTPARAMETERFPROC glad_debug_glPointParameterf;
-#define glPointParameterf glad_debug_glPointParameterf
+#define glPointParameterf GLAD_FUNCTION(glPointParameterf)
 typedef void (APIENTRYP PFNGLPOINTPARAMETERFVPROC)(GLenum pname, const GLfloat *params);
 GLAPI PFNGLPOINTPARAMETERFVPROC glad_glPointParameterfv;
 GLAPI PFNGLPOINTPARAMETERFVPROC glad_debug_glPointParameterfv;
-#define glPointParameterfv glad_debug_glPointParameterfv
+#define glPointParameterfv GLAD_FUNCTION(glPointParameterfv)
 typedef void (APIENTRYP PFNGLPOINTPARAMETERIPROC)(GLenum pname, GLint param);
 GLAPI PFNGLPOINTPARAMETERIPROC glad_glPointParameteri;
 GLAPI PFNGLPOINTPARAMETERIPROC glad_debug_glPointParameteri;
-#define glPointParameteri glad_debug_glPointParameteri
+#define glPointParameteri GLAD_FUNCTION(glPointParameteri)
 typedef void (APIENTRYP PFNGLPOINTPARAMETERIVPROC)(GLenum pname, const GLint *params);
 GLAPI PFNGLPOINTPARAMETERIVPROC glad_glPointParameteriv;
 GLAPI PFNGLPOINTPARAMETERIVPROC glad_debug_glPointParameteriv;
-#define glPointParameteriv glad_debug_glPointParameteriv
+#define glPointParameteriv GLAD_FUNCTION(glPointParameteriv)
 typedef void (APIENTRYP PFNGLBLENDCOLORPROC)(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
 GLAPI PFNGLBLENDCOLORPROC glad_glBlendColor;
 GLAPI PFNGLBLENDCOLORPROC glad_debug_glBlendColor;
-#define glBlendColor glad_debug_glBlendColor
+#define glBlendColor GLAD_FUNCTION(glBlendColor)
 typedef void (APIENTRYP PFNGLBLENDEQUATIONPROC)(GLenum mode);
 GLAPI PFNGLBLENDEQUATIONPROC glad_glBlendEquation;
 GLAPI PFNGLBLENDEQUATIONPROC glad_debug_glBlendEquation;
-#define glBlendEquation glad_debug_glBlendEquation
+#define glBlendEquation GLAD_FUNCTION(glBlendEquation)
 #endif
 #ifndef GL_VERSION_1_5
 #define GL_VERSION_1_5 1
@@ -1365,79 +1374,79 @@ GLAPI int GLAD_GL_VERSION_1_5;
 typedef void (APIENTRYP PFNGLGENQUERIESPROC)(GLsizei n, GLuint *ids);
 GLAPI PFNGLGENQUERIESPROC glad_glGenQueries;
 GLAPI PFNGLGENQUERIESPROC glad_debug_glGenQueries;
-#define glGenQueries glad_debug_glGenQueries
+#define glGenQueries GLAD_FUNCTION(glGenQueries)
 typedef void (APIENTRYP PFNGLDELETEQUERIESPROC)(GLsizei n, const GLuint *ids);
 GLAPI PFNGLDELETEQUERIESPROC glad_glDeleteQueries;
 GLAPI PFNGLDELETEQUERIESPROC glad_debug_glDeleteQueries;
-#define glDeleteQueries glad_debug_glDeleteQueries
+#define glDeleteQueries GLAD_FUNCTION(glDeleteQueries)
 typedef GLboolean (APIENTRYP PFNGLISQUERYPROC)(GLuint id);
 GLAPI PFNGLISQUERYPROC glad_glIsQuery;
 GLAPI PFNGLISQUERYPROC glad_debug_glIsQuery;
-#define glIsQuery glad_debug_glIsQuery
+#define glIsQuery GLAD_FUNCTION(glIsQuery)
 typedef void (APIENTRYP PFNGLBEGINQUERYPROC)(GLenum target, GLuint id);
 GLAPI PFNGLBEGINQUERYPROC glad_glBeginQuery;
 GLAPI PFNGLBEGINQUERYPROC glad_debug_glBeginQuery;
-#define glBeginQuery glad_debug_glBeginQuery
+#define glBeginQuery GLAD_FUNCTION(glBeginQuery)
 typedef void (APIENTRYP PFNGLENDQUERYPROC)(GLenum target);
 GLAPI PFNGLENDQUERYPROC glad_glEndQuery;
 GLAPI PFNGLENDQUERYPROC glad_debug_glEndQuery;
-#define glEndQuery glad_debug_glEndQuery
+#define glEndQuery GLAD_FUNCTION(glEndQuery)
 typedef void (APIENTRYP PFNGLGETQUERYIVPROC)(GLenum target, GLenum pname, GLint *params);
 GLAPI PFNGLGETQUERYIVPROC glad_glGetQueryiv;
 GLAPI PFNGLGETQUERYIVPROC glad_debug_glGetQueryiv;
-#define glGetQueryiv glad_debug_glGetQueryiv
+#define glGetQueryiv GLAD_FUNCTION(glGetQueryiv)
 typedef void (APIENTRYP PFNGLGETQUERYOBJECTIVPROC)(GLuint id, GLenum pname, GLint *params);
 GLAPI PFNGLGETQUERYOBJECTIVPROC glad_glGetQueryObjectiv;
 GLAPI PFNGLGETQUERYOBJECTIVPROC glad_debug_glGetQueryObjectiv;
-#define glGetQueryObjectiv glad_debug_glGetQueryObjectiv
+#define glGetQueryObjectiv GLAD_FUNCTION(glGetQueryObjectiv)
 typedef void (APIENTRYP PFNGLGETQUERYOBJECTUIVPROC)(GLuint id, GLenum pname, GLuint *params);
 GLAPI PFNGLGETQUERYOBJECTUIVPROC glad_glGetQueryObjectuiv;
 GLAPI PFNGLGETQUERYOBJECTUIVPROC glad_debug_glGetQueryObjectuiv;
-#define glGetQueryObjectuiv glad_debug_glGetQueryObjectuiv
+#define glGetQueryObjectuiv GLAD_FUNCTION(glGetQueryObjectuiv)
 typedef void (APIENTRYP PFNGLBINDBUFFERPROC)(GLenum target, GLuint buffer);
 GLAPI PFNGLBINDBUFFERPROC glad_glBindBuffer;
 GLAPI PFNGLBINDBUFFERPROC glad_debug_glBindBuffer;
-#define glBindBuffer glad_debug_glBindBuffer
+#define glBindBuffer GLAD_FUNCTION(glBindBuffer)
 typedef void (APIENTRYP PFNGLDELETEBUFFERSPROC)(GLsizei n, const GLuint *buffers);
 GLAPI PFNGLDELETEBUFFERSPROC glad_glDeleteBuffers;
 GLAPI PFNGLDELETEBUFFERSPROC glad_debug_glDeleteBuffers;
-#define glDeleteBuffers glad_debug_glDeleteBuffers
+#define glDeleteBuffers GLAD_FUNCTION(glDeleteBuffers)
 typedef void (APIENTRYP PFNGLGENBUFFERSPROC)(GLsizei n, GLuint *buffers);
 GLAPI PFNGLGENBUFFERSPROC glad_glGenBuffers;
 GLAPI PFNGLGENBUFFERSPROC glad_debug_glGenBuffers;
-#define glGenBuffers glad_debug_glGenBuffers
+#define glGenBuffers GLAD_FUNCTION(glGenBuffers)
 typedef GLboolean (APIENTRYP PFNGLISBUFFERPROC)(GLuint buffer);
 GLAPI PFNGLISBUFFERPROC glad_glIsBuffer;
 GLAPI PFNGLISBUFFERPROC glad_debug_glIsBuffer;
-#define glIsBuffer glad_debug_glIsBuffer
+#define glIsBuffer GLAD_FUNCTION(glIsBuffer)
 typedef void (APIENTRYP PFNGLBUFFERDATAPROC)(GLenum target, GLsizeiptr size, const void *data, GLenum usage);
 GLAPI PFNGLBUFFERDATAPROC glad_glBufferData;
 GLAPI PFNGLBUFFERDATAPROC glad_debug_glBufferData;
-#define glBufferData glad_debug_glBufferData
+#define glBufferData GLAD_FUNCTION(glBufferData)
 typedef void (APIENTRYP PFNGLBUFFERSUBDATAPROC)(GLenum target, GLintptr offset, GLsizeiptr size, const void *data);
 GLAPI PFNGLBUFFERSUBDATAPROC glad_glBufferSubData;
 GLAPI PFNGLBUFFERSUBDATAPROC glad_debug_glBufferSubData;
-#define glBufferSubData glad_debug_glBufferSubData
+#define glBufferSubData GLAD_FUNCTION(glBufferSubData)
 typedef void (APIENTRYP PFNGLGETBUFFERSUBDATAPROC)(GLenum target, GLintptr offset, GLsizeiptr size, void *data);
 GLAPI PFNGLGETBUFFERSUBDATAPROC glad_glGetBufferSubData;
 GLAPI PFNGLGETBUFFERSUBDATAPROC glad_debug_glGetBufferSubData;
-#define glGetBufferSubData glad_debug_glGetBufferSubData
+#define glGetBufferSubData GLAD_FUNCTION(glGetBufferSubData)
 typedef void * (APIENTRYP PFNGLMAPBUFFERPROC)(GLenum target, GLenum access);
 GLAPI PFNGLMAPBUFFERPROC glad_glMapBuffer;
 GLAPI PFNGLMAPBUFFERPROC glad_debug_glMapBuffer;
-#define glMapBuffer glad_debug_glMapBuffer
+#define glMapBuffer GLAD_FUNCTION(glMapBuffer)
 typedef GLboolean (APIENTRYP PFNGLUNMAPBUFFERPROC)(GLenum target);
 GLAPI PFNGLUNMAPBUFFERPROC glad_glUnmapBuffer;
 GLAPI PFNGLUNMAPBUFFERPROC glad_debug_glUnmapBuffer;
-#define glUnmapBuffer glad_debug_glUnmapBuffer
+#define glUnmapBuffer GLAD_FUNCTION(glUnmapBuffer)
 typedef void (APIENTRYP PFNGLGETBUFFERPARAMETERIVPROC)(GLenum target, GLenum pname, GLint *params);
 GLAPI PFNGLGETBUFFERPARAMETERIVPROC glad_glGetBufferParameteriv;
 GLAPI PFNGLGETBUFFERPARAMETERIVPROC glad_debug_glGetBufferParameteriv;
-#define glGetBufferParameteriv glad_debug_glGetBufferParameteriv
+#define glGetBufferParameteriv GLAD_FUNCTION(glGetBufferParameteriv)
 typedef void (APIENTRYP PFNGLGETBUFFERPOINTERVPROC)(GLenum target, GLenum pname, void **params);
 GLAPI PFNGLGETBUFFERPOINTERVPROC glad_glGetBufferPointerv;
 GLAPI PFNGLGETBUFFERPOINTERVPROC glad_debug_glGetBufferPointerv;
-#define glGetBufferPointerv glad_debug_glGetBufferPointerv
+#define glGetBufferPointerv GLAD_FUNCTION(glGetBufferPointerv)
 #endif
 #ifndef GL_VERSION_2_0
 #define GL_VERSION_2_0 1
@@ -1445,375 +1454,375 @@ GLAPI int GLAD_GL_VERSION_2_0;
 typedef void (APIENTRYP PFNGLBLENDEQUATIONSEPARATEPROC)(GLenum modeRGB, GLenum modeAlpha);
 GLAPI PFNGLBLENDEQUATIONSEPARATEPROC glad_glBlendEquationSeparate;
 GLAPI PFNGLBLENDEQUATIONSEPARATEPROC glad_debug_glBlendEquationSeparate;
-#define glBlendEquationSeparate glad_debug_glBlendEquationSeparate
+#define glBlendEquationSeparate GLAD_FUNCTION(glBlendEquationSeparate)
 typedef void (APIENTRYP PFNGLDRAWBUFFERSPROC)(GLsizei n, const GLenum *bufs);
 GLAPI PFNGLDRAWBUFFERSPROC glad_glDrawBuffers;
 GLAPI PFNGLDRAWBUFFERSPROC glad_debug_glDrawBuffers;
-#define glDrawBuffers glad_debug_glDrawBuffers
+#define glDrawBuffers GLAD_FUNCTION(glDrawBuffers)
 typedef void (APIENTRYP PFNGLSTENCILOPSEPARATEPROC)(GLenum face, GLenum sfail, GLenum dpfail, GLenum dppass);
 GLAPI PFNGLSTENCILOPSEPARATEPROC glad_glStencilOpSeparate;
 GLAPI PFNGLSTENCILOPSEPARATEPROC glad_debug_glStencilOpSeparate;
-#define glStencilOpSeparate glad_debug_glStencilOpSeparate
+#define glStencilOpSeparate GLAD_FUNCTION(glStencilOpSeparate)
 typedef void (APIENTRYP PFNGLSTENCILFUNCSEPARATEPROC)(GLenum face, GLenum func, GLint ref, GLuint mask);
 GLAPI PFNGLSTENCILFUNCSEPARATEPROC glad_glStencilFuncSeparate;
 GLAPI PFNGLSTENCILFUNCSEPARATEPROC glad_debug_glStencilFuncSeparate;
-#define glStencilFuncSeparate glad_debug_glStencilFuncSeparate
+#define glStencilFuncSeparate GLAD_FUNCTION(glStencilFuncSeparate)
 typedef void (APIENTRYP PFNGLSTENCILMASKSEPARATEPROC)(GLenum face, GLuint mask);
 GLAPI PFNGLSTENCILMASKSEPARATEPROC glad_glStencilMaskSeparate;
 GLAPI PFNGLSTENCILMASKSEPARATEPROC glad_debug_glStencilMaskSeparate;
-#define glStencilMaskSeparate glad_debug_glStencilMaskSeparate
+#define glStencilMaskSeparate GLAD_FUNCTION(glStencilMaskSeparate)
 typedef void (APIENTRYP PFNGLATTACHSHADERPROC)(GLuint program, GLuint shader);
 GLAPI PFNGLATTACHSHADERPROC glad_glAttachShader;
 GLAPI PFNGLATTACHSHADERPROC glad_debug_glAttachShader;
-#define glAttachShader glad_debug_glAttachShader
+#define glAttachShader GLAD_FUNCTION(glAttachShader)
 typedef void (APIENTRYP PFNGLBINDATTRIBLOCATIONPROC)(GLuint program, GLuint index, const GLchar *name);
 GLAPI PFNGLBINDATTRIBLOCATIONPROC glad_glBindAttribLocation;
 GLAPI PFNGLBINDATTRIBLOCATIONPROC glad_debug_glBindAttribLocation;
-#define glBindAttribLocation glad_debug_glBindAttribLocation
+#define glBindAttribLocation GLAD_FUNCTION(glBindAttribLocation)
 typedef void (APIENTRYP PFNGLCOMPILESHADERPROC)(GLuint shader);
 GLAPI PFNGLCOMPILESHADERPROC glad_glCompileShader;
 GLAPI PFNGLCOMPILESHADERPROC glad_debug_glCompileShader;
-#define glCompileShader glad_debug_glCompileShader
+#define glCompileShader GLAD_FUNCTION(glCompileShader)
 typedef GLuint (APIENTRYP PFNGLCREATEPROGRAMPROC)();
 GLAPI PFNGLCREATEPROGRAMPROC glad_glCreateProgram;
 GLAPI PFNGLCREATEPROGRAMPROC glad_debug_glCreateProgram;
-#define glCreateProgram glad_debug_glCreateProgram
+#define glCreateProgram GLAD_FUNCTION(glCreateProgram)
 typedef GLuint (APIENTRYP PFNGLCREATESHADERPROC)(GLenum type);
 GLAPI PFNGLCREATESHADERPROC glad_glCreateShader;
 GLAPI PFNGLCREATESHADERPROC glad_debug_glCreateShader;
-#define glCreateShader glad_debug_glCreateShader
+#define glCreateShader GLAD_FUNCTION(glCreateShader)
 typedef void (APIENTRYP PFNGLDELETEPROGRAMPROC)(GLuint program);
 GLAPI PFNGLDELETEPROGRAMPROC glad_glDeleteProgram;
 GLAPI PFNGLDELETEPROGRAMPROC glad_debug_glDeleteProgram;
-#define glDeleteProgram glad_debug_glDeleteProgram
+#define glDeleteProgram GLAD_FUNCTION(glDeleteProgram)
 typedef void (APIENTRYP PFNGLDELETESHADERPROC)(GLuint shader);
 GLAPI PFNGLDELETESHADERPROC glad_glDeleteShader;
 GLAPI PFNGLDELETESHADERPROC glad_debug_glDeleteShader;
-#define glDeleteShader glad_debug_glDeleteShader
+#define glDeleteShader GLAD_FUNCTION(glDeleteShader)
 typedef void (APIENTRYP PFNGLDETACHSHADERPROC)(GLuint program, GLuint shader);
 GLAPI PFNGLDETACHSHADERPROC glad_glDetachShader;
 GLAPI PFNGLDETACHSHADERPROC glad_debug_glDetachShader;
-#define glDetachShader glad_debug_glDetachShader
+#define glDetachShader GLAD_FUNCTION(glDetachShader)
 typedef void (APIENTRYP PFNGLDISABLEVERTEXATTRIBARRAYPROC)(GLuint index);
 GLAPI PFNGLDISABLEVERTEXATTRIBARRAYPROC glad_glDisableVertexAttribArray;
 GLAPI PFNGLDISABLEVERTEXATTRIBARRAYPROC glad_debug_glDisableVertexAttribArray;
-#define glDisableVertexAttribArray glad_debug_glDisableVertexAttribArray
+#define glDisableVertexAttribArray GLAD_FUNCTION(glDisableVertexAttribArray)
 typedef void (APIENTRYP PFNGLENABLEVERTEXATTRIBARRAYPROC)(GLuint index);
 GLAPI PFNGLENABLEVERTEXATTRIBARRAYPROC glad_glEnableVertexAttribArray;
 GLAPI PFNGLENABLEVERTEXATTRIBARRAYPROC glad_debug_glEnableVertexAttribArray;
-#define glEnableVertexAttribArray glad_debug_glEnableVertexAttribArray
+#define glEnableVertexAttribArray GLAD_FUNCTION(glEnableVertexAttribArray)
 typedef void (APIENTRYP PFNGLGETACTIVEATTRIBPROC)(GLuint program, GLuint index, GLsizei bufSize, GLsizei *length, GLint *size, GLenum *type, GLchar *name);
 GLAPI PFNGLGETACTIVEATTRIBPROC glad_glGetActiveAttrib;
 GLAPI PFNGLGETACTIVEATTRIBPROC glad_debug_glGetActiveAttrib;
-#define glGetActiveAttrib glad_debug_glGetActiveAttrib
+#define glGetActiveAttrib GLAD_FUNCTION(glGetActiveAttrib)
 typedef void (APIENTRYP PFNGLGETACTIVEUNIFORMPROC)(GLuint program, GLuint index, GLsizei bufSize, GLsizei *length, GLint *size, GLenum *type, GLchar *name);
 GLAPI PFNGLGETACTIVEUNIFORMPROC glad_glGetActiveUniform;
 GLAPI PFNGLGETACTIVEUNIFORMPROC glad_debug_glGetActiveUniform;
-#define glGetActiveUniform glad_debug_glGetActiveUniform
+#define glGetActiveUniform GLAD_FUNCTION(glGetActiveUniform)
 typedef void (APIENTRYP PFNGLGETATTACHEDSHADERSPROC)(GLuint program, GLsizei maxCount, GLsizei *count, GLuint *shaders);
 GLAPI PFNGLGETATTACHEDSHADERSPROC glad_glGetAttachedShaders;
 GLAPI PFNGLGETATTACHEDSHADERSPROC glad_debug_glGetAttachedShaders;
-#define glGetAttachedShaders glad_debug_glGetAttachedShaders
+#define glGetAttachedShaders GLAD_FUNCTION(glGetAttachedShaders)
 typedef GLint (APIENTRYP PFNGLGETATTRIBLOCATIONPROC)(GLuint program, const GLchar *name);
 GLAPI PFNGLGETATTRIBLOCATIONPROC glad_glGetAttribLocation;
 GLAPI PFNGLGETATTRIBLOCATIONPROC glad_debug_glGetAttribLocation;
-#define glGetAttribLocation glad_debug_glGetAttribLocation
+#define glGetAttribLocation GLAD_FUNCTION(glGetAttribLocation)
 typedef void (APIENTRYP PFNGLGETPROGRAMIVPROC)(GLuint program, GLenum pname, GLint *params);
 GLAPI PFNGLGETPROGRAMIVPROC glad_glGetProgramiv;
 GLAPI PFNGLGETPROGRAMIVPROC glad_debug_glGetProgramiv;
-#define glGetProgramiv glad_debug_glGetProgramiv
+#define glGetProgramiv GLAD_FUNCTION(glGetProgramiv)
 typedef void (APIENTRYP PFNGLGETPROGRAMINFOLOGPROC)(GLuint program, GLsizei bufSize, GLsizei *length, GLchar *infoLog);
 GLAPI PFNGLGETPROGRAMINFOLOGPROC glad_glGetProgramInfoLog;
 GLAPI PFNGLGETPROGRAMINFOLOGPROC glad_debug_glGetProgramInfoLog;
-#define glGetProgramInfoLog glad_debug_glGetProgramInfoLog
+#define glGetProgramInfoLog GLAD_FUNCTION(glGetProgramInfoLog)
 typedef void (APIENTRYP PFNGLGETSHADERIVPROC)(GLuint shader, GLenum pname, GLint *params);
 GLAPI PFNGLGETSHADERIVPROC glad_glGetShaderiv;
 GLAPI PFNGLGETSHADERIVPROC glad_debug_glGetShaderiv;
-#define glGetShaderiv glad_debug_glGetShaderiv
+#define glGetShaderiv GLAD_FUNCTION(glGetShaderiv)
 typedef void (APIENTRYP PFNGLGETSHADERINFOLOGPROC)(GLuint shader, GLsizei bufSize, GLsizei *length, GLchar *infoLog);
 GLAPI PFNGLGETSHADERINFOLOGPROC glad_glGetShaderInfoLog;
 GLAPI PFNGLGETSHADERINFOLOGPROC glad_debug_glGetShaderInfoLog;
-#define glGetShaderInfoLog glad_debug_glGetShaderInfoLog
+#define glGetShaderInfoLog GLAD_FUNCTION(glGetShaderInfoLog)
 typedef void (APIENTRYP PFNGLGETSHADERSOURCEPROC)(GLuint shader, GLsizei bufSize, GLsizei *length, GLchar *source);
 GLAPI PFNGLGETSHADERSOURCEPROC glad_glGetShaderSource;
 GLAPI PFNGLGETSHADERSOURCEPROC glad_debug_glGetShaderSource;
-#define glGetShaderSource glad_debug_glGetShaderSource
+#define glGetShaderSource GLAD_FUNCTION(glGetShaderSource)
 typedef GLint (APIENTRYP PFNGLGETUNIFORMLOCATIONPROC)(GLuint program, const GLchar *name);
 GLAPI PFNGLGETUNIFORMLOCATIONPROC glad_glGetUniformLocation;
 GLAPI PFNGLGETUNIFORMLOCATIONPROC glad_debug_glGetUniformLocation;
-#define glGetUniformLocation glad_debug_glGetUniformLocation
+#define glGetUniformLocation GLAD_FUNCTION(glGetUniformLocation)
 typedef void (APIENTRYP PFNGLGETUNIFORMFVPROC)(GLuint program, GLint location, GLfloat *params);
 GLAPI PFNGLGETUNIFORMFVPROC glad_glGetUniformfv;
 GLAPI PFNGLGETUNIFORMFVPROC glad_debug_glGetUniformfv;
-#define glGetUniformfv glad_debug_glGetUniformfv
+#define glGetUniformfv GLAD_FUNCTION(glGetUniformfv)
 typedef void (APIENTRYP PFNGLGETUNIFORMIVPROC)(GLuint program, GLint location, GLint *params);
 GLAPI PFNGLGETUNIFORMIVPROC glad_glGetUniformiv;
 GLAPI PFNGLGETUNIFORMIVPROC glad_debug_glGetUniformiv;
-#define glGetUniformiv glad_debug_glGetUniformiv
+#define glGetUniformiv GLAD_FUNCTION(glGetUniformiv)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBDVPROC)(GLuint index, GLenum pname, GLdouble *params);
 GLAPI PFNGLGETVERTEXATTRIBDVPROC glad_glGetVertexAttribdv;
 GLAPI PFNGLGETVERTEXATTRIBDVPROC glad_debug_glGetVertexAttribdv;
-#define glGetVertexAttribdv glad_debug_glGetVertexAttribdv
+#define glGetVertexAttribdv GLAD_FUNCTION(glGetVertexAttribdv)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBFVPROC)(GLuint index, GLenum pname, GLfloat *params);
 GLAPI PFNGLGETVERTEXATTRIBFVPROC glad_glGetVertexAttribfv;
 GLAPI PFNGLGETVERTEXATTRIBFVPROC glad_debug_glGetVertexAttribfv;
-#define glGetVertexAttribfv glad_debug_glGetVertexAttribfv
+#define glGetVertexAttribfv GLAD_FUNCTION(glGetVertexAttribfv)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBIVPROC)(GLuint index, GLenum pname, GLint *params);
 GLAPI PFNGLGETVERTEXATTRIBIVPROC glad_glGetVertexAttribiv;
 GLAPI PFNGLGETVERTEXATTRIBIVPROC glad_debug_glGetVertexAttribiv;
-#define glGetVertexAttribiv glad_debug_glGetVertexAttribiv
+#define glGetVertexAttribiv GLAD_FUNCTION(glGetVertexAttribiv)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBPOINTERVPROC)(GLuint index, GLenum pname, void **pointer);
 GLAPI PFNGLGETVERTEXATTRIBPOINTERVPROC glad_glGetVertexAttribPointerv;
 GLAPI PFNGLGETVERTEXATTRIBPOINTERVPROC glad_debug_glGetVertexAttribPointerv;
-#define glGetVertexAttribPointerv glad_debug_glGetVertexAttribPointerv
+#define glGetVertexAttribPointerv GLAD_FUNCTION(glGetVertexAttribPointerv)
 typedef GLboolean (APIENTRYP PFNGLISPROGRAMPROC)(GLuint program);
 GLAPI PFNGLISPROGRAMPROC glad_glIsProgram;
 GLAPI PFNGLISPROGRAMPROC glad_debug_glIsProgram;
-#define glIsProgram glad_debug_glIsProgram
+#define glIsProgram GLAD_FUNCTION(glIsProgram)
 typedef GLboolean (APIENTRYP PFNGLISSHADERPROC)(GLuint shader);
 GLAPI PFNGLISSHADERPROC glad_glIsShader;
 GLAPI PFNGLISSHADERPROC glad_debug_glIsShader;
-#define glIsShader glad_debug_glIsShader
+#define glIsShader GLAD_FUNCTION(glIsShader)
 typedef void (APIENTRYP PFNGLLINKPROGRAMPROC)(GLuint program);
 GLAPI PFNGLLINKPROGRAMPROC glad_glLinkProgram;
 GLAPI PFNGLLINKPROGRAMPROC glad_debug_glLinkProgram;
-#define glLinkProgram glad_debug_glLinkProgram
+#define glLinkProgram GLAD_FUNCTION(glLinkProgram)
 typedef void (APIENTRYP PFNGLSHADERSOURCEPROC)(GLuint shader, GLsizei count, const GLchar *const*string, const GLint *length);
 GLAPI PFNGLSHADERSOURCEPROC glad_glShaderSource;
 GLAPI PFNGLSHADERSOURCEPROC glad_debug_glShaderSource;
-#define glShaderSource glad_debug_glShaderSource
+#define glShaderSource GLAD_FUNCTION(glShaderSource)
 typedef void (APIENTRYP PFNGLUSEPROGRAMPROC)(GLuint program);
 GLAPI PFNGLUSEPROGRAMPROC glad_glUseProgram;
 GLAPI PFNGLUSEPROGRAMPROC glad_debug_glUseProgram;
-#define glUseProgram glad_debug_glUseProgram
+#define glUseProgram GLAD_FUNCTION(glUseProgram)
 typedef void (APIENTRYP PFNGLUNIFORM1FPROC)(GLint location, GLfloat v0);
 GLAPI PFNGLUNIFORM1FPROC glad_glUniform1f;
 GLAPI PFNGLUNIFORM1FPROC glad_debug_glUniform1f;
-#define glUniform1f glad_debug_glUniform1f
+#define glUniform1f GLAD_FUNCTION(glUniform1f)
 typedef void (APIENTRYP PFNGLUNIFORM2FPROC)(GLint location, GLfloat v0, GLfloat v1);
 GLAPI PFNGLUNIFORM2FPROC glad_glUniform2f;
 GLAPI PFNGLUNIFORM2FPROC glad_debug_glUniform2f;
-#define glUniform2f glad_debug_glUniform2f
+#define glUniform2f GLAD_FUNCTION(glUniform2f)
 typedef void (APIENTRYP PFNGLUNIFORM3FPROC)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2);
 GLAPI PFNGLUNIFORM3FPROC glad_glUniform3f;
 GLAPI PFNGLUNIFORM3FPROC glad_debug_glUniform3f;
-#define glUniform3f glad_debug_glUniform3f
+#define glUniform3f GLAD_FUNCTION(glUniform3f)
 typedef void (APIENTRYP PFNGLUNIFORM4FPROC)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3);
 GLAPI PFNGLUNIFORM4FPROC glad_glUniform4f;
 GLAPI PFNGLUNIFORM4FPROC glad_debug_glUniform4f;
-#define glUniform4f glad_debug_glUniform4f
+#define glUniform4f GLAD_FUNCTION(glUniform4f)
 typedef void (APIENTRYP PFNGLUNIFORM1IPROC)(GLint location, GLint v0);
 GLAPI PFNGLUNIFORM1IPROC glad_glUniform1i;
 GLAPI PFNGLUNIFORM1IPROC glad_debug_glUniform1i;
-#define glUniform1i glad_debug_glUniform1i
+#define glUniform1i GLAD_FUNCTION(glUniform1i)
 typedef void (APIENTRYP PFNGLUNIFORM2IPROC)(GLint location, GLint v0, GLint v1);
 GLAPI PFNGLUNIFORM2IPROC glad_glUniform2i;
 GLAPI PFNGLUNIFORM2IPROC glad_debug_glUniform2i;
-#define glUniform2i glad_debug_glUniform2i
+#define glUniform2i GLAD_FUNCTION(glUniform2i)
 typedef void (APIENTRYP PFNGLUNIFORM3IPROC)(GLint location, GLint v0, GLint v1, GLint v2);
 GLAPI PFNGLUNIFORM3IPROC glad_glUniform3i;
 GLAPI PFNGLUNIFORM3IPROC glad_debug_glUniform3i;
-#define glUniform3i glad_debug_glUniform3i
+#define glUniform3i GLAD_FUNCTION(glUniform3i)
 typedef void (APIENTRYP PFNGLUNIFORM4IPROC)(GLint location, GLint v0, GLint v1, GLint v2, GLint v3);
 GLAPI PFNGLUNIFORM4IPROC glad_glUniform4i;
 GLAPI PFNGLUNIFORM4IPROC glad_debug_glUniform4i;
-#define glUniform4i glad_debug_glUniform4i
+#define glUniform4i GLAD_FUNCTION(glUniform4i)
 typedef void (APIENTRYP PFNGLUNIFORM1FVPROC)(GLint location, GLsizei count, const GLfloat *value);
 GLAPI PFNGLUNIFORM1FVPROC glad_glUniform1fv;
 GLAPI PFNGLUNIFORM1FVPROC glad_debug_glUniform1fv;
-#define glUniform1fv glad_debug_glUniform1fv
+#define glUniform1fv GLAD_FUNCTION(glUniform1fv)
 typedef void (APIENTRYP PFNGLUNIFORM2FVPROC)(GLint location, GLsizei count, const GLfloat *value);
 GLAPI PFNGLUNIFORM2FVPROC glad_glUniform2fv;
 GLAPI PFNGLUNIFORM2FVPROC glad_debug_glUniform2fv;
-#define glUniform2fv glad_debug_glUniform2fv
+#define glUniform2fv GLAD_FUNCTION(glUniform2fv)
 typedef void (APIENTRYP PFNGLUNIFORM3FVPROC)(GLint location, GLsizei count, const GLfloat *value);
 GLAPI PFNGLUNIFORM3FVPROC glad_glUniform3fv;
 GLAPI PFNGLUNIFORM3FVPROC glad_debug_glUniform3fv;
-#define glUniform3fv glad_debug_glUniform3fv
+#define glUniform3fv GLAD_FUNCTION(glUniform3fv)
 typedef void (APIENTRYP PFNGLUNIFORM4FVPROC)(GLint location, GLsizei count, const GLfloat *value);
 GLAPI PFNGLUNIFORM4FVPROC glad_glUniform4fv;
 GLAPI PFNGLUNIFORM4FVPROC glad_debug_glUniform4fv;
-#define glUniform4fv glad_debug_glUniform4fv
+#define glUniform4fv GLAD_FUNCTION(glUniform4fv)
 typedef void (APIENTRYP PFNGLUNIFORM1IVPROC)(GLint location, GLsizei count, const GLint *value);
 GLAPI PFNGLUNIFORM1IVPROC glad_glUniform1iv;
 GLAPI PFNGLUNIFORM1IVPROC glad_debug_glUniform1iv;
-#define glUniform1iv glad_debug_glUniform1iv
+#define glUniform1iv GLAD_FUNCTION(glUniform1iv)
 typedef void (APIENTRYP PFNGLUNIFORM2IVPROC)(GLint location, GLsizei count, const GLint *value);
 GLAPI PFNGLUNIFORM2IVPROC glad_glUniform2iv;
 GLAPI PFNGLUNIFORM2IVPROC glad_debug_glUniform2iv;
-#define glUniform2iv glad_debug_glUniform2iv
+#define glUniform2iv GLAD_FUNCTION(glUniform2iv)
 typedef void (APIENTRYP PFNGLUNIFORM3IVPROC)(GLint location, GLsizei count, const GLint *value);
 GLAPI PFNGLUNIFORM3IVPROC glad_glUniform3iv;
 GLAPI PFNGLUNIFORM3IVPROC glad_debug_glUniform3iv;
-#define glUniform3iv glad_debug_glUniform3iv
+#define glUniform3iv GLAD_FUNCTION(glUniform3iv)
 typedef void (APIENTRYP PFNGLUNIFORM4IVPROC)(GLint location, GLsizei count, const GLint *value);
 GLAPI PFNGLUNIFORM4IVPROC glad_glUniform4iv;
 GLAPI PFNGLUNIFORM4IVPROC glad_debug_glUniform4iv;
-#define glUniform4iv glad_debug_glUniform4iv
+#define glUniform4iv GLAD_FUNCTION(glUniform4iv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX2FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX2FVPROC glad_glUniformMatrix2fv;
 GLAPI PFNGLUNIFORMMATRIX2FVPROC glad_debug_glUniformMatrix2fv;
-#define glUniformMatrix2fv glad_debug_glUniformMatrix2fv
+#define glUniformMatrix2fv GLAD_FUNCTION(glUniformMatrix2fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX3FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX3FVPROC glad_glUniformMatrix3fv;
 GLAPI PFNGLUNIFORMMATRIX3FVPROC glad_debug_glUniformMatrix3fv;
-#define glUniformMatrix3fv glad_debug_glUniformMatrix3fv
+#define glUniformMatrix3fv GLAD_FUNCTION(glUniformMatrix3fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX4FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX4FVPROC glad_glUniformMatrix4fv;
 GLAPI PFNGLUNIFORMMATRIX4FVPROC glad_debug_glUniformMatrix4fv;
-#define glUniformMatrix4fv glad_debug_glUniformMatrix4fv
+#define glUniformMatrix4fv GLAD_FUNCTION(glUniformMatrix4fv)
 typedef void (APIENTRYP PFNGLVALIDATEPROGRAMPROC)(GLuint program);
 GLAPI PFNGLVALIDATEPROGRAMPROC glad_glValidateProgram;
 GLAPI PFNGLVALIDATEPROGRAMPROC glad_debug_glValidateProgram;
-#define glValidateProgram glad_debug_glValidateProgram
+#define glValidateProgram GLAD_FUNCTION(glValidateProgram)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1DPROC)(GLuint index, GLdouble x);
 GLAPI PFNGLVERTEXATTRIB1DPROC glad_glVertexAttrib1d;
 GLAPI PFNGLVERTEXATTRIB1DPROC glad_debug_glVertexAttrib1d;
-#define glVertexAttrib1d glad_debug_glVertexAttrib1d
+#define glVertexAttrib1d GLAD_FUNCTION(glVertexAttrib1d)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1DVPROC)(GLuint index, const GLdouble *v);
 GLAPI PFNGLVERTEXATTRIB1DVPROC glad_glVertexAttrib1dv;
 GLAPI PFNGLVERTEXATTRIB1DVPROC glad_debug_glVertexAttrib1dv;
-#define glVertexAttrib1dv glad_debug_glVertexAttrib1dv
+#define glVertexAttrib1dv GLAD_FUNCTION(glVertexAttrib1dv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1FPROC)(GLuint index, GLfloat x);
 GLAPI PFNGLVERTEXATTRIB1FPROC glad_glVertexAttrib1f;
 GLAPI PFNGLVERTEXATTRIB1FPROC glad_debug_glVertexAttrib1f;
-#define glVertexAttrib1f glad_debug_glVertexAttrib1f
+#define glVertexAttrib1f GLAD_FUNCTION(glVertexAttrib1f)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1FVPROC)(GLuint index, const GLfloat *v);
 GLAPI PFNGLVERTEXATTRIB1FVPROC glad_glVertexAttrib1fv;
 GLAPI PFNGLVERTEXATTRIB1FVPROC glad_debug_glVertexAttrib1fv;
-#define glVertexAttrib1fv glad_debug_glVertexAttrib1fv
+#define glVertexAttrib1fv GLAD_FUNCTION(glVertexAttrib1fv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1SPROC)(GLuint index, GLshort x);
 GLAPI PFNGLVERTEXATTRIB1SPROC glad_glVertexAttrib1s;
 GLAPI PFNGLVERTEXATTRIB1SPROC glad_debug_glVertexAttrib1s;
-#define glVertexAttrib1s glad_debug_glVertexAttrib1s
+#define glVertexAttrib1s GLAD_FUNCTION(glVertexAttrib1s)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB1SVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIB1SVPROC glad_glVertexAttrib1sv;
 GLAPI PFNGLVERTEXATTRIB1SVPROC glad_debug_glVertexAttrib1sv;
-#define glVertexAttrib1sv glad_debug_glVertexAttrib1sv
+#define glVertexAttrib1sv GLAD_FUNCTION(glVertexAttrib1sv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2DPROC)(GLuint index, GLdouble x, GLdouble y);
 GLAPI PFNGLVERTEXATTRIB2DPROC glad_glVertexAttrib2d;
 GLAPI PFNGLVERTEXATTRIB2DPROC glad_debug_glVertexAttrib2d;
-#define glVertexAttrib2d glad_debug_glVertexAttrib2d
+#define glVertexAttrib2d GLAD_FUNCTION(glVertexAttrib2d)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2DVPROC)(GLuint index, const GLdouble *v);
 GLAPI PFNGLVERTEXATTRIB2DVPROC glad_glVertexAttrib2dv;
 GLAPI PFNGLVERTEXATTRIB2DVPROC glad_debug_glVertexAttrib2dv;
-#define glVertexAttrib2dv glad_debug_glVertexAttrib2dv
+#define glVertexAttrib2dv GLAD_FUNCTION(glVertexAttrib2dv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2FPROC)(GLuint index, GLfloat x, GLfloat y);
 GLAPI PFNGLVERTEXATTRIB2FPROC glad_glVertexAttrib2f;
 GLAPI PFNGLVERTEXATTRIB2FPROC glad_debug_glVertexAttrib2f;
-#define glVertexAttrib2f glad_debug_glVertexAttrib2f
+#define glVertexAttrib2f GLAD_FUNCTION(glVertexAttrib2f)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2FVPROC)(GLuint index, const GLfloat *v);
 GLAPI PFNGLVERTEXATTRIB2FVPROC glad_glVertexAttrib2fv;
 GLAPI PFNGLVERTEXATTRIB2FVPROC glad_debug_glVertexAttrib2fv;
-#define glVertexAttrib2fv glad_debug_glVertexAttrib2fv
+#define glVertexAttrib2fv GLAD_FUNCTION(glVertexAttrib2fv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2SPROC)(GLuint index, GLshort x, GLshort y);
 GLAPI PFNGLVERTEXATTRIB2SPROC glad_glVertexAttrib2s;
 GLAPI PFNGLVERTEXATTRIB2SPROC glad_debug_glVertexAttrib2s;
-#define glVertexAttrib2s glad_debug_glVertexAttrib2s
+#define glVertexAttrib2s GLAD_FUNCTION(glVertexAttrib2s)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB2SVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIB2SVPROC glad_glVertexAttrib2sv;
 GLAPI PFNGLVERTEXATTRIB2SVPROC glad_debug_glVertexAttrib2sv;
-#define glVertexAttrib2sv glad_debug_glVertexAttrib2sv
+#define glVertexAttrib2sv GLAD_FUNCTION(glVertexAttrib2sv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3DPROC)(GLuint index, GLdouble x, GLdouble y, GLdouble z);
 GLAPI PFNGLVERTEXATTRIB3DPROC glad_glVertexAttrib3d;
 GLAPI PFNGLVERTEXATTRIB3DPROC glad_debug_glVertexAttrib3d;
-#define glVertexAttrib3d glad_debug_glVertexAttrib3d
+#define glVertexAttrib3d GLAD_FUNCTION(glVertexAttrib3d)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3DVPROC)(GLuint index, const GLdouble *v);
 GLAPI PFNGLVERTEXATTRIB3DVPROC glad_glVertexAttrib3dv;
 GLAPI PFNGLVERTEXATTRIB3DVPROC glad_debug_glVertexAttrib3dv;
-#define glVertexAttrib3dv glad_debug_glVertexAttrib3dv
+#define glVertexAttrib3dv GLAD_FUNCTION(glVertexAttrib3dv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3FPROC)(GLuint index, GLfloat x, GLfloat y, GLfloat z);
 GLAPI PFNGLVERTEXATTRIB3FPROC glad_glVertexAttrib3f;
 GLAPI PFNGLVERTEXATTRIB3FPROC glad_debug_glVertexAttrib3f;
-#define glVertexAttrib3f glad_debug_glVertexAttrib3f
+#define glVertexAttrib3f GLAD_FUNCTION(glVertexAttrib3f)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3FVPROC)(GLuint index, const GLfloat *v);
 GLAPI PFNGLVERTEXATTRIB3FVPROC glad_glVertexAttrib3fv;
 GLAPI PFNGLVERTEXATTRIB3FVPROC glad_debug_glVertexAttrib3fv;
-#define glVertexAttrib3fv glad_debug_glVertexAttrib3fv
+#define glVertexAttrib3fv GLAD_FUNCTION(glVertexAttrib3fv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3SPROC)(GLuint index, GLshort x, GLshort y, GLshort z);
 GLAPI PFNGLVERTEXATTRIB3SPROC glad_glVertexAttrib3s;
 GLAPI PFNGLVERTEXATTRIB3SPROC glad_debug_glVertexAttrib3s;
-#define glVertexAttrib3s glad_debug_glVertexAttrib3s
+#define glVertexAttrib3s GLAD_FUNCTION(glVertexAttrib3s)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB3SVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIB3SVPROC glad_glVertexAttrib3sv;
 GLAPI PFNGLVERTEXATTRIB3SVPROC glad_debug_glVertexAttrib3sv;
-#define glVertexAttrib3sv glad_debug_glVertexAttrib3sv
+#define glVertexAttrib3sv GLAD_FUNCTION(glVertexAttrib3sv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NBVPROC)(GLuint index, const GLbyte *v);
 GLAPI PFNGLVERTEXATTRIB4NBVPROC glad_glVertexAttrib4Nbv;
 GLAPI PFNGLVERTEXATTRIB4NBVPROC glad_debug_glVertexAttrib4Nbv;
-#define glVertexAttrib4Nbv glad_debug_glVertexAttrib4Nbv
+#define glVertexAttrib4Nbv GLAD_FUNCTION(glVertexAttrib4Nbv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NIVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIB4NIVPROC glad_glVertexAttrib4Niv;
 GLAPI PFNGLVERTEXATTRIB4NIVPROC glad_debug_glVertexAttrib4Niv;
-#define glVertexAttrib4Niv glad_debug_glVertexAttrib4Niv
+#define glVertexAttrib4Niv GLAD_FUNCTION(glVertexAttrib4Niv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NSVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIB4NSVPROC glad_glVertexAttrib4Nsv;
 GLAPI PFNGLVERTEXATTRIB4NSVPROC glad_debug_glVertexAttrib4Nsv;
-#define glVertexAttrib4Nsv glad_debug_glVertexAttrib4Nsv
+#define glVertexAttrib4Nsv GLAD_FUNCTION(glVertexAttrib4Nsv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NUBPROC)(GLuint index, GLubyte x, GLubyte y, GLubyte z, GLubyte w);
 GLAPI PFNGLVERTEXATTRIB4NUBPROC glad_glVertexAttrib4Nub;
 GLAPI PFNGLVERTEXATTRIB4NUBPROC glad_debug_glVertexAttrib4Nub;
-#define glVertexAttrib4Nub glad_debug_glVertexAttrib4Nub
+#define glVertexAttrib4Nub GLAD_FUNCTION(glVertexAttrib4Nub)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NUBVPROC)(GLuint index, const GLubyte *v);
 GLAPI PFNGLVERTEXATTRIB4NUBVPROC glad_glVertexAttrib4Nubv;
 GLAPI PFNGLVERTEXATTRIB4NUBVPROC glad_debug_glVertexAttrib4Nubv;
-#define glVertexAttrib4Nubv glad_debug_glVertexAttrib4Nubv
+#define glVertexAttrib4Nubv GLAD_FUNCTION(glVertexAttrib4Nubv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NUIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIB4NUIVPROC glad_glVertexAttrib4Nuiv;
 GLAPI PFNGLVERTEXATTRIB4NUIVPROC glad_debug_glVertexAttrib4Nuiv;
-#define glVertexAttrib4Nuiv glad_debug_glVertexAttrib4Nuiv
+#define glVertexAttrib4Nuiv GLAD_FUNCTION(glVertexAttrib4Nuiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4NUSVPROC)(GLuint index, const GLushort *v);
 GLAPI PFNGLVERTEXATTRIB4NUSVPROC glad_glVertexAttrib4Nusv;
 GLAPI PFNGLVERTEXATTRIB4NUSVPROC glad_debug_glVertexAttrib4Nusv;
-#define glVertexAttrib4Nusv glad_debug_glVertexAttrib4Nusv
+#define glVertexAttrib4Nusv GLAD_FUNCTION(glVertexAttrib4Nusv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4BVPROC)(GLuint index, const GLbyte *v);
 GLAPI PFNGLVERTEXATTRIB4BVPROC glad_glVertexAttrib4bv;
 GLAPI PFNGLVERTEXATTRIB4BVPROC glad_debug_glVertexAttrib4bv;
-#define glVertexAttrib4bv glad_debug_glVertexAttrib4bv
+#define glVertexAttrib4bv GLAD_FUNCTION(glVertexAttrib4bv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4DPROC)(GLuint index, GLdouble x, GLdouble y, GLdouble z, GLdouble w);
 GLAPI PFNGLVERTEXATTRIB4DPROC glad_glVertexAttrib4d;
 GLAPI PFNGLVERTEXATTRIB4DPROC glad_debug_glVertexAttrib4d;
-#define glVertexAttrib4d glad_debug_glVertexAttrib4d
+#define glVertexAttrib4d GLAD_FUNCTION(glVertexAttrib4d)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4DVPROC)(GLuint index, const GLdouble *v);
 GLAPI PFNGLVERTEXATTRIB4DVPROC glad_glVertexAttrib4dv;
 GLAPI PFNGLVERTEXATTRIB4DVPROC glad_debug_glVertexAttrib4dv;
-#define glVertexAttrib4dv glad_debug_glVertexAttrib4dv
+#define glVertexAttrib4dv GLAD_FUNCTION(glVertexAttrib4dv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4FPROC)(GLuint index, GLfloat x, GLfloat y, GLfloat z, GLfloat w);
 GLAPI PFNGLVERTEXATTRIB4FPROC glad_glVertexAttrib4f;
 GLAPI PFNGLVERTEXATTRIB4FPROC glad_debug_glVertexAttrib4f;
-#define glVertexAttrib4f glad_debug_glVertexAttrib4f
+#define glVertexAttrib4f GLAD_FUNCTION(glVertexAttrib4f)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4FVPROC)(GLuint index, const GLfloat *v);
 GLAPI PFNGLVERTEXATTRIB4FVPROC glad_glVertexAttrib4fv;
 GLAPI PFNGLVERTEXATTRIB4FVPROC glad_debug_glVertexAttrib4fv;
-#define glVertexAttrib4fv glad_debug_glVertexAttrib4fv
+#define glVertexAttrib4fv GLAD_FUNCTION(glVertexAttrib4fv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4IVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIB4IVPROC glad_glVertexAttrib4iv;
 GLAPI PFNGLVERTEXATTRIB4IVPROC glad_debug_glVertexAttrib4iv;
-#define glVertexAttrib4iv glad_debug_glVertexAttrib4iv
+#define glVertexAttrib4iv GLAD_FUNCTION(glVertexAttrib4iv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4SPROC)(GLuint index, GLshort x, GLshort y, GLshort z, GLshort w);
 GLAPI PFNGLVERTEXATTRIB4SPROC glad_glVertexAttrib4s;
 GLAPI PFNGLVERTEXATTRIB4SPROC glad_debug_glVertexAttrib4s;
-#define glVertexAttrib4s glad_debug_glVertexAttrib4s
+#define glVertexAttrib4s GLAD_FUNCTION(glVertexAttrib4s)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4SVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIB4SVPROC glad_glVertexAttrib4sv;
 GLAPI PFNGLVERTEXATTRIB4SVPROC glad_debug_glVertexAttrib4sv;
-#define glVertexAttrib4sv glad_debug_glVertexAttrib4sv
+#define glVertexAttrib4sv GLAD_FUNCTION(glVertexAttrib4sv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4UBVPROC)(GLuint index, const GLubyte *v);
 GLAPI PFNGLVERTEXATTRIB4UBVPROC glad_glVertexAttrib4ubv;
 GLAPI PFNGLVERTEXATTRIB4UBVPROC glad_debug_glVertexAttrib4ubv;
-#define glVertexAttrib4ubv glad_debug_glVertexAttrib4ubv
+#define glVertexAttrib4ubv GLAD_FUNCTION(glVertexAttrib4ubv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4UIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIB4UIVPROC glad_glVertexAttrib4uiv;
 GLAPI PFNGLVERTEXATTRIB4UIVPROC glad_debug_glVertexAttrib4uiv;
-#define glVertexAttrib4uiv glad_debug_glVertexAttrib4uiv
+#define glVertexAttrib4uiv GLAD_FUNCTION(glVertexAttrib4uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIB4USVPROC)(GLuint index, const GLushort *v);
 GLAPI PFNGLVERTEXATTRIB4USVPROC glad_glVertexAttrib4usv;
 GLAPI PFNGLVERTEXATTRIB4USVPROC glad_debug_glVertexAttrib4usv;
-#define glVertexAttrib4usv glad_debug_glVertexAttrib4usv
+#define glVertexAttrib4usv GLAD_FUNCTION(glVertexAttrib4usv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBPOINTERPROC)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer);
 GLAPI PFNGLVERTEXATTRIBPOINTERPROC glad_glVertexAttribPointer;
 GLAPI PFNGLVERTEXATTRIBPOINTERPROC glad_debug_glVertexAttribPointer;
-#define glVertexAttribPointer glad_debug_glVertexAttribPointer
+#define glVertexAttribPointer GLAD_FUNCTION(glVertexAttribPointer)
 #endif
 #ifndef GL_VERSION_2_1
 #define GL_VERSION_2_1 1
@@ -1821,27 +1830,27 @@ GLAPI int GLAD_GL_VERSION_2_1;
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX2X3FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX2X3FVPROC glad_glUniformMatrix2x3fv;
 GLAPI PFNGLUNIFORMMATRIX2X3FVPROC glad_debug_glUniformMatrix2x3fv;
-#define glUniformMatrix2x3fv glad_debug_glUniformMatrix2x3fv
+#define glUniformMatrix2x3fv GLAD_FUNCTION(glUniformMatrix2x3fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX3X2FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX3X2FVPROC glad_glUniformMatrix3x2fv;
 GLAPI PFNGLUNIFORMMATRIX3X2FVPROC glad_debug_glUniformMatrix3x2fv;
-#define glUniformMatrix3x2fv glad_debug_glUniformMatrix3x2fv
+#define glUniformMatrix3x2fv GLAD_FUNCTION(glUniformMatrix3x2fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX2X4FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX2X4FVPROC glad_glUniformMatrix2x4fv;
 GLAPI PFNGLUNIFORMMATRIX2X4FVPROC glad_debug_glUniformMatrix2x4fv;
-#define glUniformMatrix2x4fv glad_debug_glUniformMatrix2x4fv
+#define glUniformMatrix2x4fv GLAD_FUNCTION(glUniformMatrix2x4fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX4X2FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX4X2FVPROC glad_glUniformMatrix4x2fv;
 GLAPI PFNGLUNIFORMMATRIX4X2FVPROC glad_debug_glUniformMatrix4x2fv;
-#define glUniformMatrix4x2fv glad_debug_glUniformMatrix4x2fv
+#define glUniformMatrix4x2fv GLAD_FUNCTION(glUniformMatrix4x2fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX3X4FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX3X4FVPROC glad_glUniformMatrix3x4fv;
 GLAPI PFNGLUNIFORMMATRIX3X4FVPROC glad_debug_glUniformMatrix3x4fv;
-#define glUniformMatrix3x4fv glad_debug_glUniformMatrix3x4fv
+#define glUniformMatrix3x4fv GLAD_FUNCTION(glUniformMatrix3x4fv)
 typedef void (APIENTRYP PFNGLUNIFORMMATRIX4X3FVPROC)(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value);
 GLAPI PFNGLUNIFORMMATRIX4X3FVPROC glad_glUniformMatrix4x3fv;
 GLAPI PFNGLUNIFORMMATRIX4X3FVPROC glad_debug_glUniformMatrix4x3fv;
-#define glUniformMatrix4x3fv glad_debug_glUniformMatrix4x3fv
+#define glUniformMatrix4x3fv GLAD_FUNCTION(glUniformMatrix4x3fv)
 #endif
 #ifndef GL_VERSION_3_0
 #define GL_VERSION_3_0 1
@@ -1849,339 +1858,339 @@ GLAPI int GLAD_GL_VERSION_3_0;
 typedef void (APIENTRYP PFNGLCOLORMASKIPROC)(GLuint index, GLboolean r, GLboolean g, GLboolean b, GLboolean a);
 GLAPI PFNGLCOLORMASKIPROC glad_glColorMaski;
 GLAPI PFNGLCOLORMASKIPROC glad_debug_glColorMaski;
-#define glColorMaski glad_debug_glColorMaski
+#define glColorMaski GLAD_FUNCTION(glColorMaski)
 typedef void (APIENTRYP PFNGLGETBOOLEANI_VPROC)(GLenum target, GLuint index, GLboolean *data);
 GLAPI PFNGLGETBOOLEANI_VPROC glad_glGetBooleani_v;
 GLAPI PFNGLGETBOOLEANI_VPROC glad_debug_glGetBooleani_v;
-#define glGetBooleani_v glad_debug_glGetBooleani_v
+#define glGetBooleani_v GLAD_FUNCTION(glGetBooleani_v)
 typedef void (APIENTRYP PFNGLGETINTEGERI_VPROC)(GLenum target, GLuint index, GLint *data);
 GLAPI PFNGLGETINTEGERI_VPROC glad_glGetIntegeri_v;
 GLAPI PFNGLGETINTEGERI_VPROC glad_debug_glGetIntegeri_v;
-#define glGetIntegeri_v glad_debug_glGetIntegeri_v
+#define glGetIntegeri_v GLAD_FUNCTION(glGetIntegeri_v)
 typedef void (APIENTRYP PFNGLENABLEIPROC)(GLenum target, GLuint index);
 GLAPI PFNGLENABLEIPROC glad_glEnablei;
 GLAPI PFNGLENABLEIPROC glad_debug_glEnablei;
-#define glEnablei glad_debug_glEnablei
+#define glEnablei GLAD_FUNCTION(glEnablei)
 typedef void (APIENTRYP PFNGLDISABLEIPROC)(GLenum target, GLuint index);
 GLAPI PFNGLDISABLEIPROC glad_glDisablei;
 GLAPI PFNGLDISABLEIPROC glad_debug_glDisablei;
-#define glDisablei glad_debug_glDisablei
+#define glDisablei GLAD_FUNCTION(glDisablei)
 typedef GLboolean (APIENTRYP PFNGLISENABLEDIPROC)(GLenum target, GLuint index);
 GLAPI PFNGLISENABLEDIPROC glad_glIsEnabledi;
 GLAPI PFNGLISENABLEDIPROC glad_debug_glIsEnabledi;
-#define glIsEnabledi glad_debug_glIsEnabledi
+#define glIsEnabledi GLAD_FUNCTION(glIsEnabledi)
 typedef void (APIENTRYP PFNGLBEGINTRANSFORMFEEDBACKPROC)(GLenum primitiveMode);
 GLAPI PFNGLBEGINTRANSFORMFEEDBACKPROC glad_glBeginTransformFeedback;
 GLAPI PFNGLBEGINTRANSFORMFEEDBACKPROC glad_debug_glBeginTransformFeedback;
-#define glBeginTransformFeedback glad_debug_glBeginTransformFeedback
+#define glBeginTransformFeedback GLAD_FUNCTION(glBeginTransformFeedback)
 typedef void (APIENTRYP PFNGLENDTRANSFORMFEEDBACKPROC)();
 GLAPI PFNGLENDTRANSFORMFEEDBACKPROC glad_glEndTransformFeedback;
 GLAPI PFNGLENDTRANSFORMFEEDBACKPROC glad_debug_glEndTransformFeedback;
-#define glEndTransformFeedback glad_debug_glEndTransformFeedback
+#define glEndTransformFeedback GLAD_FUNCTION(glEndTransformFeedback)
 typedef void (APIENTRYP PFNGLBINDBUFFERRANGEPROC)(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
 GLAPI PFNGLBINDBUFFERRANGEPROC glad_glBindBufferRange;
 GLAPI PFNGLBINDBUFFERRANGEPROC glad_debug_glBindBufferRange;
-#define glBindBufferRange glad_debug_glBindBufferRange
+#define glBindBufferRange GLAD_FUNCTION(glBindBufferRange)
 typedef void (APIENTRYP PFNGLBINDBUFFERBASEPROC)(GLenum target, GLuint index, GLuint buffer);
 GLAPI PFNGLBINDBUFFERBASEPROC glad_glBindBufferBase;
 GLAPI PFNGLBINDBUFFERBASEPROC glad_debug_glBindBufferBase;
-#define glBindBufferBase glad_debug_glBindBufferBase
+#define glBindBufferBase GLAD_FUNCTION(glBindBufferBase)
 typedef void (APIENTRYP PFNGLTRANSFORMFEEDBACKVARYINGSPROC)(GLuint program, GLsizei count, const GLchar *const*varyings, GLenum bufferMode);
 GLAPI PFNGLTRANSFORMFEEDBACKVARYINGSPROC glad_glTransformFeedbackVaryings;
 GLAPI PFNGLTRANSFORMFEEDBACKVARYINGSPROC glad_debug_glTransformFeedbackVaryings;
-#define glTransformFeedbackVaryings glad_debug_glTransformFeedbackVaryings
+#define glTransformFeedbackVaryings GLAD_FUNCTION(glTransformFeedbackVaryings)
 typedef void (APIENTRYP PFNGLGETTRANSFORMFEEDBACKVARYINGPROC)(GLuint program, GLuint index, GLsizei bufSize, GLsizei *length, GLsizei *size, GLenum *type, GLchar *name);
 GLAPI PFNGLGETTRANSFORMFEEDBACKVARYINGPROC glad_glGetTransformFeedbackVarying;
 GLAPI PFNGLGETTRANSFORMFEEDBACKVARYINGPROC glad_debug_glGetTransformFeedbackVarying;
-#define glGetTransformFeedbackVarying glad_debug_glGetTransformFeedbackVarying
+#define glGetTransformFeedbackVarying GLAD_FUNCTION(glGetTransformFeedbackVarying)
 typedef void (APIENTRYP PFNGLCLAMPCOLORPROC)(GLenum target, GLenum clamp);
 GLAPI PFNGLCLAMPCOLORPROC glad_glClampColor;
 GLAPI PFNGLCLAMPCOLORPROC glad_debug_glClampColor;
-#define glClampColor glad_debug_glClampColor
+#define glClampColor GLAD_FUNCTION(glClampColor)
 typedef void (APIENTRYP PFNGLBEGINCONDITIONALRENDERPROC)(GLuint id, GLenum mode);
 GLAPI PFNGLBEGINCONDITIONALRENDERPROC glad_glBeginConditionalRender;
 GLAPI PFNGLBEGINCONDITIONALRENDERPROC glad_debug_glBeginConditionalRender;
-#define glBeginConditionalRender glad_debug_glBeginConditionalRender
+#define glBeginConditionalRender GLAD_FUNCTION(glBeginConditionalRender)
 typedef void (APIENTRYP PFNGLENDCONDITIONALRENDERPROC)();
 GLAPI PFNGLENDCONDITIONALRENDERPROC glad_glEndConditionalRender;
 GLAPI PFNGLENDCONDITIONALRENDERPROC glad_debug_glEndConditionalRender;
-#define glEndConditionalRender glad_debug_glEndConditionalRender
+#define glEndConditionalRender GLAD_FUNCTION(glEndConditionalRender)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBIPOINTERPROC)(GLuint index, GLint size, GLenum type, GLsizei stride, const void *pointer);
 GLAPI PFNGLVERTEXATTRIBIPOINTERPROC glad_glVertexAttribIPointer;
 GLAPI PFNGLVERTEXATTRIBIPOINTERPROC glad_debug_glVertexAttribIPointer;
-#define glVertexAttribIPointer glad_debug_glVertexAttribIPointer
+#define glVertexAttribIPointer GLAD_FUNCTION(glVertexAttribIPointer)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBIIVPROC)(GLuint index, GLenum pname, GLint *params);
 GLAPI PFNGLGETVERTEXATTRIBIIVPROC glad_glGetVertexAttribIiv;
 GLAPI PFNGLGETVERTEXATTRIBIIVPROC glad_debug_glGetVertexAttribIiv;
-#define glGetVertexAttribIiv glad_debug_glGetVertexAttribIiv
+#define glGetVertexAttribIiv GLAD_FUNCTION(glGetVertexAttribIiv)
 typedef void (APIENTRYP PFNGLGETVERTEXATTRIBIUIVPROC)(GLuint index, GLenum pname, GLuint *params);
 GLAPI PFNGLGETVERTEXATTRIBIUIVPROC glad_glGetVertexAttribIuiv;
 GLAPI PFNGLGETVERTEXATTRIBIUIVPROC glad_debug_glGetVertexAttribIuiv;
-#define glGetVertexAttribIuiv glad_debug_glGetVertexAttribIuiv
+#define glGetVertexAttribIuiv GLAD_FUNCTION(glGetVertexAttribIuiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI1IPROC)(GLuint index, GLint x);
 GLAPI PFNGLVERTEXATTRIBI1IPROC glad_glVertexAttribI1i;
 GLAPI PFNGLVERTEXATTRIBI1IPROC glad_debug_glVertexAttribI1i;
-#define glVertexAttribI1i glad_debug_glVertexAttribI1i
+#define glVertexAttribI1i GLAD_FUNCTION(glVertexAttribI1i)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI2IPROC)(GLuint index, GLint x, GLint y);
 GLAPI PFNGLVERTEXATTRIBI2IPROC glad_glVertexAttribI2i;
 GLAPI PFNGLVERTEXATTRIBI2IPROC glad_debug_glVertexAttribI2i;
-#define glVertexAttribI2i glad_debug_glVertexAttribI2i
+#define glVertexAttribI2i GLAD_FUNCTION(glVertexAttribI2i)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI3IPROC)(GLuint index, GLint x, GLint y, GLint z);
 GLAPI PFNGLVERTEXATTRIBI3IPROC glad_glVertexAttribI3i;
 GLAPI PFNGLVERTEXATTRIBI3IPROC glad_debug_glVertexAttribI3i;
-#define glVertexAttribI3i glad_debug_glVertexAttribI3i
+#define glVertexAttribI3i GLAD_FUNCTION(glVertexAttribI3i)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4IPROC)(GLuint index, GLint x, GLint y, GLint z, GLint w);
 GLAPI PFNGLVERTEXATTRIBI4IPROC glad_glVertexAttribI4i;
 GLAPI PFNGLVERTEXATTRIBI4IPROC glad_debug_glVertexAttribI4i;
-#define glVertexAttribI4i glad_debug_glVertexAttribI4i
+#define glVertexAttribI4i GLAD_FUNCTION(glVertexAttribI4i)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI1UIPROC)(GLuint index, GLuint x);
 GLAPI PFNGLVERTEXATTRIBI1UIPROC glad_glVertexAttribI1ui;
 GLAPI PFNGLVERTEXATTRIBI1UIPROC glad_debug_glVertexAttribI1ui;
-#define glVertexAttribI1ui glad_debug_glVertexAttribI1ui
+#define glVertexAttribI1ui GLAD_FUNCTION(glVertexAttribI1ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI2UIPROC)(GLuint index, GLuint x, GLuint y);
 GLAPI PFNGLVERTEXATTRIBI2UIPROC glad_glVertexAttribI2ui;
 GLAPI PFNGLVERTEXATTRIBI2UIPROC glad_debug_glVertexAttribI2ui;
-#define glVertexAttribI2ui glad_debug_glVertexAttribI2ui
+#define glVertexAttribI2ui GLAD_FUNCTION(glVertexAttribI2ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI3UIPROC)(GLuint index, GLuint x, GLuint y, GLuint z);
 GLAPI PFNGLVERTEXATTRIBI3UIPROC glad_glVertexAttribI3ui;
 GLAPI PFNGLVERTEXATTRIBI3UIPROC glad_debug_glVertexAttribI3ui;
-#define glVertexAttribI3ui glad_debug_glVertexAttribI3ui
+#define glVertexAttribI3ui GLAD_FUNCTION(glVertexAttribI3ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4UIPROC)(GLuint index, GLuint x, GLuint y, GLuint z, GLuint w);
 GLAPI PFNGLVERTEXATTRIBI4UIPROC glad_glVertexAttribI4ui;
 GLAPI PFNGLVERTEXATTRIBI4UIPROC glad_debug_glVertexAttribI4ui;
-#define glVertexAttribI4ui glad_debug_glVertexAttribI4ui
+#define glVertexAttribI4ui GLAD_FUNCTION(glVertexAttribI4ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI1IVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIBI1IVPROC glad_glVertexAttribI1iv;
 GLAPI PFNGLVERTEXATTRIBI1IVPROC glad_debug_glVertexAttribI1iv;
-#define glVertexAttribI1iv glad_debug_glVertexAttribI1iv
+#define glVertexAttribI1iv GLAD_FUNCTION(glVertexAttribI1iv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI2IVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIBI2IVPROC glad_glVertexAttribI2iv;
 GLAPI PFNGLVERTEXATTRIBI2IVPROC glad_debug_glVertexAttribI2iv;
-#define glVertexAttribI2iv glad_debug_glVertexAttribI2iv
+#define glVertexAttribI2iv GLAD_FUNCTION(glVertexAttribI2iv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI3IVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIBI3IVPROC glad_glVertexAttribI3iv;
 GLAPI PFNGLVERTEXATTRIBI3IVPROC glad_debug_glVertexAttribI3iv;
-#define glVertexAttribI3iv glad_debug_glVertexAttribI3iv
+#define glVertexAttribI3iv GLAD_FUNCTION(glVertexAttribI3iv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4IVPROC)(GLuint index, const GLint *v);
 GLAPI PFNGLVERTEXATTRIBI4IVPROC glad_glVertexAttribI4iv;
 GLAPI PFNGLVERTEXATTRIBI4IVPROC glad_debug_glVertexAttribI4iv;
-#define glVertexAttribI4iv glad_debug_glVertexAttribI4iv
+#define glVertexAttribI4iv GLAD_FUNCTION(glVertexAttribI4iv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI1UIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIBI1UIVPROC glad_glVertexAttribI1uiv;
 GLAPI PFNGLVERTEXATTRIBI1UIVPROC glad_debug_glVertexAttribI1uiv;
-#define glVertexAttribI1uiv glad_debug_glVertexAttribI1uiv
+#define glVertexAttribI1uiv GLAD_FUNCTION(glVertexAttribI1uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI2UIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIBI2UIVPROC glad_glVertexAttribI2uiv;
 GLAPI PFNGLVERTEXATTRIBI2UIVPROC glad_debug_glVertexAttribI2uiv;
-#define glVertexAttribI2uiv glad_debug_glVertexAttribI2uiv
+#define glVertexAttribI2uiv GLAD_FUNCTION(glVertexAttribI2uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI3UIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIBI3UIVPROC glad_glVertexAttribI3uiv;
 GLAPI PFNGLVERTEXATTRIBI3UIVPROC glad_debug_glVertexAttribI3uiv;
-#define glVertexAttribI3uiv glad_debug_glVertexAttribI3uiv
+#define glVertexAttribI3uiv GLAD_FUNCTION(glVertexAttribI3uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4UIVPROC)(GLuint index, const GLuint *v);
 GLAPI PFNGLVERTEXATTRIBI4UIVPROC glad_glVertexAttribI4uiv;
 GLAPI PFNGLVERTEXATTRIBI4UIVPROC glad_debug_glVertexAttribI4uiv;
-#define glVertexAttribI4uiv glad_debug_glVertexAttribI4uiv
+#define glVertexAttribI4uiv GLAD_FUNCTION(glVertexAttribI4uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4BVPROC)(GLuint index, const GLbyte *v);
 GLAPI PFNGLVERTEXATTRIBI4BVPROC glad_glVertexAttribI4bv;
 GLAPI PFNGLVERTEXATTRIBI4BVPROC glad_debug_glVertexAttribI4bv;
-#define glVertexAttribI4bv glad_debug_glVertexAttribI4bv
+#define glVertexAttribI4bv GLAD_FUNCTION(glVertexAttribI4bv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4SVPROC)(GLuint index, const GLshort *v);
 GLAPI PFNGLVERTEXATTRIBI4SVPROC glad_glVertexAttribI4sv;
 GLAPI PFNGLVERTEXATTRIBI4SVPROC glad_debug_glVertexAttribI4sv;
-#define glVertexAttribI4sv glad_debug_glVertexAttribI4sv
+#define glVertexAttribI4sv GLAD_FUNCTION(glVertexAttribI4sv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4UBVPROC)(GLuint index, const GLubyte *v);
 GLAPI PFNGLVERTEXATTRIBI4UBVPROC glad_glVertexAttribI4ubv;
 GLAPI PFNGLVERTEXATTRIBI4UBVPROC glad_debug_glVertexAttribI4ubv;
-#define glVertexAttribI4ubv glad_debug_glVertexAttribI4ubv
+#define glVertexAttribI4ubv GLAD_FUNCTION(glVertexAttribI4ubv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBI4USVPROC)(GLuint index, const GLushort *v);
 GLAPI PFNGLVERTEXATTRIBI4USVPROC glad_glVertexAttribI4usv;
 GLAPI PFNGLVERTEXATTRIBI4USVPROC glad_debug_glVertexAttribI4usv;
-#define glVertexAttribI4usv glad_debug_glVertexAttribI4usv
+#define glVertexAttribI4usv GLAD_FUNCTION(glVertexAttribI4usv)
 typedef void (APIENTRYP PFNGLGETUNIFORMUIVPROC)(GLuint program, GLint location, GLuint *params);
 GLAPI PFNGLGETUNIFORMUIVPROC glad_glGetUniformuiv;
 GLAPI PFNGLGETUNIFORMUIVPROC glad_debug_glGetUniformuiv;
-#define glGetUniformuiv glad_debug_glGetUniformuiv
+#define glGetUniformuiv GLAD_FUNCTION(glGetUniformuiv)
 typedef void (APIENTRYP PFNGLBINDFRAGDATALOCATIONPROC)(GLuint program, GLuint color, const GLchar *name);
 GLAPI PFNGLBINDFRAGDATALOCATIONPROC glad_glBindFragDataLocation;
 GLAPI PFNGLBINDFRAGDATALOCATIONPROC glad_debug_glBindFragDataLocation;
-#define glBindFragDataLocation glad_debug_glBindFragDataLocation
+#define glBindFragDataLocation GLAD_FUNCTION(glBindFragDataLocation)
 typedef GLint (APIENTRYP PFNGLGETFRAGDATALOCATIONPROC)(GLuint program, const GLchar *name);
 GLAPI PFNGLGETFRAGDATALOCATIONPROC glad_glGetFragDataLocation;
 GLAPI PFNGLGETFRAGDATALOCATIONPROC glad_debug_glGetFragDataLocation;
-#define glGetFragDataLocation glad_debug_glGetFragDataLocation
+#define glGetFragDataLocation GLAD_FUNCTION(glGetFragDataLocation)
 typedef void (APIENTRYP PFNGLUNIFORM1UIPROC)(GLint location, GLuint v0);
 GLAPI PFNGLUNIFORM1UIPROC glad_glUniform1ui;
 GLAPI PFNGLUNIFORM1UIPROC glad_debug_glUniform1ui;
-#define glUniform1ui glad_debug_glUniform1ui
+#define glUniform1ui GLAD_FUNCTION(glUniform1ui)
 typedef void (APIENTRYP PFNGLUNIFORM2UIPROC)(GLint location, GLuint v0, GLuint v1);
 GLAPI PFNGLUNIFORM2UIPROC glad_glUniform2ui;
 GLAPI PFNGLUNIFORM2UIPROC glad_debug_glUniform2ui;
-#define glUniform2ui glad_debug_glUniform2ui
+#define glUniform2ui GLAD_FUNCTION(glUniform2ui)
 typedef void (APIENTRYP PFNGLUNIFORM3UIPROC)(GLint location, GLuint v0, GLuint v1, GLuint v2);
 GLAPI PFNGLUNIFORM3UIPROC glad_glUniform3ui;
 GLAPI PFNGLUNIFORM3UIPROC glad_debug_glUniform3ui;
-#define glUniform3ui glad_debug_glUniform3ui
+#define glUniform3ui GLAD_FUNCTION(glUniform3ui)
 typedef void (APIENTRYP PFNGLUNIFORM4UIPROC)(GLint location, GLuint v0, GLuint v1, GLuint v2, GLuint v3);
 GLAPI PFNGLUNIFORM4UIPROC glad_glUniform4ui;
 GLAPI PFNGLUNIFORM4UIPROC glad_debug_glUniform4ui;
-#define glUniform4ui glad_debug_glUniform4ui
+#define glUniform4ui GLAD_FUNCTION(glUniform4ui)
 typedef void (APIENTRYP PFNGLUNIFORM1UIVPROC)(GLint location, GLsizei count, const GLuint *value);
 GLAPI PFNGLUNIFORM1UIVPROC glad_glUniform1uiv;
 GLAPI PFNGLUNIFORM1UIVPROC glad_debug_glUniform1uiv;
-#define glUniform1uiv glad_debug_glUniform1uiv
+#define glUniform1uiv GLAD_FUNCTION(glUniform1uiv)
 typedef void (APIENTRYP PFNGLUNIFORM2UIVPROC)(GLint location, GLsizei count, const GLuint *value);
 GLAPI PFNGLUNIFORM2UIVPROC glad_glUniform2uiv;
 GLAPI PFNGLUNIFORM2UIVPROC glad_debug_glUniform2uiv;
-#define glUniform2uiv glad_debug_glUniform2uiv
+#define glUniform2uiv GLAD_FUNCTION(glUniform2uiv)
 typedef void (APIENTRYP PFNGLUNIFORM3UIVPROC)(GLint location, GLsizei count, const GLuint *value);
 GLAPI PFNGLUNIFORM3UIVPROC glad_glUniform3uiv;
 GLAPI PFNGLUNIFORM3UIVPROC glad_debug_glUniform3uiv;
-#define glUniform3uiv glad_debug_glUniform3uiv
+#define glUniform3uiv GLAD_FUNCTION(glUniform3uiv)
 typedef void (APIENTRYP PFNGLUNIFORM4UIVPROC)(GLint location, GLsizei count, const GLuint *value);
 GLAPI PFNGLUNIFORM4UIVPROC glad_glUniform4uiv;
 GLAPI PFNGLUNIFORM4UIVPROC glad_debug_glUniform4uiv;
-#define glUniform4uiv glad_debug_glUniform4uiv
+#define glUniform4uiv GLAD_FUNCTION(glUniform4uiv)
 typedef void (APIENTRYP PFNGLTEXPARAMETERIIVPROC)(GLenum target, GLenum pname, const GLint *params);
 GLAPI PFNGLTEXPARAMETERIIVPROC glad_glTexParameterIiv;
 GLAPI PFNGLTEXPARAMETERIIVPROC glad_debug_glTexParameterIiv;
-#define glTexParameterIiv glad_debug_glTexParameterIiv
+#define glTexParameterIiv GLAD_FUNCTION(glTexParameterIiv)
 typedef void (APIENTRYP PFNGLTEXPARAMETERIUIVPROC)(GLenum target, GLenum pname, const GLuint *params);
 GLAPI PFNGLTEXPARAMETERIUIVPROC glad_glTexParameterIuiv;
 GLAPI PFNGLTEXPARAMETERIUIVPROC glad_debug_glTexParameterIuiv;
-#define glTexParameterIuiv glad_debug_glTexParameterIuiv
+#define glTexParameterIuiv GLAD_FUNCTION(glTexParameterIuiv)
 typedef void (APIENTRYP PFNGLGETTEXPARAMETERIIVPROC)(GLenum target, GLenum pname, GLint *params);
 GLAPI PFNGLGETTEXPARAMETERIIVPROC glad_glGetTexParameterIiv;
 GLAPI PFNGLGETTEXPARAMETERIIVPROC glad_debug_glGetTexParameterIiv;
-#define glGetTexParameterIiv glad_debug_glGetTexParameterIiv
+#define glGetTexParameterIiv GLAD_FUNCTION(glGetTexParameterIiv)
 typedef void (APIENTRYP PFNGLGETTEXPARAMETERIUIVPROC)(GLenum target, GLenum pname, GLuint *params);
 GLAPI PFNGLGETTEXPARAMETERIUIVPROC glad_glGetTexParameterIuiv;
 GLAPI PFNGLGETTEXPARAMETERIUIVPROC glad_debug_glGetTexParameterIuiv;
-#define glGetTexParameterIuiv glad_debug_glGetTexParameterIuiv
+#define glGetTexParameterIuiv GLAD_FUNCTION(glGetTexParameterIuiv)
 typedef void (APIENTRYP PFNGLCLEARBUFFERIVPROC)(GLenum buffer, GLint drawbuffer, const GLint *value);
 GLAPI PFNGLCLEARBUFFERIVPROC glad_glClearBufferiv;
 GLAPI PFNGLCLEARBUFFERIVPROC glad_debug_glClearBufferiv;
-#define glClearBufferiv glad_debug_glClearBufferiv
+#define glClearBufferiv GLAD_FUNCTION(glClearBufferiv)
 typedef void (APIENTRYP PFNGLCLEARBUFFERUIVPROC)(GLenum buffer, GLint drawbuffer, const GLuint *value);
 GLAPI PFNGLCLEARBUFFERUIVPROC glad_glClearBufferuiv;
 GLAPI PFNGLCLEARBUFFERUIVPROC glad_debug_glClearBufferuiv;
-#define glClearBufferuiv glad_debug_glClearBufferuiv
+#define glClearBufferuiv GLAD_FUNCTION(glClearBufferuiv)
 typedef void (APIENTRYP PFNGLCLEARBUFFERFVPROC)(GLenum buffer, GLint drawbuffer, const GLfloat *value);
 GLAPI PFNGLCLEARBUFFERFVPROC glad_glClearBufferfv;
 GLAPI PFNGLCLEARBUFFERFVPROC glad_debug_glClearBufferfv;
-#define glClearBufferfv glad_debug_glClearBufferfv
+#define glClearBufferfv GLAD_FUNCTION(glClearBufferfv)
 typedef void (APIENTRYP PFNGLCLEARBUFFERFIPROC)(GLenum buffer, GLint drawbuffer, GLfloat depth, GLint stencil);
 GLAPI PFNGLCLEARBUFFERFIPROC glad_glClearBufferfi;
 GLAPI PFNGLCLEARBUFFERFIPROC glad_debug_glClearBufferfi;
-#define glClearBufferfi glad_debug_glClearBufferfi
+#define glClearBufferfi GLAD_FUNCTION(glClearBufferfi)
 typedef const GLubyte * (APIENTRYP PFNGLGETSTRINGIPROC)(GLenum name, GLuint index);
 GLAPI PFNGLGETSTRINGIPROC glad_glGetStringi;
 GLAPI PFNGLGETSTRINGIPROC glad_debug_glGetStringi;
-#define glGetStringi glad_debug_glGetStringi
+#define glGetStringi GLAD_FUNCTION(glGetStringi)
 typedef GLboolean (APIENTRYP PFNGLISRENDERBUFFERPROC)(GLuint renderbuffer);
 GLAPI PFNGLISRENDERBUFFERPROC glad_glIsRenderbuffer;
 GLAPI PFNGLISRENDERBUFFERPROC glad_debug_glIsRenderbuffer;
-#define glIsRenderbuffer glad_debug_glIsRenderbuffer
+#define glIsRenderbuffer GLAD_FUNCTION(glIsRenderbuffer)
 typedef void (APIENTRYP PFNGLBINDRENDERBUFFERPROC)(GLenum target, GLuint renderbuffer);
 GLAPI PFNGLBINDRENDERBUFFERPROC glad_glBindRenderbuffer;
 GLAPI PFNGLBINDRENDERBUFFERPROC glad_debug_glBindRenderbuffer;
-#define glBindRenderbuffer glad_debug_glBindRenderbuffer
+#define glBindRenderbuffer GLAD_FUNCTION(glBindRenderbuffer)
 typedef void (APIENTRYP PFNGLDELETERENDERBUFFERSPROC)(GLsizei n, const GLuint *renderbuffers);
 GLAPI PFNGLDELETERENDERBUFFERSPROC glad_glDeleteRenderbuffers;
 GLAPI PFNGLDELETERENDERBUFFERSPROC glad_debug_glDeleteRenderbuffers;
-#define glDeleteRenderbuffers glad_debug_glDeleteRenderbuffers
+#define glDeleteRenderbuffers GLAD_FUNCTION(glDeleteRenderbuffers)
 typedef void (APIENTRYP PFNGLGENRENDERBUFFERSPROC)(GLsizei n, GLuint *renderbuffers);
 GLAPI PFNGLGENRENDERBUFFERSPROC glad_glGenRenderbuffers;
 GLAPI PFNGLGENRENDERBUFFERSPROC glad_debug_glGenRenderbuffers;
-#define glGenRenderbuffers glad_debug_glGenRenderbuffers
+#define glGenRenderbuffers GLAD_FUNCTION(glGenRenderbuffers)
 typedef void (APIENTRYP PFNGLRENDERBUFFERSTORAGEPROC)(GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
 GLAPI PFNGLRENDERBUFFERSTORAGEPROC glad_glRenderbufferStorage;
 GLAPI PFNGLRENDERBUFFERSTORAGEPROC glad_debug_glRenderbufferStorage;
-#define glRenderbufferStorage glad_debug_glRenderbufferStorage
+#define glRenderbufferStorage GLAD_FUNCTION(glRenderbufferStorage)
 typedef void (APIENTRYP PFNGLGETRENDERBUFFERPARAMETERIVPROC)(GLenum target, GLenum pname, GLint *params);
 GLAPI PFNGLGETRENDERBUFFERPARAMETERIVPROC glad_glGetRenderbufferParameteriv;
 GLAPI PFNGLGETRENDERBUFFERPARAMETERIVPROC glad_debug_glGetRenderbufferParameteriv;
-#define glGetRenderbufferParameteriv glad_debug_glGetRenderbufferParameteriv
+#define glGetRenderbufferParameteriv GLAD_FUNCTION(glGetRenderbufferParameteriv)
 typedef GLboolean (APIENTRYP PFNGLISFRAMEBUFFERPROC)(GLuint framebuffer);
 GLAPI PFNGLISFRAMEBUFFERPROC glad_glIsFramebuffer;
 GLAPI PFNGLISFRAMEBUFFERPROC glad_debug_glIsFramebuffer;
-#define glIsFramebuffer glad_debug_glIsFramebuffer
+#define glIsFramebuffer GLAD_FUNCTION(glIsFramebuffer)
 typedef void (APIENTRYP PFNGLBINDFRAMEBUFFERPROC)(GLenum target, GLuint framebuffer);
 GLAPI PFNGLBINDFRAMEBUFFERPROC glad_glBindFramebuffer;
 GLAPI PFNGLBINDFRAMEBUFFERPROC glad_debug_glBindFramebuffer;
-#define glBindFramebuffer glad_debug_glBindFramebuffer
+#define glBindFramebuffer GLAD_FUNCTION(glBindFramebuffer)
 typedef void (APIENTRYP PFNGLDELETEFRAMEBUFFERSPROC)(GLsizei n, const GLuint *framebuffers);
 GLAPI PFNGLDELETEFRAMEBUFFERSPROC glad_glDeleteFramebuffers;
 GLAPI PFNGLDELETEFRAMEBUFFERSPROC glad_debug_glDeleteFramebuffers;
-#define glDeleteFramebuffers glad_debug_glDeleteFramebuffers
+#define glDeleteFramebuffers GLAD_FUNCTION(glDeleteFramebuffers)
 typedef void (APIENTRYP PFNGLGENFRAMEBUFFERSPROC)(GLsizei n, GLuint *framebuffers);
 GLAPI PFNGLGENFRAMEBUFFERSPROC glad_glGenFramebuffers;
 GLAPI PFNGLGENFRAMEBUFFERSPROC glad_debug_glGenFramebuffers;
-#define glGenFramebuffers glad_debug_glGenFramebuffers
+#define glGenFramebuffers GLAD_FUNCTION(glGenFramebuffers)
 typedef GLenum (APIENTRYP PFNGLCHECKFRAMEBUFFERSTATUSPROC)(GLenum target);
 GLAPI PFNGLCHECKFRAMEBUFFERSTATUSPROC glad_glCheckFramebufferStatus;
 GLAPI PFNGLCHECKFRAMEBUFFERSTATUSPROC glad_debug_glCheckFramebufferStatus;
-#define glCheckFramebufferStatus glad_debug_glCheckFramebufferStatus
+#define glCheckFramebufferStatus GLAD_FUNCTION(glCheckFramebufferStatus)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERTEXTURE1DPROC)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
 GLAPI PFNGLFRAMEBUFFERTEXTURE1DPROC glad_glFramebufferTexture1D;
 GLAPI PFNGLFRAMEBUFFERTEXTURE1DPROC glad_debug_glFramebufferTexture1D;
-#define glFramebufferTexture1D glad_debug_glFramebufferTexture1D
+#define glFramebufferTexture1D GLAD_FUNCTION(glFramebufferTexture1D)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERTEXTURE2DPROC)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
 GLAPI PFNGLFRAMEBUFFERTEXTURE2DPROC glad_glFramebufferTexture2D;
 GLAPI PFNGLFRAMEBUFFERTEXTURE2DPROC glad_debug_glFramebufferTexture2D;
-#define glFramebufferTexture2D glad_debug_glFramebufferTexture2D
+#define glFramebufferTexture2D GLAD_FUNCTION(glFramebufferTexture2D)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERTEXTURE3DPROC)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level, GLint zoffset);
 GLAPI PFNGLFRAMEBUFFERTEXTURE3DPROC glad_glFramebufferTexture3D;
 GLAPI PFNGLFRAMEBUFFERTEXTURE3DPROC glad_debug_glFramebufferTexture3D;
-#define glFramebufferTexture3D glad_debug_glFramebufferTexture3D
+#define glFramebufferTexture3D GLAD_FUNCTION(glFramebufferTexture3D)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERRENDERBUFFERPROC)(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
 GLAPI PFNGLFRAMEBUFFERRENDERBUFFERPROC glad_glFramebufferRenderbuffer;
 GLAPI PFNGLFRAMEBUFFERRENDERBUFFERPROC glad_debug_glFramebufferRenderbuffer;
-#define glFramebufferRenderbuffer glad_debug_glFramebufferRenderbuffer
+#define glFramebufferRenderbuffer GLAD_FUNCTION(glFramebufferRenderbuffer)
 typedef void (APIENTRYP PFNGLGETFRAMEBUFFERATTACHMENTPARAMETERIVPROC)(GLenum target, GLenum attachment, GLenum pname, GLint *params);
 GLAPI PFNGLGETFRAMEBUFFERATTACHMENTPARAMETERIVPROC glad_glGetFramebufferAttachmentParameteriv;
 GLAPI PFNGLGETFRAMEBUFFERATTACHMENTPARAMETERIVPROC glad_debug_glGetFramebufferAttachmentParameteriv;
-#define glGetFramebufferAttachmentParameteriv glad_debug_glGetFramebufferAttachmentParameteriv
+#define glGetFramebufferAttachmentParameteriv GLAD_FUNCTION(glGetFramebufferAttachmentParameteriv)
 typedef void (APIENTRYP PFNGLGENERATEMIPMAPPROC)(GLenum target);
 GLAPI PFNGLGENERATEMIPMAPPROC glad_glGenerateMipmap;
 GLAPI PFNGLGENERATEMIPMAPPROC glad_debug_glGenerateMipmap;
-#define glGenerateMipmap glad_debug_glGenerateMipmap
+#define glGenerateMipmap GLAD_FUNCTION(glGenerateMipmap)
 typedef void (APIENTRYP PFNGLBLITFRAMEBUFFERPROC)(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
 GLAPI PFNGLBLITFRAMEBUFFERPROC glad_glBlitFramebuffer;
 GLAPI PFNGLBLITFRAMEBUFFERPROC glad_debug_glBlitFramebuffer;
-#define glBlitFramebuffer glad_debug_glBlitFramebuffer
+#define glBlitFramebuffer GLAD_FUNCTION(glBlitFramebuffer)
 typedef void (APIENTRYP PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC)(GLenum target, GLsizei samples, GLenum internalformat, GLsizei width, GLsizei height);
 GLAPI PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC glad_glRenderbufferStorageMultisample;
 GLAPI PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC glad_debug_glRenderbufferStorageMultisample;
-#define glRenderbufferStorageMultisample glad_debug_glRenderbufferStorageMultisample
+#define glRenderbufferStorageMultisample GLAD_FUNCTION(glRenderbufferStorageMultisample)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERTEXTURELAYERPROC)(GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer);
 GLAPI PFNGLFRAMEBUFFERTEXTURELAYERPROC glad_glFramebufferTextureLayer;
 GLAPI PFNGLFRAMEBUFFERTEXTURELAYERPROC glad_debug_glFramebufferTextureLayer;
-#define glFramebufferTextureLayer glad_debug_glFramebufferTextureLayer
+#define glFramebufferTextureLayer GLAD_FUNCTION(glFramebufferTextureLayer)
 typedef void * (APIENTRYP PFNGLMAPBUFFERRANGEPROC)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
 GLAPI PFNGLMAPBUFFERRANGEPROC glad_glMapBufferRange;
 GLAPI PFNGLMAPBUFFERRANGEPROC glad_debug_glMapBufferRange;
-#define glMapBufferRange glad_debug_glMapBufferRange
+#define glMapBufferRange GLAD_FUNCTION(glMapBufferRange)
 typedef void (APIENTRYP PFNGLFLUSHMAPPEDBUFFERRANGEPROC)(GLenum target, GLintptr offset, GLsizeiptr length);
 GLAPI PFNGLFLUSHMAPPEDBUFFERRANGEPROC glad_glFlushMappedBufferRange;
 GLAPI PFNGLFLUSHMAPPEDBUFFERRANGEPROC glad_debug_glFlushMappedBufferRange;
-#define glFlushMappedBufferRange glad_debug_glFlushMappedBufferRange
+#define glFlushMappedBufferRange GLAD_FUNCTION(glFlushMappedBufferRange)
 typedef void (APIENTRYP PFNGLBINDVERTEXARRAYPROC)(GLuint array);
 GLAPI PFNGLBINDVERTEXARRAYPROC glad_glBindVertexArray;
 GLAPI PFNGLBINDVERTEXARRAYPROC glad_debug_glBindVertexArray;
-#define glBindVertexArray glad_debug_glBindVertexArray
+#define glBindVertexArray GLAD_FUNCTION(glBindVertexArray)
 typedef void (APIENTRYP PFNGLDELETEVERTEXARRAYSPROC)(GLsizei n, const GLuint *arrays);
 GLAPI PFNGLDELETEVERTEXARRAYSPROC glad_glDeleteVertexArrays;
 GLAPI PFNGLDELETEVERTEXARRAYSPROC glad_debug_glDeleteVertexArrays;
-#define glDeleteVertexArrays glad_debug_glDeleteVertexArrays
+#define glDeleteVertexArrays GLAD_FUNCTION(glDeleteVertexArrays)
 typedef void (APIENTRYP PFNGLGENVERTEXARRAYSPROC)(GLsizei n, GLuint *arrays);
 GLAPI PFNGLGENVERTEXARRAYSPROC glad_glGenVertexArrays;
 GLAPI PFNGLGENVERTEXARRAYSPROC glad_debug_glGenVertexArrays;
-#define glGenVertexArrays glad_debug_glGenVertexArrays
+#define glGenVertexArrays GLAD_FUNCTION(glGenVertexArrays)
 typedef GLboolean (APIENTRYP PFNGLISVERTEXARRAYPROC)(GLuint array);
 GLAPI PFNGLISVERTEXARRAYPROC glad_glIsVertexArray;
 GLAPI PFNGLISVERTEXARRAYPROC glad_debug_glIsVertexArray;
-#define glIsVertexArray glad_debug_glIsVertexArray
+#define glIsVertexArray GLAD_FUNCTION(glIsVertexArray)
 #endif
 #ifndef GL_VERSION_3_1
 #define GL_VERSION_3_1 1
@@ -2189,51 +2198,51 @@ GLAPI int GLAD_GL_VERSION_3_1;
 typedef void (APIENTRYP PFNGLDRAWARRAYSINSTANCEDPROC)(GLenum mode, GLint first, GLsizei count, GLsizei instancecount);
 GLAPI PFNGLDRAWARRAYSINSTANCEDPROC glad_glDrawArraysInstanced;
 GLAPI PFNGLDRAWARRAYSINSTANCEDPROC glad_debug_glDrawArraysInstanced;
-#define glDrawArraysInstanced glad_debug_glDrawArraysInstanced
+#define glDrawArraysInstanced GLAD_FUNCTION(glDrawArraysInstanced)
 typedef void (APIENTRYP PFNGLDRAWELEMENTSINSTANCEDPROC)(GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instancecount);
 GLAPI PFNGLDRAWELEMENTSINSTANCEDPROC glad_glDrawElementsInstanced;
 GLAPI PFNGLDRAWELEMENTSINSTANCEDPROC glad_debug_glDrawElementsInstanced;
-#define glDrawElementsInstanced glad_debug_glDrawElementsInstanced
+#define glDrawElementsInstanced GLAD_FUNCTION(glDrawElementsInstanced)
 typedef void (APIENTRYP PFNGLTEXBUFFERPROC)(GLenum target, GLenum internalformat, GLuint buffer);
 GLAPI PFNGLTEXBUFFERPROC glad_glTexBuffer;
 GLAPI PFNGLTEXBUFFERPROC glad_debug_glTexBuffer;
-#define glTexBuffer glad_debug_glTexBuffer
+#define glTexBuffer GLAD_FUNCTION(glTexBuffer)
 typedef void (APIENTRYP PFNGLPRIMITIVERESTARTINDEXPROC)(GLuint index);
 GLAPI PFNGLPRIMITIVERESTARTINDEXPROC glad_glPrimitiveRestartIndex;
 GLAPI PFNGLPRIMITIVERESTARTINDEXPROC glad_debug_glPrimitiveRestartIndex;
-#define glPrimitiveRestartIndex glad_debug_glPrimitiveRestartIndex
+#define glPrimitiveRestartIndex GLAD_FUNCTION(glPrimitiveRestartIndex)
 typedef void (APIENTRYP PFNGLCOPYBUFFERSUBDATAPROC)(GLenum readTarget, GLenum writeTarget, GLintptr readOffset, GLintptr writeOffset, GLsizeiptr size);
 GLAPI PFNGLCOPYBUFFERSUBDATAPROC glad_glCopyBufferSubData;
 GLAPI PFNGLCOPYBUFFERSUBDATAPROC glad_debug_glCopyBufferSubData;
-#define glCopyBufferSubData glad_debug_glCopyBufferSubData
+#define glCopyBufferSubData GLAD_FUNCTION(glCopyBufferSubData)
 typedef void (APIENTRYP PFNGLGETUNIFORMINDICESPROC)(GLuint program, GLsizei uniformCount, const GLchar *const*uniformNames, GLuint *uniformIndices);
 GLAPI PFNGLGETUNIFORMINDICESPROC glad_glGetUniformIndices;
 GLAPI PFNGLGETUNIFORMINDICESPROC glad_debug_glGetUniformIndices;
-#define glGetUniformIndices glad_debug_glGetUniformIndices
+#define glGetUniformIndices GLAD_FUNCTION(glGetUniformIndices)
 typedef void (APIENTRYP PFNGLGETACTIVEUNIFORMSIVPROC)(GLuint program, GLsizei uniformCount, const GLuint *uniformIndices, GLenum pname, GLint *params);
 GLAPI PFNGLGETACTIVEUNIFORMSIVPROC glad_glGetActiveUniformsiv;
 GLAPI PFNGLGETACTIVEUNIFORMSIVPROC glad_debug_glGetActiveUniformsiv;
-#define glGetActiveUniformsiv glad_debug_glGetActiveUniformsiv
+#define glGetActiveUniformsiv GLAD_FUNCTION(glGetActiveUniformsiv)
 typedef void (APIENTRYP PFNGLGETACTIVEUNIFORMNAMEPROC)(GLuint program, GLuint uniformIndex, GLsizei bufSize, GLsizei *length, GLchar *uniformName);
 GLAPI PFNGLGETACTIVEUNIFORMNAMEPROC glad_glGetActiveUniformName;
 GLAPI PFNGLGETACTIVEUNIFORMNAMEPROC glad_debug_glGetActiveUniformName;
-#define glGetActiveUniformName glad_debug_glGetActiveUniformName
+#define glGetActiveUniformName GLAD_FUNCTION(glGetActiveUniformName)
 typedef GLuint (APIENTRYP PFNGLGETUNIFORMBLOCKINDEXPROC)(GLuint program, const GLchar *uniformBlockName);
 GLAPI PFNGLGETUNIFORMBLOCKINDEXPROC glad_glGetUniformBlockIndex;
 GLAPI PFNGLGETUNIFORMBLOCKINDEXPROC glad_debug_glGetUniformBlockIndex;
-#define glGetUniformBlockIndex glad_debug_glGetUniformBlockIndex
+#define glGetUniformBlockIndex GLAD_FUNCTION(glGetUniformBlockIndex)
 typedef void (APIENTRYP PFNGLGETACTIVEUNIFORMBLOCKIVPROC)(GLuint program, GLuint uniformBlockIndex, GLenum pname, GLint *params);
 GLAPI PFNGLGETACTIVEUNIFORMBLOCKIVPROC glad_glGetActiveUniformBlockiv;
 GLAPI PFNGLGETACTIVEUNIFORMBLOCKIVPROC glad_debug_glGetActiveUniformBlockiv;
-#define glGetActiveUniformBlockiv glad_debug_glGetActiveUniformBlockiv
+#define glGetActiveUniformBlockiv GLAD_FUNCTION(glGetActiveUniformBlockiv)
 typedef void (APIENTRYP PFNGLGETACTIVEUNIFORMBLOCKNAMEPROC)(GLuint program, GLuint uniformBlockIndex, GLsizei bufSize, GLsizei *length, GLchar *uniformBlockName);
 GLAPI PFNGLGETACTIVEUNIFORMBLOCKNAMEPROC glad_glGetActiveUniformBlockName;
 GLAPI PFNGLGETACTIVEUNIFORMBLOCKNAMEPROC glad_debug_glGetActiveUniformBlockName;
-#define glGetActiveUniformBlockName glad_debug_glGetActiveUniformBlockName
+#define glGetActiveUniformBlockName GLAD_FUNCTION(glGetActiveUniformBlockName)
 typedef void (APIENTRYP PFNGLUNIFORMBLOCKBINDINGPROC)(GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding);
 GLAPI PFNGLUNIFORMBLOCKBINDINGPROC glad_glUniformBlockBinding;
 GLAPI PFNGLUNIFORMBLOCKBINDINGPROC glad_debug_glUniformBlockBinding;
-#define glUniformBlockBinding glad_debug_glUniformBlockBinding
+#define glUniformBlockBinding GLAD_FUNCTION(glUniformBlockBinding)
 #endif
 #ifndef GL_VERSION_3_2
 #define GL_VERSION_3_2 1
@@ -2241,79 +2250,79 @@ GLAPI int GLAD_GL_VERSION_3_2;
 typedef void (APIENTRYP PFNGLDRAWELEMENTSBASEVERTEXPROC)(GLenum mode, GLsizei count, GLenum type, const void *indices, GLint basevertex);
 GLAPI PFNGLDRAWELEMENTSBASEVERTEXPROC glad_glDrawElementsBaseVertex;
 GLAPI PFNGLDRAWELEMENTSBASEVERTEXPROC glad_debug_glDrawElementsBaseVertex;
-#define glDrawElementsBaseVertex glad_debug_glDrawElementsBaseVertex
+#define glDrawElementsBaseVertex GLAD_FUNCTION(glDrawElementsBaseVertex)
 typedef void (APIENTRYP PFNGLDRAWRANGEELEMENTSBASEVERTEXPROC)(GLenum mode, GLuint start, GLuint end, GLsizei count, GLenum type, const void *indices, GLint basevertex);
 GLAPI PFNGLDRAWRANGEELEMENTSBASEVERTEXPROC glad_glDrawRangeElementsBaseVertex;
 GLAPI PFNGLDRAWRANGEELEMENTSBASEVERTEXPROC glad_debug_glDrawRangeElementsBaseVertex;
-#define glDrawRangeElementsBaseVertex glad_debug_glDrawRangeElementsBaseVertex
+#define glDrawRangeElementsBaseVertex GLAD_FUNCTION(glDrawRangeElementsBaseVertex)
 typedef void (APIENTRYP PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC)(GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instancecount, GLint basevertex);
 GLAPI PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC glad_glDrawElementsInstancedBaseVertex;
 GLAPI PFNGLDRAWELEMENTSINSTANCEDBASEVERTEXPROC glad_debug_glDrawElementsInstancedBaseVertex;
-#define glDrawElementsInstancedBaseVertex glad_debug_glDrawElementsInstancedBaseVertex
+#define glDrawElementsInstancedBaseVertex GLAD_FUNCTION(glDrawElementsInstancedBaseVertex)
 typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSBASEVERTEXPROC)(GLenum mode, const GLsizei *count, GLenum type, const void *const*indices, GLsizei drawcount, const GLint *basevertex);
 GLAPI PFNGLMULTIDRAWELEMENTSBASEVERTEXPROC glad_glMultiDrawElementsBaseVertex;
 GLAPI PFNGLMULTIDRAWELEMENTSBASEVERTEXPROC glad_debug_glMultiDrawElementsBaseVertex;
-#define glMultiDrawElementsBaseVertex glad_debug_glMultiDrawElementsBaseVertex
+#define glMultiDrawElementsBaseVertex GLAD_FUNCTION(glMultiDrawElementsBaseVertex)
 typedef void (APIENTRYP PFNGLPROVOKINGVERTEXPROC)(GLenum mode);
 GLAPI PFNGLPROVOKINGVERTEXPROC glad_glProvokingVertex;
 GLAPI PFNGLPROVOKINGVERTEXPROC glad_debug_glProvokingVertex;
-#define glProvokingVertex glad_debug_glProvokingVertex
+#define glProvokingVertex GLAD_FUNCTION(glProvokingVertex)
 typedef GLsync (APIENTRYP PFNGLFENCESYNCPROC)(GLenum condition, GLbitfield flags);
 GLAPI PFNGLFENCESYNCPROC glad_glFenceSync;
 GLAPI PFNGLFENCESYNCPROC glad_debug_glFenceSync;
-#define glFenceSync glad_debug_glFenceSync
+#define glFenceSync GLAD_FUNCTION(glFenceSync)
 typedef GLboolean (APIENTRYP PFNGLISSYNCPROC)(GLsync sync);
 GLAPI PFNGLISSYNCPROC glad_glIsSync;
 GLAPI PFNGLISSYNCPROC glad_debug_glIsSync;
-#define glIsSync glad_debug_glIsSync
+#define glIsSync GLAD_FUNCTION(glIsSync)
 typedef void (APIENTRYP PFNGLDELETESYNCPROC)(GLsync sync);
 GLAPI PFNGLDELETESYNCPROC glad_glDeleteSync;
 GLAPI PFNGLDELETESYNCPROC glad_debug_glDeleteSync;
-#define glDeleteSync glad_debug_glDeleteSync
+#define glDeleteSync GLAD_FUNCTION(glDeleteSync)
 typedef GLenum (APIENTRYP PFNGLCLIENTWAITSYNCPROC)(GLsync sync, GLbitfield flags, GLuint64 timeout);
 GLAPI PFNGLCLIENTWAITSYNCPROC glad_glClientWaitSync;
 GLAPI PFNGLCLIENTWAITSYNCPROC glad_debug_glClientWaitSync;
-#define glClientWaitSync glad_debug_glClientWaitSync
+#define glClientWaitSync GLAD_FUNCTION(glClientWaitSync)
 typedef void (APIENTRYP PFNGLWAITSYNCPROC)(GLsync sync, GLbitfield flags, GLuint64 timeout);
 GLAPI PFNGLWAITSYNCPROC glad_glWaitSync;
 GLAPI PFNGLWAITSYNCPROC glad_debug_glWaitSync;
-#define glWaitSync glad_debug_glWaitSync
+#define glWaitSync GLAD_FUNCTION(glWaitSync)
 typedef void (APIENTRYP PFNGLGETINTEGER64VPROC)(GLenum pname, GLint64 *data);
 GLAPI PFNGLGETINTEGER64VPROC glad_glGetInteger64v;
 GLAPI PFNGLGETINTEGER64VPROC glad_debug_glGetInteger64v;
-#define glGetInteger64v glad_debug_glGetInteger64v
+#define glGetInteger64v GLAD_FUNCTION(glGetInteger64v)
 typedef void (APIENTRYP PFNGLGETSYNCIVPROC)(GLsync sync, GLenum pname, GLsizei bufSize, GLsizei *length, GLint *values);
 GLAPI PFNGLGETSYNCIVPROC glad_glGetSynciv;
 GLAPI PFNGLGETSYNCIVPROC glad_debug_glGetSynciv;
-#define glGetSynciv glad_debug_glGetSynciv
+#define glGetSynciv GLAD_FUNCTION(glGetSynciv)
 typedef void (APIENTRYP PFNGLGETINTEGER64I_VPROC)(GLenum target, GLuint index, GLint64 *data);
 GLAPI PFNGLGETINTEGER64I_VPROC glad_glGetInteger64i_v;
 GLAPI PFNGLGETINTEGER64I_VPROC glad_debug_glGetInteger64i_v;
-#define glGetInteger64i_v glad_debug_glGetInteger64i_v
+#define glGetInteger64i_v GLAD_FUNCTION(glGetInteger64i_v)
 typedef void (APIENTRYP PFNGLGETBUFFERPARAMETERI64VPROC)(GLenum target, GLenum pname, GLint64 *params);
 GLAPI PFNGLGETBUFFERPARAMETERI64VPROC glad_glGetBufferParameteri64v;
 GLAPI PFNGLGETBUFFERPARAMETERI64VPROC glad_debug_glGetBufferParameteri64v;
-#define glGetBufferParameteri64v glad_debug_glGetBufferParameteri64v
+#define glGetBufferParameteri64v GLAD_FUNCTION(glGetBufferParameteri64v)
 typedef void (APIENTRYP PFNGLFRAMEBUFFERTEXTUREPROC)(GLenum target, GLenum attachment, GLuint texture, GLint level);
 GLAPI PFNGLFRAMEBUFFERTEXTUREPROC glad_glFramebufferTexture;
 GLAPI PFNGLFRAMEBUFFERTEXTUREPROC glad_debug_glFramebufferTexture;
-#define glFramebufferTexture glad_debug_glFramebufferTexture
+#define glFramebufferTexture GLAD_FUNCTION(glFramebufferTexture)
 typedef void (APIENTRYP PFNGLTEXIMAGE2DMULTISAMPLEPROC)(GLenum target, GLsizei samples, GLenum internalformat, GLsizei width, GLsizei height, GLboolean fixedsamplelocations);
 GLAPI PFNGLTEXIMAGE2DMULTISAMPLEPROC glad_glTexImage2DMultisample;
 GLAPI PFNGLTEXIMAGE2DMULTISAMPLEPROC glad_debug_glTexImage2DMultisample;
-#define glTexImage2DMultisample glad_debug_glTexImage2DMultisample
+#define glTexImage2DMultisample GLAD_FUNCTION(glTexImage2DMultisample)
 typedef void (APIENTRYP PFNGLTEXIMAGE3DMULTISAMPLEPROC)(GLenum target, GLsizei samples, GLenum internalformat, GLsizei width, GLsizei height, GLsizei depth, GLboolean fixedsamplelocations);
 GLAPI PFNGLTEXIMAGE3DMULTISAMPLEPROC glad_glTexImage3DMultisample;
 GLAPI PFNGLTEXIMAGE3DMULTISAMPLEPROC glad_debug_glTexImage3DMultisample;
-#define glTexImage3DMultisample glad_debug_glTexImage3DMultisample
+#define glTexImage3DMultisample GLAD_FUNCTION(glTexImage3DMultisample)
 typedef void (APIENTRYP PFNGLGETMULTISAMPLEFVPROC)(GLenum pname, GLuint index, GLfloat *val);
 GLAPI PFNGLGETMULTISAMPLEFVPROC glad_glGetMultisamplefv;
 GLAPI PFNGLGETMULTISAMPLEFVPROC glad_debug_glGetMultisamplefv;
-#define glGetMultisamplefv glad_debug_glGetMultisamplefv
+#define glGetMultisamplefv GLAD_FUNCTION(glGetMultisamplefv)
 typedef void (APIENTRYP PFNGLSAMPLEMASKIPROC)(GLuint maskNumber, GLbitfield mask);
 GLAPI PFNGLSAMPLEMASKIPROC glad_glSampleMaski;
 GLAPI PFNGLSAMPLEMASKIPROC glad_debug_glSampleMaski;
-#define glSampleMaski glad_debug_glSampleMaski
+#define glSampleMaski GLAD_FUNCTION(glSampleMaski)
 #endif
 #ifndef GL_VERSION_3_3
 #define GL_VERSION_3_3 1
@@ -2321,235 +2330,235 @@ GLAPI int GLAD_GL_VERSION_3_3;
 typedef void (APIENTRYP PFNGLBINDFRAGDATALOCATIONINDEXEDPROC)(GLuint program, GLuint colorNumber, GLuint index, const GLchar *name);
 GLAPI PFNGLBINDFRAGDATALOCATIONINDEXEDPROC glad_glBindFragDataLocationIndexed;
 GLAPI PFNGLBINDFRAGDATALOCATIONINDEXEDPROC glad_debug_glBindFragDataLocationIndexed;
-#define glBindFragDataLocationIndexed glad_debug_glBindFragDataLocationIndexed
+#define glBindFragDataLocationIndexed GLAD_FUNCTION(glBindFragDataLocationIndexed)
 typedef GLint (APIENTRYP PFNGLGETFRAGDATAINDEXPROC)(GLuint program, const GLchar *name);
 GLAPI PFNGLGETFRAGDATAINDEXPROC glad_glGetFragDataIndex;
 GLAPI PFNGLGETFRAGDATAINDEXPROC glad_debug_glGetFragDataIndex;
-#define glGetFragDataIndex glad_debug_glGetFragDataIndex
+#define glGetFragDataIndex GLAD_FUNCTION(glGetFragDataIndex)
 typedef void (APIENTRYP PFNGLGENSAMPLERSPROC)(GLsizei count, GLuint *samplers);
 GLAPI PFNGLGENSAMPLERSPROC glad_glGenSamplers;
 GLAPI PFNGLGENSAMPLERSPROC glad_debug_glGenSamplers;
-#define glGenSamplers glad_debug_glGenSamplers
+#define glGenSamplers GLAD_FUNCTION(glGenSamplers)
 typedef void (APIENTRYP PFNGLDELETESAMPLERSPROC)(GLsizei count, const GLuint *samplers);
 GLAPI PFNGLDELETESAMPLERSPROC glad_glDeleteSamplers;
 GLAPI PFNGLDELETESAMPLERSPROC glad_debug_glDeleteSamplers;
-#define glDeleteSamplers glad_debug_glDeleteSamplers
+#define glDeleteSamplers GLAD_FUNCTION(glDeleteSamplers)
 typedef GLboolean (APIENTRYP PFNGLISSAMPLERPROC)(GLuint sampler);
 GLAPI PFNGLISSAMPLERPROC glad_glIsSampler;
 GLAPI PFNGLISSAMPLERPROC glad_debug_glIsSampler;
-#define glIsSampler glad_debug_glIsSampler
+#define glIsSampler GLAD_FUNCTION(glIsSampler)
 typedef void (APIENTRYP PFNGLBINDSAMPLERPROC)(GLuint unit, GLuint sampler);
 GLAPI PFNGLBINDSAMPLERPROC glad_glBindSampler;
 GLAPI PFNGLBINDSAMPLERPROC glad_debug_glBindSampler;
-#define glBindSampler glad_debug_glBindSampler
+#define glBindSampler GLAD_FUNCTION(glBindSampler)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERIPROC)(GLuint sampler, GLenum pname, GLint param);
 GLAPI PFNGLSAMPLERPARAMETERIPROC glad_glSamplerParameteri;
 GLAPI PFNGLSAMPLERPARAMETERIPROC glad_debug_glSamplerParameteri;
-#define glSamplerParameteri glad_debug_glSamplerParameteri
+#define glSamplerParameteri GLAD_FUNCTION(glSamplerParameteri)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERIVPROC)(GLuint sampler, GLenum pname, const GLint *param);
 GLAPI PFNGLSAMPLERPARAMETERIVPROC glad_glSamplerParameteriv;
 GLAPI PFNGLSAMPLERPARAMETERIVPROC glad_debug_glSamplerParameteriv;
-#define glSamplerParameteriv glad_debug_glSamplerParameteriv
+#define glSamplerParameteriv GLAD_FUNCTION(glSamplerParameteriv)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERFPROC)(GLuint sampler, GLenum pname, GLfloat param);
 GLAPI PFNGLSAMPLERPARAMETERFPROC glad_glSamplerParameterf;
 GLAPI PFNGLSAMPLERPARAMETERFPROC glad_debug_glSamplerParameterf;
-#define glSamplerParameterf glad_debug_glSamplerParameterf
+#define glSamplerParameterf GLAD_FUNCTION(glSamplerParameterf)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERFVPROC)(GLuint sampler, GLenum pname, const GLfloat *param);
 GLAPI PFNGLSAMPLERPARAMETERFVPROC glad_glSamplerParameterfv;
 GLAPI PFNGLSAMPLERPARAMETERFVPROC glad_debug_glSamplerParameterfv;
-#define glSamplerParameterfv glad_debug_glSamplerParameterfv
+#define glSamplerParameterfv GLAD_FUNCTION(glSamplerParameterfv)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERIIVPROC)(GLuint sampler, GLenum pname, const GLint *param);
 GLAPI PFNGLSAMPLERPARAMETERIIVPROC glad_glSamplerParameterIiv;
 GLAPI PFNGLSAMPLERPARAMETERIIVPROC glad_debug_glSamplerParameterIiv;
-#define glSamplerParameterIiv glad_debug_glSamplerParameterIiv
+#define glSamplerParameterIiv GLAD_FUNCTION(glSamplerParameterIiv)
 typedef void (APIENTRYP PFNGLSAMPLERPARAMETERIUIVPROC)(GLuint sampler, GLenum pname, const GLuint *param);
 GLAPI PFNGLSAMPLERPARAMETERIUIVPROC glad_glSamplerParameterIuiv;
 GLAPI PFNGLSAMPLERPARAMETERIUIVPROC glad_debug_glSamplerParameterIuiv;
-#define glSamplerParameterIuiv glad_debug_glSamplerParameterIuiv
+#define glSamplerParameterIuiv GLAD_FUNCTION(glSamplerParameterIuiv)
 typedef void (APIENTRYP PFNGLGETSAMPLERPARAMETERIVPROC)(GLuint sampler, GLenum pname, GLint *params);
 GLAPI PFNGLGETSAMPLERPARAMETERIVPROC glad_glGetSamplerParameteriv;
 GLAPI PFNGLGETSAMPLERPARAMETERIVPROC glad_debug_glGetSamplerParameteriv;
-#define glGetSamplerParameteriv glad_debug_glGetSamplerParameteriv
+#define glGetSamplerParameteriv GLAD_FUNCTION(glGetSamplerParameteriv)
 typedef void (APIENTRYP PFNGLGETSAMPLERPARAMETERIIVPROC)(GLuint sampler, GLenum pname, GLint *params);
 GLAPI PFNGLGETSAMPLERPARAMETERIIVPROC glad_glGetSamplerParameterIiv;
 GLAPI PFNGLGETSAMPLERPARAMETERIIVPROC glad_debug_glGetSamplerParameterIiv;
-#define glGetSamplerParameterIiv glad_debug_glGetSamplerParameterIiv
+#define glGetSamplerParameterIiv GLAD_FUNCTION(glGetSamplerParameterIiv)
 typedef void (APIENTRYP PFNGLGETSAMPLERPARAMETERFVPROC)(GLuint sampler, GLenum pname, GLfloat *params);
 GLAPI PFNGLGETSAMPLERPARAMETERFVPROC glad_glGetSamplerParameterfv;
 GLAPI PFNGLGETSAMPLERPARAMETERFVPROC glad_debug_glGetSamplerParameterfv;
-#define glGetSamplerParameterfv glad_debug_glGetSamplerParameterfv
+#define glGetSamplerParameterfv GLAD_FUNCTION(glGetSamplerParameterfv)
 typedef void (APIENTRYP PFNGLGETSAMPLERPARAMETERIUIVPROC)(GLuint sampler, GLenum pname, GLuint *params);
 GLAPI PFNGLGETSAMPLERPARAMETERIUIVPROC glad_glGetSamplerParameterIuiv;
 GLAPI PFNGLGETSAMPLERPARAMETERIUIVPROC glad_debug_glGetSamplerParameterIuiv;
-#define glGetSamplerParameterIuiv glad_debug_glGetSamplerParameterIuiv
+#define glGetSamplerParameterIuiv GLAD_FUNCTION(glGetSamplerParameterIuiv)
 typedef void (APIENTRYP PFNGLQUERYCOUNTERPROC)(GLuint id, GLenum target);
 GLAPI PFNGLQUERYCOUNTERPROC glad_glQueryCounter;
 GLAPI PFNGLQUERYCOUNTERPROC glad_debug_glQueryCounter;
-#define glQueryCounter glad_debug_glQueryCounter
+#define glQueryCounter GLAD_FUNCTION(glQueryCounter)
 typedef void (APIENTRYP PFNGLGETQUERYOBJECTI64VPROC)(GLuint id, GLenum pname, GLint64 *params);
 GLAPI PFNGLGETQUERYOBJECTI64VPROC glad_glGetQueryObjecti64v;
 GLAPI PFNGLGETQUERYOBJECTI64VPROC glad_debug_glGetQueryObjecti64v;
-#define glGetQueryObjecti64v glad_debug_glGetQueryObjecti64v
+#define glGetQueryObjecti64v GLAD_FUNCTION(glGetQueryObjecti64v)
 typedef void (APIENTRYP PFNGLGETQUERYOBJECTUI64VPROC)(GLuint id, GLenum pname, GLuint64 *params);
 GLAPI PFNGLGETQUERYOBJECTUI64VPROC glad_glGetQueryObjectui64v;
 GLAPI PFNGLGETQUERYOBJECTUI64VPROC glad_debug_glGetQueryObjectui64v;
-#define glGetQueryObjectui64v glad_debug_glGetQueryObjectui64v
+#define glGetQueryObjectui64v GLAD_FUNCTION(glGetQueryObjectui64v)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBDIVISORPROC)(GLuint index, GLuint divisor);
 GLAPI PFNGLVERTEXATTRIBDIVISORPROC glad_glVertexAttribDivisor;
 GLAPI PFNGLVERTEXATTRIBDIVISORPROC glad_debug_glVertexAttribDivisor;
-#define glVertexAttribDivisor glad_debug_glVertexAttribDivisor
+#define glVertexAttribDivisor GLAD_FUNCTION(glVertexAttribDivisor)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP1UIPROC)(GLuint index, GLenum type, GLboolean normalized, GLuint value);
 GLAPI PFNGLVERTEXATTRIBP1UIPROC glad_glVertexAttribP1ui;
 GLAPI PFNGLVERTEXATTRIBP1UIPROC glad_debug_glVertexAttribP1ui;
-#define glVertexAttribP1ui glad_debug_glVertexAttribP1ui
+#define glVertexAttribP1ui GLAD_FUNCTION(glVertexAttribP1ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP1UIVPROC)(GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 GLAPI PFNGLVERTEXATTRIBP1UIVPROC glad_glVertexAttribP1uiv;
 GLAPI PFNGLVERTEXATTRIBP1UIVPROC glad_debug_glVertexAttribP1uiv;
-#define glVertexAttribP1uiv glad_debug_glVertexAttribP1uiv
+#define glVertexAttribP1uiv GLAD_FUNCTION(glVertexAttribP1uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP2UIPROC)(GLuint index, GLenum type, GLboolean normalized, GLuint value);
 GLAPI PFNGLVERTEXATTRIBP2UIPROC glad_glVertexAttribP2ui;
 GLAPI PFNGLVERTEXATTRIBP2UIPROC glad_debug_glVertexAttribP2ui;
-#define glVertexAttribP2ui glad_debug_glVertexAttribP2ui
+#define glVertexAttribP2ui GLAD_FUNCTION(glVertexAttribP2ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP2UIVPROC)(GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 GLAPI PFNGLVERTEXATTRIBP2UIVPROC glad_glVertexAttribP2uiv;
 GLAPI PFNGLVERTEXATTRIBP2UIVPROC glad_debug_glVertexAttribP2uiv;
-#define glVertexAttribP2uiv glad_debug_glVertexAttribP2uiv
+#define glVertexAttribP2uiv GLAD_FUNCTION(glVertexAttribP2uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP3UIPROC)(GLuint index, GLenum type, GLboolean normalized, GLuint value);
 GLAPI PFNGLVERTEXATTRIBP3UIPROC glad_glVertexAttribP3ui;
 GLAPI PFNGLVERTEXATTRIBP3UIPROC glad_debug_glVertexAttribP3ui;
-#define glVertexAttribP3ui glad_debug_glVertexAttribP3ui
+#define glVertexAttribP3ui GLAD_FUNCTION(glVertexAttribP3ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP3UIVPROC)(GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 GLAPI PFNGLVERTEXATTRIBP3UIVPROC glad_glVertexAttribP3uiv;
 GLAPI PFNGLVERTEXATTRIBP3UIVPROC glad_debug_glVertexAttribP3uiv;
-#define glVertexAttribP3uiv glad_debug_glVertexAttribP3uiv
+#define glVertexAttribP3uiv GLAD_FUNCTION(glVertexAttribP3uiv)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP4UIPROC)(GLuint index, GLenum type, GLboolean normalized, GLuint value);
 GLAPI PFNGLVERTEXATTRIBP4UIPROC glad_glVertexAttribP4ui;
 GLAPI PFNGLVERTEXATTRIBP4UIPROC glad_debug_glVertexAttribP4ui;
-#define glVertexAttribP4ui glad_debug_glVertexAttribP4ui
+#define glVertexAttribP4ui GLAD_FUNCTION(glVertexAttribP4ui)
 typedef void (APIENTRYP PFNGLVERTEXATTRIBP4UIVPROC)(GLuint index, GLenum type, GLboolean normalized, const GLuint *value);
 GLAPI PFNGLVERTEXATTRIBP4UIVPROC glad_glVertexAttribP4uiv;
 GLAPI PFNGLVERTEXATTRIBP4UIVPROC glad_debug_glVertexAttribP4uiv;
-#define glVertexAttribP4uiv glad_debug_glVertexAttribP4uiv
+#define glVertexAttribP4uiv GLAD_FUNCTION(glVertexAttribP4uiv)
 typedef void (APIENTRYP PFNGLVERTEXP2UIPROC)(GLenum type, GLuint value);
 GLAPI PFNGLVERTEXP2UIPROC glad_glVertexP2ui;
 GLAPI PFNGLVERTEXP2UIPROC glad_debug_glVertexP2ui;
-#define glVertexP2ui glad_debug_glVertexP2ui
+#define glVertexP2ui GLAD_FUNCTION(glVertexP2ui)
 typedef void (APIENTRYP PFNGLVERTEXP2UIVPROC)(GLenum type, const GLuint *value);
 GLAPI PFNGLVERTEXP2UIVPROC glad_glVertexP2uiv;
 GLAPI PFNGLVERTEXP2UIVPROC glad_debug_glVertexP2uiv;
-#define glVertexP2uiv glad_debug_glVertexP2uiv
+#define glVertexP2uiv GLAD_FUNCTION(glVertexP2uiv)
 typedef void (APIENTRYP PFNGLVERTEXP3UIPROC)(GLenum type, GLuint value);
 GLAPI PFNGLVERTEXP3UIPROC glad_glVertexP3ui;
 GLAPI PFNGLVERTEXP3UIPROC glad_debug_glVertexP3ui;
-#define glVertexP3ui glad_debug_glVertexP3ui
+#define glVertexP3ui GLAD_FUNCTION(glVertexP3ui)
 typedef void (APIENTRYP PFNGLVERTEXP3UIVPROC)(GLenum type, const GLuint *value);
 GLAPI PFNGLVERTEXP3UIVPROC glad_glVertexP3uiv;
 GLAPI PFNGLVERTEXP3UIVPROC glad_debug_glVertexP3uiv;
-#define glVertexP3uiv glad_debug_glVertexP3uiv
+#define glVertexP3uiv GLAD_FUNCTION(glVertexP3uiv)
 typedef void (APIENTRYP PFNGLVERTEXP4UIPROC)(GLenum type, GLuint value);
 GLAPI PFNGLVERTEXP4UIPROC glad_glVertexP4ui;
 GLAPI PFNGLVERTEXP4UIPROC glad_debug_glVertexP4ui;
-#define glVertexP4ui glad_debug_glVertexP4ui
+#define glVertexP4ui GLAD_FUNCTION(glVertexP4ui)
 typedef void (APIENTRYP PFNGLVERTEXP4UIVPROC)(GLenum type, const GLuint *value);
 GLAPI PFNGLVERTEXP4UIVPROC glad_glVertexP4uiv;
 GLAPI PFNGLVERTEXP4UIVPROC glad_debug_glVertexP4uiv;
-#define glVertexP4uiv glad_debug_glVertexP4uiv
+#define glVertexP4uiv GLAD_FUNCTION(glVertexP4uiv)
 typedef void (APIENTRYP PFNGLTEXCOORDP1UIPROC)(GLenum type, GLuint coords);
 GLAPI PFNGLTEXCOORDP1UIPROC glad_glTexCoordP1ui;
 GLAPI PFNGLTEXCOORDP1UIPROC glad_debug_glTexCoordP1ui;
-#define glTexCoordP1ui glad_debug_glTexCoordP1ui
+#define glTexCoordP1ui GLAD_FUNCTION(glTexCoordP1ui)
 typedef void (APIENTRYP PFNGLTEXCOORDP1UIVPROC)(GLenum type, const GLuint *coords);
 GLAPI PFNGLTEXCOORDP1UIVPROC glad_glTexCoordP1uiv;
 GLAPI PFNGLTEXCOORDP1UIVPROC glad_debug_glTexCoordP1uiv;
-#define glTexCoordP1uiv glad_debug_glTexCoordP1uiv
+#define glTexCoordP1uiv GLAD_FUNCTION(glTexCoordP1uiv)
 typedef void (APIENTRYP PFNGLTEXCOORDP2UIPROC)(GLenum type, GLuint coords);
 GLAPI PFNGLTEXCOORDP2UIPROC glad_glTexCoordP2ui;
 GLAPI PFNGLTEXCOORDP2UIPROC glad_debug_glTexCoordP2ui;
-#define glTexCoordP2ui glad_debug_glTexCoordP2ui
+#define glTexCoordP2ui GLAD_FUNCTION(glTexCoordP2ui)
 typedef void (APIENTRYP PFNGLTEXCOORDP2UIVPROC)(GLenum type, const GLuint *coords);
 GLAPI PFNGLTEXCOORDP2UIVPROC glad_glTexCoordP2uiv;
 GLAPI PFNGLTEXCOORDP2UIVPROC glad_debug_glTexCoordP2uiv;
-#define glTexCoordP2uiv glad_debug_glTexCoordP2uiv
+#define glTexCoordP2uiv GLAD_FUNCTION(glTexCoordP2uiv)
 typedef void (APIENTRYP PFNGLTEXCOORDP3UIPROC)(GLenum type, GLuint coords);
 GLAPI PFNGLTEXCOORDP3UIPROC glad_glTexCoordP3ui;
 GLAPI PFNGLTEXCOORDP3UIPROC glad_debug_glTexCoordP3ui;
-#define glTexCoordP3ui glad_debug_glTexCoordP3ui
+#define glTexCoordP3ui GLAD_FUNCTION(glTexCoordP3ui)
 typedef void (APIENTRYP PFNGLTEXCOORDP3UIVPROC)(GLenum type, const GLuint *coords);
 GLAPI PFNGLTEXCOORDP3UIVPROC glad_glTexCoordP3uiv;
 GLAPI PFNGLTEXCOORDP3UIVPROC glad_debug_glTexCoordP3uiv;
-#define glTexCoordP3uiv glad_debug_glTexCoordP3uiv
+#define glTexCoordP3uiv GLAD_FUNCTION(glTexCoordP3uiv)
 typedef void (APIENTRYP PFNGLTEXCOORDP4UIPROC)(GLenum type, GLuint coords);
 GLAPI PFNGLTEXCOORDP4UIPROC glad_glTexCoordP4ui;
 GLAPI PFNGLTEXCOORDP4UIPROC glad_debug_glTexCoordP4ui;
-#define glTexCoordP4ui glad_debug_glTexCoordP4ui
+#define glTexCoordP4ui GLAD_FUNCTION(glTexCoordP4ui)
 typedef void (APIENTRYP PFNGLTEXCOORDP4UIVPROC)(GLenum type, const GLuint *coords);
 GLAPI PFNGLTEXCOORDP4UIVPROC glad_glTexCoordP4uiv;
 GLAPI PFNGLTEXCOORDP4UIVPROC glad_debug_glTexCoordP4uiv;
-#define glTexCoordP4uiv glad_debug_glTexCoordP4uiv
+#define glTexCoordP4uiv GLAD_FUNCTION(glTexCoordP4uiv)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP1UIPROC)(GLenum texture, GLenum type, GLuint coords);
 GLAPI PFNGLMULTITEXCOORDP1UIPROC glad_glMultiTexCoordP1ui;
 GLAPI PFNGLMULTITEXCOORDP1UIPROC glad_debug_glMultiTexCoordP1ui;
-#define glMultiTexCoordP1ui glad_debug_glMultiTexCoordP1ui
+#define glMultiTexCoordP1ui GLAD_FUNCTION(glMultiTexCoordP1ui)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP1UIVPROC)(GLenum texture, GLenum type, const GLuint *coords);
 GLAPI PFNGLMULTITEXCOORDP1UIVPROC glad_glMultiTexCoordP1uiv;
 GLAPI PFNGLMULTITEXCOORDP1UIVPROC glad_debug_glMultiTexCoordP1uiv;
-#define glMultiTexCoordP1uiv glad_debug_glMultiTexCoordP1uiv
+#define glMultiTexCoordP1uiv GLAD_FUNCTION(glMultiTexCoordP1uiv)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP2UIPROC)(GLenum texture, GLenum type, GLuint coords);
 GLAPI PFNGLMULTITEXCOORDP2UIPROC glad_glMultiTexCoordP2ui;
 GLAPI PFNGLMULTITEXCOORDP2UIPROC glad_debug_glMultiTexCoordP2ui;
-#define glMultiTexCoordP2ui glad_debug_glMultiTexCoordP2ui
+#define glMultiTexCoordP2ui GLAD_FUNCTION(glMultiTexCoordP2ui)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP2UIVPROC)(GLenum texture, GLenum type, const GLuint *coords);
 GLAPI PFNGLMULTITEXCOORDP2UIVPROC glad_glMultiTexCoordP2uiv;
 GLAPI PFNGLMULTITEXCOORDP2UIVPROC glad_debug_glMultiTexCoordP2uiv;
-#define glMultiTexCoordP2uiv glad_debug_glMultiTexCoordP2uiv
+#define glMultiTexCoordP2uiv GLAD_FUNCTION(glMultiTexCoordP2uiv)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP3UIPROC)(GLenum texture, GLenum type, GLuint coords);
 GLAPI PFNGLMULTITEXCOORDP3UIPROC glad_glMultiTexCoordP3ui;
 GLAPI PFNGLMULTITEXCOORDP3UIPROC glad_debug_glMultiTexCoordP3ui;
-#define glMultiTexCoordP3ui glad_debug_glMultiTexCoordP3ui
+#define glMultiTexCoordP3ui GLAD_FUNCTION(glMultiTexCoordP3ui)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP3UIVPROC)(GLenum texture, GLenum type, const GLuint *coords);
 GLAPI PFNGLMULTITEXCOORDP3UIVPROC glad_glMultiTexCoordP3uiv;
 GLAPI PFNGLMULTITEXCOORDP3UIVPROC glad_debug_glMultiTexCoordP3uiv;
-#define glMultiTexCoordP3uiv glad_debug_glMultiTexCoordP3uiv
+#define glMultiTexCoordP3uiv GLAD_FUNCTION(glMultiTexCoordP3uiv)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP4UIPROC)(GLenum texture, GLenum type, GLuint coords);
 GLAPI PFNGLMULTITEXCOORDP4UIPROC glad_glMultiTexCoordP4ui;
 GLAPI PFNGLMULTITEXCOORDP4UIPROC glad_debug_glMultiTexCoordP4ui;
-#define glMultiTexCoordP4ui glad_debug_glMultiTexCoordP4ui
+#define glMultiTexCoordP4ui GLAD_FUNCTION(glMultiTexCoordP4ui)
 typedef void (APIENTRYP PFNGLMULTITEXCOORDP4UIVPROC)(GLenum texture, GLenum type, const GLuint *coords);
 GLAPI PFNGLMULTITEXCOORDP4UIVPROC glad_glMultiTexCoordP4uiv;
 GLAPI PFNGLMULTITEXCOORDP4UIVPROC glad_debug_glMultiTexCoordP4uiv;
-#define glMultiTexCoordP4uiv glad_debug_glMultiTexCoordP4uiv
+#define glMultiTexCoordP4uiv GLAD_FUNCTION(glMultiTexCoordP4uiv)
 typedef void (APIENTRYP PFNGLNORMALP3UIPROC)(GLenum type, GLuint coords);
 GLAPI PFNGLNORMALP3UIPROC glad_glNormalP3ui;
 GLAPI PFNGLNORMALP3UIPROC glad_debug_glNormalP3ui;
-#define glNormalP3ui glad_debug_glNormalP3ui
+#define glNormalP3ui GLAD_FUNCTION(glNormalP3ui)
 typedef void (APIENTRYP PFNGLNORMALP3UIVPROC)(GLenum type, const GLuint *coords);
 GLAPI PFNGLNORMALP3UIVPROC glad_glNormalP3uiv;
 GLAPI PFNGLNORMALP3UIVPROC glad_debug_glNormalP3uiv;
-#define glNormalP3uiv glad_debug_glNormalP3uiv
+#define glNormalP3uiv GLAD_FUNCTION(glNormalP3uiv)
 typedef void (APIENTRYP PFNGLCOLORP3UIPROC)(GLenum type, GLuint color);
 GLAPI PFNGLCOLORP3UIPROC glad_glColorP3ui;
 GLAPI PFNGLCOLORP3UIPROC glad_debug_glColorP3ui;
-#define glColorP3ui glad_debug_glColorP3ui
+#define glColorP3ui GLAD_FUNCTION(glColorP3ui)
 typedef void (APIENTRYP PFNGLCOLORP3UIVPROC)(GLenum type, const GLuint *color);
 GLAPI PFNGLCOLORP3UIVPROC glad_glColorP3uiv;
 GLAPI PFNGLCOLORP3UIVPROC glad_debug_glColorP3uiv;
-#define glColorP3uiv glad_debug_glColorP3uiv
+#define glColorP3uiv GLAD_FUNCTION(glColorP3uiv)
 typedef void (APIENTRYP PFNGLCOLORP4UIPROC)(GLenum type, GLuint color);
 GLAPI PFNGLCOLORP4UIPROC glad_glColorP4ui;
 GLAPI PFNGLCOLORP4UIPROC glad_debug_glColorP4ui;
-#define glColorP4ui glad_debug_glColorP4ui
+#define glColorP4ui GLAD_FUNCTION(glColorP4ui)
 typedef void (APIENTRYP PFNGLCOLORP4UIVPROC)(GLenum type, const GLuint *color);
 GLAPI PFNGLCOLORP4UIVPROC glad_glColorP4uiv;
 GLAPI PFNGLCOLORP4UIVPROC glad_debug_glColorP4uiv;
-#define glColorP4uiv glad_debug_glColorP4uiv
+#define glColorP4uiv GLAD_FUNCTION(glColorP4uiv)
 typedef void (APIENTRYP PFNGLSECONDARYCOLORP3UIPROC)(GLenum type, GLuint color);
 GLAPI PFNGLSECONDARYCOLORP3UIPROC glad_glSecondaryColorP3ui;
 GLAPI PFNGLSECONDARYCOLORP3UIPROC glad_debug_glSecondaryColorP3ui;
-#define glSecondaryColorP3ui glad_debug_glSecondaryColorP3ui
+#define glSecondaryColorP3ui GLAD_FUNCTION(glSecondaryColorP3ui)
 typedef void (APIENTRYP PFNGLSECONDARYCOLORP3UIVPROC)(GLenum type, const GLuint *color);
 GLAPI PFNGLSECONDARYCOLORP3UIVPROC glad_glSecondaryColorP3uiv;
 GLAPI PFNGLSECONDARYCOLORP3UIVPROC glad_debug_glSecondaryColorP3uiv;
-#define glSecondaryColorP3uiv glad_debug_glSecondaryColorP3uiv
+#define glSecondaryColorP3uiv GLAD_FUNCTION(glSecondaryColorP3uiv)
 #endif
 #define GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB 0x8242
 #define GL_DEBUG_NEXT_LOGGED_MESSAGE_LENGTH_ARB 0x8243
@@ -2601,19 +2610,19 @@ GLAPI int GLAD_GL_ARB_debug_output;
 typedef void (APIENTRYP PFNGLDEBUGMESSAGECONTROLARBPROC)(GLenum source, GLenum type, GLenum severity, GLsizei count, const GLuint *ids, GLboolean enabled);
 GLAPI PFNGLDEBUGMESSAGECONTROLARBPROC glad_glDebugMessageControlARB;
 GLAPI PFNGLDEBUGMESSAGECONTROLARBPROC glad_debug_glDebugMessageControlARB;
-#define glDebugMessageControlARB glad_debug_glDebugMessageControlARB
+#define glDebugMessageControlARB GLAD_FUNCTION(glDebugMessageControlARB)
 typedef void (APIENTRYP PFNGLDEBUGMESSAGEINSERTARBPROC)(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar *buf);
 GLAPI PFNGLDEBUGMESSAGEINSERTARBPROC glad_glDebugMessageInsertARB;
 GLAPI PFNGLDEBUGMESSAGEINSERTARBPROC glad_debug_glDebugMessageInsertARB;
-#define glDebugMessageInsertARB glad_debug_glDebugMessageInsertARB
+#define glDebugMessageInsertARB GLAD_FUNCTION(glDebugMessageInsertARB)
 typedef void (APIENTRYP PFNGLDEBUGMESSAGECALLBACKARBPROC)(GLDEBUGPROCARB callback, const void *userParam);
 GLAPI PFNGLDEBUGMESSAGECALLBACKARBPROC glad_glDebugMessageCallbackARB;
 GLAPI PFNGLDEBUGMESSAGECALLBACKARBPROC glad_debug_glDebugMessageCallbackARB;
-#define glDebugMessageCallbackARB glad_debug_glDebugMessageCallbackARB
+#define glDebugMessageCallbackARB GLAD_FUNCTION(glDebugMessageCallbackARB)
 typedef GLuint (APIENTRYP PFNGLGETDEBUGMESSAGELOGARBPROC)(GLuint count, GLsizei bufSize, GLenum *sources, GLenum *types, GLuint *ids, GLenum *severities, GLsizei *lengths, GLchar *messageLog);
 GLAPI PFNGLGETDEBUGMESSAGELOGARBPROC glad_glGetDebugMessageLogARB;
 GLAPI PFNGLGETDEBUGMESSAGELOGARBPROC glad_debug_glGetDebugMessageLogARB;
-#define glGetDebugMessageLogARB glad_debug_glGetDebugMessageLogARB
+#define glGetDebugMessageLogARB GLAD_FUNCTION(glGetDebugMessageLogARB)
 #endif
 #ifndef GL_EXT_texture_compression_s3tc
 #define GL_EXT_texture_compression_s3tc 1
@@ -1,5 +1,17 @@
 #version 330 core
 
+layout (location = 0) in vec2 pos;
+layout (location = 1) in vec2 size;
+layout (location = 2) in vec4 uvRect;
+layout (location = 3) in float layer;
+
+out Sprite {
+    vec2 size;
+    vec4 uvRect;
+} sprite;
+
 void main() {
-    gl_Position = vec4(0, 0, 0, 1);
+    gl_Position = vec4(pos, layer, 1);
+    sprite.size = size;
+    sprite.uvRect = uvRect;
 }
@@ -0,0 +1,24 @@
+#version 330 core
+
+const mat4 projection = mat4(
+    2, 0, 0, 0,
+    0, -2, 0, 0,
+    0, 0, -1, 0,
+    -1, 1, 0, 1);
+
+const float LAYER_DEPTH = 1.0 / 16;
+
+// per-instance when drawn instanced, repeated on all 4 vertices otherwise
+layout (location = 0) in vec2 pos;
+layout (location = 1) in vec2 size;
+layout (location = 2) in vec4 uvRect;
+layout (location = 3) in float layer;
+
+out vec2 uv;
+
+void main() {
+    // quad corners in vertex order: (0, 0), (1, 0), (0, 1), (1, 1)
+    vec2 corner = vec2(gl_VertexID & 1, (gl_VertexID >> 1) & 1);
+    gl_Position = projection * vec4(pos + corner * size, layer * LAYER_DEPTH, 1);
+    uv = uvRect.xy + corner * uvRect.zw;
+}
@@ -0,0 +1,283 @@
+#ifndef WAVE_ATLAS_HPP
+#define WAVE_ATLAS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+// Layout of the sprite atlas, shared by wave and wave_bake. Nothing in here
+// depends on GL.
+
+// every sprite image, in the order they are packed
+const std::vector<std::string> ATLAS_FILENAMES = {
+    "wave_base.png",
+    "boat.png",
+    "spray.png",
+    "pelican0.png",
+    "pelican1.png",
+    "game_over.png"
+};
+
+const char ATLAS_CACHE_FILENAME[] = "atlas.cache";
+const char ATLAS_CACHE_MAGIC[4] = {'W', 'A', 'V', 'C'};
+
+// Each image gets a cell with a margin of at least ATLAS_PADDING / 2 texels
+// on every side. Cells are aligned to ATLAS_PADDING texels, so that a texel
+// of mipmap levels up to log2(ATLAS_PADDING) never covers two cells.
+const int ATLAS_PADDING = 8;
+const int ATLAS_MAX_MIPMAP_LEVEL = 3;
+
+inline int atlasCellSize(int size) {
+    return (size + 2 * ATLAS_PADDING - 1) / ATLAS_PADDING * ATLAS_PADDING;
+}
+
+struct AtlasImage {
+    std::string filename;
+    int width, height;
+    int x, y; // of the cell
+};
+
+// Places the images on shelves, sorted by height, and returns the size of
+// the atlas, which is a power of two wide.
+inline glm::ivec2 packAtlas(std::vector<AtlasImage>& images) {
+    int maxWidth = 0;
+    long area = 0;
+    std::vector<AtlasImage*> sorted;
+    for (auto& image : images) {
+        maxWidth = std::max(maxWidth, atlasCellSize(image.width));
+        area += static_cast<long>(atlasCellSize(image.width)) * atlasCellSize(image.height);
+        sorted.push_back(&image);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const AtlasImage* a, const AtlasImage* b) {
+        return a->height > b->height;
+    });
+
+    int width = 1;
+    while (width < maxWidth || static_cast<long>(width) * width < area) {
+        width *= 2;
+    }
+
+    int x = 0, y = 0, shelfHeight = 0;
+    for (auto image : sorted) {
+        if (x + atlasCellSize(image->width) > width) {
+            x = 0;
+            y += shelfHeight;
+            shelfHeight = 0;
+        }
+        image->x = x;
+        image->y = y;
+        x += atlasCellSize(image->width);
+        shelfHeight = std::max(shelfHeight, atlasCellSize(image->height));
+    }
+    return {width, y + shelfHeight};
+}
+
+// Writes the cell of an image, RGBA, to dst, whose rows are stride texels
+// apart. The image sits in the middle of its cell and its edges are
+// extruded into the margin, so filtering at the edges behaves like
+// GL_CLAMP_TO_EDGE.
+inline void fillAtlasCell(const AtlasImage& image, const unsigned char* data, unsigned char* dst, int stride) {
+    for (int cy = 0; cy < atlasCellSize(image.height); ++cy) {
+        const int row = glm::clamp(cy - ATLAS_PADDING / 2, 0, image.height - 1);
+        for (int cx = 0; cx < atlasCellSize(image.width); ++cx) {
+            const int column = glm::clamp(cx - ATLAS_PADDING / 2, 0, image.width - 1);
+            std::copy_n(data + 4 * (row * image.width + column), 4, dst + 4 * (cy * stride + cx));
+        }
+    }
+}
+
+// Baked atlas: the layout and every mipmap level, so that loading it is a
+// map of the file and an upload per level, with no decoding or mipmap
+// generation. Native byte order, as the file is only read where it is made:
+//   "WAVC", version, width, height, number of levels, number of images (u32)
+//   per image: name length (u32), name, width, height, x, y (i32)
+//   zeros up to a multiple of 16 bytes, then every level, RGBA, largest first
+class AtlasCache {
+public:
+    AtlasCache() :
+        data_(nullptr),
+        mappedSize_(0) {}
+
+    AtlasCache(const AtlasCache&) = delete;
+    AtlasCache& operator=(const AtlasCache&) = delete;
+
+    ~AtlasCache() {
+        if (data_) {
+            munmap(data_, mappedSize_);
+        }
+    }
+
+    // Maps the cache and checks that it holds exactly filenames, none of
+    // which has been modified since the cache was written. Fails if the
+    // cache is missing, malformed or stale.
+    bool open(const char* cacheFilename, const std::vector<std::string>& filenames) {
+        const int fd = ::open(cacheFilename, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat cacheStat;
+        const bool mapped = fstat(fd, &cacheStat) == 0 && cacheStat.st_size > 0
+            && (data_ = mmap(nullptr, cacheStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED;
+        close(fd);
+        if (!mapped) {
+            data_ = nullptr;
+            return false;
+        }
+        mappedSize_ = cacheStat.st_size;
+
+        std::size_t offset = 0;
+        std::uint32_t version, numImages;
+        char magic[sizeof(ATLAS_CACHE_MAGIC)];
+        if (!read(offset, magic, sizeof(magic)) || std::memcmp(magic, ATLAS_CACHE_MAGIC, sizeof(magic)) != 0
+            || !read(offset, &version, 4) || version != VERSION
+            || !read(offset, &atlasSize_.x, 4) || !read(offset, &atlasSize_.y, 4)
+            || !read(offset, &numLevels_, 4) || !read(offset, &numImages, 4)
+            || atlasSize_.x == 0 || atlasSize_.y == 0
+            || numLevels_ == 0 || numLevels_ > ATLAS_MAX_MIPMAP_LEVEL + 1
+            || numImages != filenames.size()) {
+            return false;
+        }
+
+        images_.resize(numImages);
+        for (auto& image : images_) {
+            std::uint32_t nameLength;
+            if (!read(offset, &nameLength, 4) || nameLength > mappedSize_ - offset) {
+                return false;
+            }
+            image.filename.assign(static_cast<const char*>(data_) + offset, nameLength);
+            offset += nameLength;
+            if (!read(offset, &image.width, 4) || !read(offset, &image.height, 4)
+                || !read(offset, &image.x, 4) || !read(offset, &image.y, 4)
+                || image.width <= 0 || image.height <= 0 || image.x < 0 || image.y < 0
+                || image.width > static_cast<long>(atlasSize_.x) || image.height > static_cast<long>(atlasSize_.y)
+                || static_cast<long>(image.x) + atlasCellSize(image.width) > atlasSize_.x
+                || static_cast<long>(image.y) + atlasCellSize(image.height) > atlasSize_.y) {
+                return false;
+            }
+
+            // a missing source leaves nothing to fall back to, so only a
+            // newer one makes the cache stale
+            struct stat sourceStat;
+            if (std::find(filenames.begin(), filenames.end(), image.filename) == filenames.end()
+                || (stat(image.filename.c_str(), &sourceStat) == 0
+                    && sourceStat.st_mtime > cacheStat.st_mtime)) {
+                return false;
+            }
+        }
+
+        offset = alignOffset(offset);
+        for (std::uint32_t i = 0; i < numLevels_; ++i) {
+            const std::size_t levelSize = 4 * static_cast<std::size_t>(atlasSize_.x >> i) * (atlasSize_.y >> i);
+            if (levelSize == 0 || offset > mappedSize_ || levelSize > mappedSize_ - offset) {
+                return false;
+            }
+            levels_.push_back(static_cast<const unsigned char*>(data_) + offset);
+            offset += levelSize;
+        }
+        return true;
+    }
+
+    glm::ivec2 getSize() const {
+        return {static_cast<int>(atlasSize_.x), static_cast<int>(atlasSize_.y)};
+    }
+
+    const std::vector<AtlasImage>& getImages() const {
+        return images_;
+    }
+
+    // level i is (width >> i) by (height >> i)
+    const std::vector<const unsigned char*>& getLevels() const {
+        return levels_;
+    }
+
+    // level 0 is the atlas itself; each further level averages 2x2 texels of
+    // the one before, up to ATLAS_MAX_MIPMAP_LEVEL
+    static bool write(const char* cacheFilename, glm::ivec2 size, const std::vector<AtlasImage>& images,
+                      const std::vector<unsigned char>& pixels) {
+        std::vector<std::vector<unsigned char>> levels = {pixels};
+        for (int i = 1; i <= ATLAS_MAX_MIPMAP_LEVEL && (size.x >> i) > 0 && (size.y >> i) > 0; ++i) {
+            levels.push_back(halve(levels.back(), size.x >> (i - 1), size.y >> (i - 1)));
+        }
+
+        std::string header(ATLAS_CACHE_MAGIC, sizeof(ATLAS_CACHE_MAGIC));
+        append(header, VERSION);
+        append(header, size.x);
+        append(header, size.y);
+        append(header, static_cast<std::uint32_t>(levels.size()));
+        append(header, static_cast<std::uint32_t>(images.size()));
+        for (const auto& image : images) {
+            append(header, static_cast<std::uint32_t>(image.filename.size()));
+            header += image.filename;
+            append(header, image.width);
+            append(header, image.height);
+            append(header, image.x);
+            append(header, image.y);
+        }
+        header.resize(alignOffset(header.size()), '\0');
+
+        std::ofstream ofs(cacheFilename, std::ios::binary);
+        ofs.write(header.data(), header.size());
+        for (const auto& level : levels) {
+            ofs.write(reinterpret_cast<const char*>(level.data()), level.size());
+        }
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    static const std::uint32_t VERSION = 1;
+
+    void* data_;
+    std::size_t mappedSize_;
+
+    glm::uvec2 atlasSize_;
+    std::uint32_t numLevels_;
+    std::vector<AtlasImage> images_;
+    std::vector<const unsigned char*> levels_;
+
+    bool read(std::size_t& offset, void* value, std::size_t size) const {
+        if (offset > mappedSize_ || size > mappedSize_ - offset) {
+            return false;
+        }
+        std::memcpy(value, static_cast<const char*>(data_) + offset, size);
+        offset += size;
+        return true;
+    }
+
+    static std::size_t alignOffset(std::size_t offset) {
+        return (offset + 15) / 16 * 16;
+    }
+
+    template <typename T>
+    static void append(std::string& bytes, T value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static std::vector<unsigned char> halve(const std::vector<unsigned char>& level, int width, int height) {
+        std::vector<unsigned char> half(4 * (width / 2) * (height / 2));
+        for (int y = 0; y < height / 2; ++y) {
+            for (int x = 0; x < width / 2; ++x) {
+                for (int c = 0; c < 4; ++c) {
+                    const auto texel = [&](int dx, int dy) {
+                        return level[4 * ((2 * y + dy) * width + 2 * x + dx) + c];
+                    };
+                    half[4 * (y * (width / 2) + x) + c] = static_cast<unsigned char>(
+                        (texel(0, 0) + texel(1, 0) + texel(0, 1) + texel(1, 1) + 2) / 4);
+                }
+            }
+        }
+        return half;
+    }
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "atlas.hpp"
+
+// Bakes the sprite images into the atlas cache that wave maps at startup
+// instead of decoding PNGs and generating mipmaps. Run it from the
+// directory with the images, after changing any of them.
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        std::cerr << "usage: " << argv[0] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<AtlasImage> images;
+    std::vector<stbi_uc*> data;
+    for (const auto& filename : ATLAS_FILENAMES) {
+        AtlasImage image;
+        image.filename = filename;
+        int numComponents;
+        data.push_back(stbi_load(filename.c_str(), &image.width, &image.height, &numComponents, STBI_rgb_alpha));
+        if (!data.back()) {
+            std::cerr << "failed to load " << filename << ": " << stbi_failure_reason() << std::endl;
+            return EXIT_FAILURE;
+        }
+        images.push_back(image);
+    }
+
+    const auto size = packAtlas(images);
+    std::vector<unsigned char> pixels(4 * size.x * size.y, 0);
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        fillAtlasCell(images[i], data[i], &pixels[4 * (images[i].y * size.x + images[i].x)], size.x);
+        stbi_image_free(data[i]);
+    }
+
+    if (!AtlasCache::write(ATLAS_CACHE_FILENAME, size, images, pixels)) {
+        std::cerr << "failed to write " << ATLAS_CACHE_FILENAME << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "wrote " << ATLAS_CACHE_FILENAME << ": " << size.x << "x" << size.y << std::endl;
+    return EXIT_SUCCESS;
+}
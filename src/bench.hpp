@@ -0,0 +1,34 @@
+#ifndef WAVE_BENCH_HPP
+#define WAVE_BENCH_HPP
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Helpers for the microbenchmarks of wave --bench and wave_headless --bench,
+// which print one JSON object per line, so that results of different
+// commits can be compared by a script.
+
+// Calls f once to warm up, then over and over for at least minSeconds, and
+// returns the mean time of a call in nanoseconds.
+template <typename F>
+double timePerCall(F f, double minSeconds = 0.25) {
+    f();
+
+    long calls = 0;
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    do {
+        f();
+        ++calls;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < minSeconds);
+    return elapsed.count() * 1e9 / calls;
+}
+
+// name is a path like "collision/broad/1024" and must not need escaping
+inline void printBench(const std::string& name, double nanoseconds) {
+    std::cout << "{\"name\":\"" << name << "\",\"ns\":" << nanoseconds << "}" << std::endl;
+}
+
+#endif
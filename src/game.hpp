@@ -0,0 +1,402 @@
+#ifndef WAVE_GAME_HPP
+#define WAVE_GAME_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+// Game simulation. Nothing in here depends on GL or GLFW, so that the game
+// can be stepped without a window.
+
+const float SPRAY_WIDTH = 0.4f;
+const float PELICAN_WIDTH = 0.2f;
+const float WAVE_SPEED = 0.4f;
+const float BOAT_POS_X = 0.1f;
+const float BOAT_WIDTH = 0.2f;
+const float SEA_LEVEL = 0.8f;
+const float JUMP_SPEED = 1.8f;
+const float GRAVITY = 3.24f;
+
+// the simulation advances in fixed steps regardless of the frame rate
+const double TICK = 1.0 / 60;
+
+// seed of the index-th of many independent random streams, so that a run
+// with any number of games is reproduced by its master seed alone
+inline std::mt19937::result_type deriveSeed(std::uint64_t masterSeed, std::uint64_t index) {
+    std::seed_seq seq{
+        static_cast<std::uint32_t>(masterSeed), static_cast<std::uint32_t>(masterSeed >> 32),
+        static_cast<std::uint32_t>(index), static_cast<std::uint32_t>(index >> 32)
+    };
+    std::mt19937::result_type seed;
+    seq.generate(&seed, &seed + 1);
+    return seed;
+}
+
+struct Input {
+    bool jump;
+    bool retry;
+};
+
+enum class ObstacleType {
+    Spray,
+    Pelican
+};
+
+// position and animation frame of an obstacle spawned at spawnTime, at time
+// t, which may lie between steps
+inline glm::vec2 getSprayPos(double spawnTime, double t) {
+    return {0.9f - WAVE_SPEED * (t - spawnTime), 0.75f + 0.25 * std::cos(2 * (t - spawnTime))};
+}
+
+inline glm::vec2 getPelicanPos(double spawnTime, double t) {
+    return {1.f - 0.8f * (t - spawnTime), 0.05f};
+}
+
+inline int getPelicanAnimIndex(double spawnTime, double t) {
+    return std::max(0, static_cast<int>((t - spawnTime) / 0.25) % 2);
+}
+
+// how long an obstacle stays on screen
+const double SPRAY_LIFETIME = glm::pi<double>();
+const double PELICAN_LIFETIME = (1.0 + PELICAN_WIDTH) / 0.8f;
+
+// ages between which an obstacle overlaps the boat in x
+const double SPRAY_HIT_MIN_AGE = (0.9f - (BOAT_POS_X + BOAT_WIDTH - 0.5 * SPRAY_WIDTH)) / WAVE_SPEED;
+const double SPRAY_HIT_MAX_AGE = (0.9f - (BOAT_POS_X - SPRAY_WIDTH)) / WAVE_SPEED;
+const double PELICAN_HIT_MIN_AGE = (1.0 - (BOAT_POS_X + BOAT_WIDTH)) / 0.8f;
+const double PELICAN_HIT_MAX_AGE = (1.0 - (BOAT_POS_X - PELICAN_WIDTH)) / 0.8f;
+
+// the longest step GameState::step takes
+const double MAX_STEP = 1.0;
+
+// Obstacles spawn at least 1 s apart and none lives longer than pi s. A step
+// keeps every obstacle alive at its start, so the queue of a kind may hold
+// those spawned over pi + MAX_STEP s, which are no more than 5.
+const std::size_t MAX_OBJECTS = 5;
+
+const double BOAT_FLIGHT_TIME = 2.0 * JUMP_SPEED / GRAVITY;
+
+// The boat floats at SEA_LEVEL until it jumps, and then follows the parabola
+// of the jump until it is back at SEA_LEVEL, so where it is at any time
+// follows from when it last jumped.
+class BoatPath {
+public:
+    BoatPath() :
+        jumpTime_(-std::numeric_limits<double>::infinity()) {}
+
+    void jump(double t) {
+        jumpTime_ = t;
+    }
+
+    double getJumpTime() const {
+        return jumpTime_;
+    }
+
+    double getLandTime() const {
+        return jumpTime_ + BOAT_FLIGHT_TIME;
+    }
+
+    double getApexTime() const {
+        return jumpTime_ + JUMP_SPEED / GRAVITY;
+    }
+
+    bool isFlying(double t) const {
+        return t >= jumpTime_ && t < getLandTime();
+    }
+
+    double getPosY(double t) const {
+        const double s = t - jumpTime_;
+        return isFlying(t) ? SEA_LEVEL - JUMP_SPEED * s + 0.5 * GRAVITY * s * s : SEA_LEVEL;
+    }
+
+    double getVelY(double t) const {
+        return isFlying(t) ? -JUMP_SPEED + GRAVITY * (t - jumpTime_) : 0.0;
+    }
+
+private:
+    double jumpTime_;
+};
+
+// Swept collision tests: whether the boat touches the obstacle spawned at
+// spawnTime at any time in [t0, t1], not only at t1, so that the outcome
+// does not depend on the timestep.
+
+inline bool sweptHitSpray(double spawnTime, const BoatPath& boat, double t0, double t1) {
+    const double begin = std::max(t0, spawnTime + SPRAY_HIT_MIN_AGE);
+    const double end = std::min(t1, spawnTime + SPRAY_HIT_MAX_AGE);
+    if (begin > end) {
+        return false;
+    }
+
+    const auto below = [&](double t) {
+        return boat.getPosY(t) > 0.75 + 0.25 * std::cos(2 * (t - spawnTime));
+    };
+
+    // In flight, the boat's y minus the spray's is convex (its second
+    // derivative is GRAVITY + cos(2 * age) > 0), so it peaks at an end of
+    // the flight within [begin, end]. Afloat, it peaks where the spray is
+    // highest, at an age of pi / 2 + k * pi.
+    for (const double t : {begin, end, boat.getJumpTime(), boat.getLandTime()}) {
+        if (t >= begin && t <= end && below(t)) {
+            return true;
+        }
+    }
+    const std::pair<double, double> afloat[] = {
+        {begin, std::min(end, boat.getJumpTime())},
+        {std::max(begin, boat.getLandTime()), end}
+    };
+    for (const auto& span : afloat) {
+        const double k = std::ceil((span.first - spawnTime - glm::half_pi<double>()) / glm::pi<double>());
+        for (double t = spawnTime + glm::half_pi<double>() + k * glm::pi<double>(); t <= span.second;
+             t += glm::pi<double>()) {
+            if (below(t)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline bool sweptHitPelican(double spawnTime, const BoatPath& boat, double t0, double t1) {
+    const double begin = std::max(t0, spawnTime + PELICAN_HIT_MIN_AGE);
+    const double end = std::min(t1, spawnTime + PELICAN_HIT_MAX_AGE);
+    if (begin > end) {
+        return false;
+    }
+
+    const auto above = [&](double t) {
+        return boat.getPosY(t) - 0.2f < 0.05f + 0.2f;
+    };
+
+    // the boat's y is convex in flight and SEA_LEVEL afloat, so it is lowest
+    // at an end of [begin, end] or at the apex of the jump
+    const double apex = boat.getApexTime();
+    return above(begin) || above(end) || (apex > begin && apex < end && above(apex));
+}
+
+// Spawn times of the obstacles of one kind, in spawn order; everything else
+// about an obstacle follows from its spawn time. The live ones are
+// [begin, end) of storage allocated once; removing from the front advances
+// begin, and the live range is moved back to the start of the storage only
+// when a spawn finds the end taken.
+class ObstacleQueue {
+public:
+    explicit ObstacleQueue(std::size_t capacity) :
+        spawnTimes_(capacity),
+        begin_(0),
+        end_(0) {}
+
+    std::size_t size() const {
+        return end_ - begin_;
+    }
+
+    bool empty() const {
+        return begin_ == end_;
+    }
+
+    // indexed from the oldest obstacle
+    const double* getSpawnTimes() const {
+        return &spawnTimes_[begin_];
+    }
+
+    void push(double spawnTime) {
+        if (end_ == spawnTimes_.size()) {
+            std::copy(spawnTimes_.begin() + begin_, spawnTimes_.begin() + end_, spawnTimes_.begin());
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        assert(end_ < spawnTimes_.size());
+        spawnTimes_[end_++] = spawnTime;
+    }
+
+    // removes the obstacles that have lived longer than lifetime at time t
+    void popOlderThan(double lifetime, double t) {
+        while (begin_ < end_ && t > spawnTimes_[begin_] + lifetime) {
+            ++begin_;
+        }
+    }
+
+    void clear() {
+        begin_ = end_ = 0;
+    }
+
+private:
+    std::vector<double> spawnTimes_;
+    std::size_t begin_, end_;
+};
+
+// All obstacles of a kind are the same age at the same x, so the ones old
+// enough to overlap the boat in x at some time in [t0, t1] have contiguous
+// spawn times. That window is found by binary search, and only the
+// obstacles inside it get the swept test. The swept test rejects one out of
+// reach almost as fast, so this only pays off with many obstacles out of
+// reach, where the binary search keeps the cost flat.
+
+inline bool hitSprays(const ObstacleQueue& sprays, const BoatPath& boat, double t0, double t1) {
+    const auto spawnTimes = sprays.getSpawnTimes();
+    const auto first = std::partition_point(spawnTimes, spawnTimes + sprays.size(), [t0](double s) {
+        return s + SPRAY_HIT_MAX_AGE < t0;
+    });
+    const auto last = std::partition_point(first, spawnTimes + sprays.size(), [t1](double s) {
+        return s + SPRAY_HIT_MIN_AGE <= t1;
+    });
+    bool hit = false;
+    for (auto it = first; it != last; ++it) {
+        hit |= sweptHitSpray(*it, boat, t0, t1);
+    }
+    return hit;
+}
+
+inline bool hitPelicans(const ObstacleQueue& pelicans, const BoatPath& boat, double t0, double t1) {
+    const auto spawnTimes = pelicans.getSpawnTimes();
+    const auto first = std::partition_point(spawnTimes, spawnTimes + pelicans.size(), [t0](double s) {
+        return s + PELICAN_HIT_MAX_AGE < t0;
+    });
+    const auto last = std::partition_point(first, spawnTimes + pelicans.size(), [t1](double s) {
+        return s + PELICAN_HIT_MIN_AGE <= t1;
+    });
+    bool hit = false;
+    for (auto it = first; it != last; ++it) {
+        hit |= sweptHitPelican(*it, boat, t0, t1);
+    }
+    return hit;
+}
+
+// The game is solved in continuous time: the boat follows BoatPath,
+// obstacles spawn at the exact time they are due and collisions are swept
+// over each step, so any timestep gives the same game. Only input is bound
+// to steps, as it is read at the start of each.
+class GameState {
+public:
+    explicit GameState(std::mt19937::result_type seed) :
+        randEngine_(seed),
+        intervalDist_(1.0, 3.0),
+        time_(0.0),
+        stepStartTime_(0.0),
+        sprays_(MAX_OBJECTS),
+        pelicans_(MAX_OBJECTS) {
+
+        reset();
+    }
+
+    // advances the game by dt seconds; while the game is over only the retry
+    // input is looked at and time stands still
+    void step(const Input& input, double dt) {
+        advance(input, dt);
+        collide();
+    }
+
+    // the first half of step: moves the boat and the obstacles
+    void advance(const Input& input, double dt) {
+        assert(dt <= MAX_STEP);
+        stepStartTime_ = time_;
+        if (gameover_) {
+            if (input.retry) {
+                reset();
+            }
+            return;
+        }
+
+        time_ += dt;
+
+        if (input.jump && !boat_.isFlying(stepStartTime_)) {
+            boat_.jump(stepStartTime_);
+        }
+
+        // these were gone before the step started; any others may still be
+        // hit within it, even ones that are gone by its end
+        sprays_.popOlderThan(SPRAY_LIFETIME, stepStartTime_);
+        pelicans_.popOlderThan(PELICAN_LIFETIME, stepStartTime_);
+
+        while (nextSpawnTime_ <= time_) {
+            spawn();
+        }
+    }
+
+    // the second half of step: ends the game if the boat hit anything over
+    // the time advance went through
+    void collide() {
+        if (gameover_) {
+            return;
+        }
+        gameover_ = hitSprays(sprays_, boat_, stepStartTime_, time_)
+            || hitPelicans(pelicans_, boat_, stepStartTime_, time_);
+    }
+
+    double getTime() const {
+        return time_;
+    }
+
+    float getBoatPosY() const {
+        return static_cast<float>(boat_.getPosY(time_));
+    }
+
+    float getBoatVelY() const {
+        return static_cast<float>(boat_.getVelY(time_));
+    }
+
+    bool isGrounded() const {
+        return !boat_.isFlying(time_);
+    }
+
+    bool isGameOver() const {
+        return gameover_;
+    }
+
+    const ObstacleQueue& getSprays() const {
+        return sprays_;
+    }
+
+    const ObstacleQueue& getPelicans() const {
+        return pelicans_;
+    }
+
+private:
+    std::mt19937 randEngine_;
+    std::uniform_real_distribution<double> intervalDist_;
+    std::bernoulli_distribution typeDist_;
+
+    double time_;
+    double stepStartTime_;
+    double nextSpawnTime_;
+    double lastDespawnTime_;
+    BoatPath boat_;
+    bool gameover_;
+    ObstacleQueue sprays_;
+    ObstacleQueue pelicans_;
+
+    // the clock keeps running across retries
+    void reset() {
+        gameover_ = false;
+        sprays_.clear();
+        pelicans_.clear();
+        boat_ = BoatPath();
+        nextSpawnTime_ = time_;
+        lastDespawnTime_ = time_;
+    }
+
+    void spawn() {
+        const double t = nextSpawnTime_;
+        if (typeDist_(randEngine_)) {
+            sprays_.push(t);
+            lastDespawnTime_ = std::max(lastDespawnTime_, t + SPRAY_LIFETIME);
+        } else {
+            pelicans_.push(t);
+            lastDespawnTime_ = std::max(lastDespawnTime_, t + PELICAN_LIFETIME);
+        }
+
+        // the next one comes after the interval, or once every obstacle is gone
+        nextSpawnTime_ = std::min(t + intervalDist_(randEngine_), lastDespawnTime_);
+    }
+};
+
+#endif
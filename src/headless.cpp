@@ -0,0 +1,463 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "game.hpp"
+#include "recording.hpp"
+#include "vec_env.hpp"
+#include "work_stealing_pool.hpp"
+
+// Every heap allocation of the process is counted, to check that stepping
+// a game does not allocate.
+std::atomic<long> allocationCount(0);
+
+// neither is inlined, or GCC takes a malloc and a free seen through them for
+// a mismatch with delete and new
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+// recording is filled with the session when it is not null
+void runGame(long steps, std::uint64_t seed, double jumpProbability, Recording* recording) {
+    GameState game(deriveSeed(seed, 0));
+    std::mt19937 playerEngine(deriveSeed(seed, 1));
+    std::bernoulli_distribution jumpDist(jumpProbability);
+    if (recording) {
+        recording->reserve(steps);
+    }
+
+    long episodes = 0;
+    double episodeTimeSum = 0.0;
+    double episodeStart = game.getTime();
+
+    const long allocationsBefore = allocationCount;
+    const auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < steps; ++i) {
+        const bool gameover = game.isGameOver();
+        if (gameover) {
+            ++episodes;
+            episodeTimeSum += game.getTime() - episodeStart;
+            episodeStart = game.getTime();
+        }
+        const Input input = {!gameover && jumpDist(playerEngine), gameover};
+        if (recording) {
+            recording->add(input);
+        }
+        game.step(input, TICK);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    const long allocations = allocationCount - allocationsBefore;
+
+    std::cout << "steps: " << steps
+        << " seconds: " << elapsed.count()
+        << " steps/s: " << steps / elapsed.count()
+        << " episodes: " << episodes
+        << " mean episode length (s): " << (episodes > 0 ? episodeTimeSum / episodes : 0.0)
+        << " allocations: " << allocations
+        << " digest: " << std::hex << digest(game) << std::dec
+        << std::endl;
+}
+
+void runReplay(const Recording& replay) {
+    GameState game(deriveSeed(replay.getSeed(), 0));
+
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < replay.size(); ++i) {
+        game.step(replay.get(i), TICK);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "ticks: " << replay.size()
+        << " seconds: " << elapsed.count()
+        << " ticks/s: " << replay.size() / elapsed.count()
+        << " digest: " << std::hex << digest(game) << std::dec
+        << std::endl;
+}
+
+void runVecEnv(int numEnvs, long steps, std::uint64_t seed, double jumpProbability) {
+    VecEnv env(numEnvs, seed);
+    std::mt19937 playerEngine(deriveSeed(seed, 1));
+    std::bernoulli_distribution jumpDist(jumpProbability);
+
+    // drawing actions is not what is being measured, so cycle through a pool
+    std::vector<std::uint8_t> actions(numEnvs * 64 + 1);
+    for (auto& action : actions) {
+        action = jumpDist(playerEngine);
+    }
+
+    const long vecSteps = steps / numEnvs;
+    long episodes = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < vecSteps; ++i) {
+        env.step(&actions[(i * numEnvs) % (actions.size() - numEnvs)]);
+        const auto dones = env.getDones();
+        for (int j = 0; j < numEnvs; ++j) {
+            episodes += dones[j];
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const long envSteps = vecSteps * numEnvs;
+    std::cout << "envs: " << numEnvs
+        << " env steps: " << envSteps
+        << " seconds: " << elapsed.count()
+        << " env steps/s: " << envSteps / elapsed.count()
+        << " episodes: " << episodes
+        << " mean episode length (s): " << (episodes > 0 ? envSteps * TICK / episodes : 0.0)
+        << std::endl;
+}
+
+// games stepped by one task of runParallel
+const int GAMES_PER_SHARD = 16;
+
+struct Shard {
+    std::vector<GameState> games;
+    std::mt19937 playerEngine;
+    long episodes;
+    double episodeTimeSum;
+};
+
+void runParallel(int numGames, int numThreads, long steps, std::uint64_t seed, double jumpProbability) {
+    // every game and every shard's player draw from their own stream, so
+    // the outcome does not depend on which thread runs which shard
+    const int numShards = (numGames + GAMES_PER_SHARD - 1) / GAMES_PER_SHARD;
+    std::vector<Shard> shards(numShards);
+    for (int i = 0; i < numShards; ++i) {
+        auto& shard = shards[i];
+        for (int j = i * GAMES_PER_SHARD; j < std::min(numGames, (i + 1) * GAMES_PER_SHARD); ++j) {
+            shard.games.emplace_back(deriveSeed(seed, 2 * j));
+        }
+        shard.playerEngine.seed(deriveSeed(seed, 2 * i + 1));
+        shard.episodes = 0;
+        shard.episodeTimeSum = 0.0;
+    }
+
+    const long stepsPerGame = steps / numGames;
+    WorkStealingPool pool(numThreads);
+
+    const auto start = std::chrono::steady_clock::now();
+    pool.run(numShards, [&](int index, int) {
+        auto& shard = shards[index];
+        std::bernoulli_distribution jumpDist(jumpProbability);
+        for (auto& game : shard.games) {
+            double episodeStart = game.getTime();
+            for (long i = 0; i < stepsPerGame; ++i) {
+                const bool gameover = game.isGameOver();
+                if (gameover) {
+                    ++shard.episodes;
+                    shard.episodeTimeSum += game.getTime() - episodeStart;
+                    episodeStart = game.getTime();
+                }
+                game.step({!gameover && jumpDist(shard.playerEngine), gameover}, TICK);
+            }
+        }
+    });
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long episodes = 0;
+    double episodeTimeSum = 0.0;
+    for (const auto& shard : shards) {
+        episodes += shard.episodes;
+        episodeTimeSum += shard.episodeTimeSum;
+    }
+
+    const long totalSteps = stepsPerGame * numGames;
+    std::cout << "games: " << numGames
+        << " threads: " << numThreads
+        << " steps: " << totalSteps
+        << " seconds: " << elapsed.count()
+        << " steps/s: " << totalSteps / elapsed.count()
+        << " episodes: " << episodes
+        << " mean episode length (s): " << (episodes > 0 ? episodeTimeSum / episodes : 0.0)
+        << std::endl;
+}
+
+// the swept test on every obstacle, to compare the broad phase with
+bool hitAllSprays(const ObstacleQueue& sprays, const BoatPath& boat, double t0, double t1) {
+    bool hit = false;
+    for (std::size_t i = 0; i < sprays.size(); ++i) {
+        hit |= sweptHitSpray(sprays.getSpawnTimes()[i], boat, t0, t1);
+    }
+    return hit;
+}
+
+bool hitAllPelicans(const ObstacleQueue& pelicans, const BoatPath& boat, double t0, double t1) {
+    bool hit = false;
+    for (std::size_t i = 0; i < pelicans.size(); ++i) {
+        hit |= sweptHitPelican(pelicans.getSpawnTimes()[i], boat, t0, t1);
+    }
+    return hit;
+}
+
+// N sprays and N pelicans spawned 1 s apart, the closest the game spawns
+// them, and boats at every height a jump reaches, for timing collision
+// tests. At time t the ages of each kind are centred on those at which it
+// can overlap the boat, so the same few obstacles are within reach for any
+// N and a larger N only adds ones that are out of reach.
+struct CollisionFixture {
+    using HitTest = bool (*)(const ObstacleQueue&, const BoatPath&, double, double);
+
+    ObstacleQueue sprays, pelicans;
+    std::vector<BoatPath> boats;
+    const double t;
+
+    CollisionFixture(std::size_t n, int numBoats, double t) :
+        sprays(n),
+        pelicans(n),
+        boats(numBoats),
+        t(t) {
+
+        const double sprayAge = (SPRAY_HIT_MIN_AGE + SPRAY_HIT_MAX_AGE) / 2;
+        const double pelicanAge = (PELICAN_HIT_MIN_AGE + PELICAN_HIT_MAX_AGE) / 2;
+        for (std::size_t i = 0; i < n; ++i) {
+            const double offset = static_cast<double>(n / 2) - i;
+            sprays.push(t - sprayAge - offset);
+            pelicans.push(t - pelicanAge - offset);
+        }
+        for (int i = 0; i < numBoats; ++i) {
+            boats[i].jump(t - BOAT_FLIGHT_TIME * i / numBoats);
+        }
+    }
+
+    // tests every boat over the tick from t, and returns how many are hit
+    int countHits(HitTest hitSprays, HitTest hitPelicans) const {
+        int hits = 0;
+        for (const auto& boat : boats) {
+            hits += hitSprays(sprays, boat, t, t + TICK) | hitPelicans(pelicans, boat, t, t + TICK);
+        }
+        return hits;
+    }
+};
+
+// Times collision tests over one tick against N sprays and N pelicans, of
+// which only a few are within reach, with and without the broad phase, for
+// growing N.
+void runCollisionBench() {
+    const int numTests = 1 << 16;
+
+    for (std::size_t n = 4; n <= 16384; n *= 4) {
+        const CollisionFixture fixture(n, numTests, 10.0);
+
+        const auto start = std::chrono::steady_clock::now();
+        const int broadHits = fixture.countHits(hitSprays, hitPelicans);
+        const auto middle = std::chrono::steady_clock::now();
+        const int bruteHits = fixture.countHits(hitAllSprays, hitAllPelicans);
+        const auto end = std::chrono::steady_clock::now();
+        const double broad = std::chrono::duration<double, std::nano>(middle - start).count() / numTests;
+        const double brute = std::chrono::duration<double, std::nano>(end - middle).count() / numTests;
+        if (broadHits != bruteHits) {
+            std::cerr << "broad phase disagrees at " << n << " obstacles" << std::endl;
+        }
+
+        std::cout << "obstacles per kind: " << n
+            << " broad phase (ns/test): " << broad
+            << " all obstacles (ns/test): " << brute
+            << std::endl;
+    }
+}
+
+// keeps the results of benchmarked code alive
+volatile double benchSink;
+
+// Microbenchmarks of the simulation: a game step, and, against N obstacles
+// of each kind of which only a few are within reach, evaluating their
+// positions and the collision tests of a tick with and without the broad
+// phase.
+void runBench() {
+    const int stepsPerCall = 1000;
+    GameState game(deriveSeed(0, 0));
+    std::mt19937 playerEngine(deriveSeed(0, 1));
+    std::bernoulli_distribution jumpDist(0.02);
+    printBench("game/step", timePerCall([&] {
+        for (int i = 0; i < stepsPerCall; ++i) {
+            const bool gameover = game.isGameOver();
+            game.step({!gameover && jumpDist(playerEngine), gameover}, TICK);
+        }
+    }) / stepsPerCall);
+
+    const int numBoats = 64;
+    for (std::size_t n = 1024; n <= 65536; n *= 8) {
+        const CollisionFixture fixture(n, numBoats, 10.0);
+        const auto& sprays = fixture.sprays;
+        const auto& pelicans = fixture.pelicans;
+        const double t = fixture.t;
+        const auto suffix = "/" + std::to_string(n);
+
+        printBench("obstacles/positions" + suffix, timePerCall([&] {
+            glm::vec2 sum(0.f);
+            for (std::size_t i = 0; i < n; ++i) {
+                sum += getSprayPos(sprays.getSpawnTimes()[i], t) + getPelicanPos(pelicans.getSpawnTimes()[i], t);
+            }
+            benchSink = sum.x + sum.y;
+        }));
+
+        printBench("collision/broad" + suffix, timePerCall([&] {
+            benchSink = fixture.countHits(hitSprays, hitPelicans);
+        }) / numBoats);
+        printBench("collision/all" + suffix, timePerCall([&] {
+            benchSink = fixture.countHits(hitAllSprays, hitAllPelicans);
+        }) / numBoats);
+    }
+}
+
+// Plays one game until it is over or horizon seconds have passed, jumping
+// at the given times, and returns when it ended (or horizon)
+double playUntilOver(std::mt19937::result_type seed, double dt, const std::vector<double>& jumpTimes,
+                     double horizon) {
+    GameState game(seed);
+    std::size_t nextJump = 0;
+    const long numTicks = std::lround(horizon / dt);
+    for (long i = 0; i < numTicks && !game.isGameOver(); ++i) {
+        // jump times lie on the tick grid, up to rounding
+        const double tickStart = i * dt;
+        bool jump = false;
+        while (nextJump < jumpTimes.size() && jumpTimes[nextJump] < tickStart + dt / 2) {
+            jump = true;
+            ++nextJump;
+        }
+        game.step({jump, false}, dt);
+    }
+    return game.isGameOver() ? game.getTime() : horizon;
+}
+
+// Plays the same games with the same jumps at a fine and at coarse
+// timesteps, and counts the games whose outcome differs: one survives and
+// the other does not, or they end more than a coarse tick apart.
+int runDtCheck(int numGames, std::uint64_t seed, double jumpProbability) {
+    const double fineDt = 1.0 / 1000;
+    const double coarseDts[] = {1.0 / 30, 0.25};
+    const double slot = 0.5; // a multiple of every timestep
+    const double horizon = 60.0;
+
+    std::mt19937 playerEngine(deriveSeed(seed, 1));
+    std::bernoulli_distribution jumpDist(jumpProbability);
+
+    int mismatches[2] = {0, 0}, gameovers = 0;
+    for (int i = 0; i < numGames; ++i) {
+        std::vector<double> jumpTimes;
+        for (int j = 0; j * slot < horizon; ++j) {
+            if (jumpDist(playerEngine)) {
+                jumpTimes.push_back(j * slot);
+            }
+        }
+
+        const auto gameSeed = deriveSeed(seed, 2 * i + 2);
+        const double fine = playUntilOver(gameSeed, fineDt, jumpTimes, horizon);
+        for (int j = 0; j < 2; ++j) {
+            const double coarse = playUntilOver(gameSeed, coarseDts[j], jumpTimes, horizon);
+            if ((fine < horizon) != (coarse < horizon) || std::abs(fine - coarse) > coarseDts[j] + fineDt) {
+                ++mismatches[j];
+            }
+        }
+        gameovers += fine < horizon;
+    }
+
+    std::cout << "games: " << numGames
+        << " game overs at dt 1/1000: " << gameovers
+        << " outcomes that differ at dt 1/30: " << mismatches[0]
+        << " at dt 0.25: " << mismatches[1]
+        << std::endl;
+    return mismatches[0] + mismatches[1];
+}
+
+// Steps the game without a window as fast as possible, with a player that
+// jumps at random and retries right away, and reports the throughput.
+// With --envs, many games are stepped at once through VecEnv instead, and
+// with --games, many GameStates are spread over --threads threads.
+// --record saves the session of the single game, which --replay plays back
+// with the same result as wave --replay. --collision-bench times the
+// collision tests at growing obstacle counts, and --dt-check compares the
+// outcomes of the same games played at dt 1/1000, 1/30 and 0.25. --bench
+// prints microbenchmarks as JSON lines.
+int main(int argc, char* argv[]) {
+    long steps = 10000000;
+    int numEnvs = 0;
+    int numGames = 0;
+    int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t seed = std::random_device()();
+    double jumpProbability = 0.02;
+    std::string recordFilename, replayFilename;
+    bool collisionBench = false;
+    bool bench = false;
+    int dtCheckGames = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            steps = std::atol(argv[++i]);
+        } else if (std::strcmp(argv[i], "--envs") == 0 && i + 1 < argc) {
+            numEnvs = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--games") == 0 && i + 1 < argc) {
+            numGames = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--jump-probability") == 0 && i + 1 < argc) {
+            jumpProbability = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--collision-bench") == 0) {
+            collisionBench = true;
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (std::strcmp(argv[i], "--dt-check") == 0 && i + 1 < argc) {
+            dtCheckGames = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "usage: " << argv[0]
+                << " [--steps N] [--envs N | --games N [--threads N]] [--seed N] [--jump-probability P]"
+                << " [--record FILE | --replay FILE] [--collision-bench] [--dt-check N] [--bench]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (bench) {
+        runBench();
+    } else if (collisionBench) {
+        runCollisionBench();
+    } else if (dtCheckGames > 0) {
+        return runDtCheck(dtCheckGames, seed, jumpProbability) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (!replayFilename.empty()) {
+        Recording replay;
+        if (!replay.load(replayFilename)) {
+            std::cerr << "failed to load " << replayFilename << std::endl;
+            return EXIT_FAILURE;
+        }
+        runReplay(replay);
+    } else if (numEnvs > 0) {
+        runVecEnv(numEnvs, steps, seed, jumpProbability);
+    } else if (numGames > 0) {
+        runParallel(numGames, numThreads, steps, seed, jumpProbability);
+    } else if (!recordFilename.empty()) {
+        Recording recording(seed);
+        runGame(steps, seed, jumpProbability, &recording);
+        if (!recording.save(recordFilename)) {
+            std::cerr << "failed to save " << recordFilename << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else {
+        runGame(steps, seed, jumpProbability, nullptr);
+    }
+
+    return EXIT_SUCCESS;
+}
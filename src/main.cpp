@@ -1,18 +1,48 @@
 #include <cassert>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <vector>
 #include <deque>
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
 #include <random>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include "glad/glad.h"
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
-
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// The atlas decodes on several threads, and this stb_image keeps the failure
+// reason in a plain global (and PNG chunk errors in a static buffer), so the
+// failure strings are compiled out rather than raced on. Failures are still
+// reported by the null result. Without them this version leaves some error
+// statements without effect, hence the pragmas.
+#define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-value"
+#pragma GCC diagnostic ignored "-Wunused-function"
 #include "stb_image.h"
+#pragma GCC diagnostic pop
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -20,20 +50,399 @@
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/io.hpp>
 
-const float SPRAY_WIDTH = 0.4f;
-const float PELICAN_WIDTH = 0.2f;
-const float WAVE_SPEED = 0.4f;
-const float BOAT_POS_X = 0.1f;
-const float BOAT_WIDTH = 0.2f;
-const float SEA_LEVEL = 0.8f;
-const float GRAVITY = 0.0009f;
+#include "atlas.hpp"
+#include "bench.hpp"
+#include "game.hpp"
+#include "recording.hpp"
+#include "trace.hpp"
+
+// longest frame that is caught up on, so that a stall doesn't snowball
+const double MAX_FRAME_TIME = 0.25;
+
+const int BACKGROUND_LAYER = 0;
+const int BOAT_LAYER = 1;
+const int OBJECT_LAYER = 2;
+const int OVERLAY_LAYER = 3;
+const int PROFILER_LAYER = 4;
 
+#ifdef GLAD_DEBUG
 void gladPostCallback(const char* name, void*, int, ...) {
     const auto code = glad_glGetError();
     if (code != GL_NO_ERROR) {
         std::cerr << "glad: " << name << " " << code << std::endl;
     }
 }
+#endif
+
+// GL_KHR_debug is core in 4.3 only, so it is not part of the generated loader
+#ifndef GL_DEBUG_OUTPUT
+#define GL_DEBUG_OUTPUT 0x92E0
+#endif
+typedef void (APIENTRYP PFNGLDEBUGMESSAGECALLBACKPROC)(GLDEBUGPROCARB callback, const void* userParam);
+
+// neither is GL_ARB_get_program_binary, which is core in 4.1
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei* length,
+        GLenum* binaryFormat, void* binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat, const void* binary,
+        GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+
+void APIENTRY debugMessageCallback(GLenum, GLenum type, GLuint id, GLenum severity,
+        GLsizei, const GLchar* message, const void*) {
+
+    std::cerr << "GL debug: type " << type << " id " << id
+        << " severity " << severity << ": " << message << std::endl;
+}
+
+bool hasExtension(const char* name) {
+    GLint numExtensions;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; ++i) {
+        if (std::strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reports errors and warnings through GL_KHR_debug (or GL_ARB_debug_output)
+// as the driver finds them, instead of polling glGetError after every call.
+// Messages are left asynchronous so that the pipeline is not serialized.
+bool enableDebugOutput(GLADloadproc load) {
+    if (hasExtension("GL_KHR_debug")) {
+        const auto glDebugMessageCallback =
+            reinterpret_cast<PFNGLDEBUGMESSAGECALLBACKPROC>(load("glDebugMessageCallback"));
+        if (glDebugMessageCallback) {
+            glDebugMessageCallback(debugMessageCallback, nullptr);
+            glEnable(GL_DEBUG_OUTPUT);
+            return true;
+        }
+    }
+    if (GLAD_GL_ARB_debug_output) {
+        glDebugMessageCallbackARB(debugMessageCallback, nullptr);
+        return true;
+    }
+    return false;
+}
+
+// Shadows the GL binding state so that binding an object that is already
+// bound can be skipped. Every program, texture, buffer and vertex array bind
+// has to go through here for the shadow state to stay accurate.
+class GLState {
+public:
+    static const unsigned int MAX_TEXTURE_UNITS = 32;
+
+    GLState(const GLState&) = delete;
+    GLState& operator=(const GLState&) = delete;
+
+    GLState() :
+        program_(0),
+        activeTextureUnit_(0),
+        vertexArray_(0),
+        issuedCount_(0),
+        skippedCount_(0) {
+
+        std::fill(std::begin(textures_), std::end(textures_), 0);
+    }
+
+    static GLState& getInstance() {
+        static GLState instance;
+        return instance;
+    }
+
+    void useProgram(GLuint program) {
+        if (update(program_, program)) {
+            glUseProgram(program);
+        }
+    }
+
+    unsigned int getActiveTextureUnit() const {
+        return activeTextureUnit_;
+    }
+
+    void bindTexture(unsigned int textureUnit, GLuint texture) {
+        assert(textureUnit < MAX_TEXTURE_UNITS);
+
+        if (textures_[textureUnit] == texture) {
+            ++skippedCount_;
+            return;
+        }
+        if (update(activeTextureUnit_, textureUnit)) {
+            glActiveTexture(GL_TEXTURE0 + textureUnit);
+        }
+        update(textures_[textureUnit], texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+    }
+
+    void bindVertexArray(GLuint vertexArray) {
+        if (update(vertexArray_, vertexArray)) {
+            glBindVertexArray(vertexArray);
+
+            // the element array binding belongs to the vertex array
+            getBufferBinding(GL_ELEMENT_ARRAY_BUFFER) = UNKNOWN;
+        }
+    }
+
+    void bindBuffer(GLenum target, GLuint buffer) {
+        if (update(getBufferBinding(target), buffer)) {
+            glBindBuffer(target, buffer);
+        }
+    }
+
+    // a program in use is only deleted once it is no longer in use, so the
+    // next use has to be issued whatever it is
+    void deleteProgram(GLuint program) {
+        glDeleteProgram(program);
+        if (program_ == program) {
+            program_ = UNKNOWN;
+        }
+    }
+
+    // deleting a bound object implicitly binds 0 in its place
+    void deleteTexture(GLuint texture) {
+        glDeleteTextures(1, &texture);
+        for (auto& bound : textures_) {
+            if (bound == texture) {
+                bound = 0;
+            }
+        }
+    }
+
+    void deleteBuffer(GLuint buffer) {
+        glDeleteBuffers(1, &buffer);
+        for (auto& binding : buffers_) {
+            if (binding.second == buffer) {
+                binding.second = 0;
+            }
+        }
+    }
+
+    void deleteVertexArray(GLuint vertexArray) {
+        glDeleteVertexArrays(1, &vertexArray);
+        if (vertexArray_ == vertexArray) {
+            vertexArray_ = 0;
+            getBufferBinding(GL_ELEMENT_ARRAY_BUFFER) = UNKNOWN;
+        }
+    }
+
+    int getIssuedCount() const {
+        return issuedCount_;
+    }
+
+    int getSkippedCount() const {
+        return skippedCount_;
+    }
+
+    void resetCounts() {
+        issuedCount_ = 0;
+        skippedCount_ = 0;
+    }
+
+private:
+    static const GLuint UNKNOWN = ~0u;
+
+    GLuint program_;
+    unsigned int activeTextureUnit_;
+    GLuint textures_[MAX_TEXTURE_UNITS];
+    GLuint vertexArray_;
+    std::vector<std::pair<GLenum, GLuint>> buffers_;
+    int issuedCount_, skippedCount_;
+
+    // returns whether the call changing current to value has to be issued
+    template <typename T>
+    bool update(T& current, T value) {
+        if (current == value) {
+            ++skippedCount_;
+            return false;
+        }
+        current = value;
+        ++issuedCount_;
+        return true;
+    }
+
+    GLuint& getBufferBinding(GLenum target) {
+        for (auto& binding : buffers_) {
+            if (binding.first == target) {
+                return binding.second;
+            }
+        }
+        buffers_.emplace_back(target, 0);
+        return buffers_.back().second;
+    }
+};
+
+// Keeps linked programs on disk with glGetProgramBinary, so that later runs
+// skip compiling and linking. A binary is only good for the driver that
+// made it and the sources it was made from, so it is stored under a key of
+// both, and anything else is a miss that is compiled as usual.
+//
+// File format, native byte order:
+//   "WAVP", version (u32), key length (u32), key,
+//   binary format (u32), binary length (u32), binary
+class ProgramBinaryCache {
+public:
+    ProgramBinaryCache(const ProgramBinaryCache&) = delete;
+    ProgramBinaryCache& operator=(const ProgramBinaryCache&) = delete;
+
+    ProgramBinaryCache() :
+        glGetProgramBinary_(nullptr),
+        glProgramBinary_(nullptr),
+        glProgramParameteri_(nullptr) {}
+
+    static ProgramBinaryCache& getInstance() {
+        static ProgramBinaryCache instance;
+        return instance;
+    }
+
+    // Loads the entry points if the driver can save programs in any format,
+    // and returns whether it can. Until then, nothing is cached.
+    bool init(GLADloadproc load) {
+        GLint major, minor, numFormats = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major > 4 || (major == 4 && minor >= 1) || hasExtension("GL_ARB_get_program_binary")) {
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+        }
+        if (numFormats <= 0) {
+            return false;
+        }
+
+        glGetProgramBinary_ = reinterpret_cast<PFNGLGETPROGRAMBINARYPROC>(load("glGetProgramBinary"));
+        glProgramBinary_ = reinterpret_cast<PFNGLPROGRAMBINARYPROC>(load("glProgramBinary"));
+        glProgramParameteri_ = reinterpret_cast<PFNGLPROGRAMPARAMETERIPROC>(load("glProgramParameteri"));
+        if (!glGetProgramBinary_ || !glProgramBinary_ || !glProgramParameteri_) {
+            glGetProgramBinary_ = nullptr;
+            return false;
+        }
+
+        for (const GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+            driver_ += reinterpret_cast<const char*>(glGetString(name));
+            driver_ += '\n';
+        }
+        return true;
+    }
+
+    bool isEnabled() const {
+        return glGetProgramBinary_ != nullptr;
+    }
+
+    // identifies the driver and sources, by an FNV-1a hash of the latter
+    std::string makeKey(const std::string& sources) const {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (const char c : sources) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+        }
+        std::ostringstream ss;
+        ss << driver_ << std::hex << hash;
+        return ss.str();
+    }
+
+    // has to be called before linking a program that is to be saved
+    void prepare(GLuint program) const {
+        if (isEnabled()) {
+            glProgramParameteri_(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+    }
+
+    // Returns a new program linked from the binary in filename if it was
+    // saved under key, or 0.
+    GLuint load(const std::string& filename, const std::string& key) const {
+        if (!isEnabled()) {
+            return 0;
+        }
+
+        std::ifstream ifs(filename, std::ios::binary);
+        char magic[sizeof(MAGIC)];
+        std::uint32_t version, keyLength, format, length;
+        if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(magic)) != 0
+            || !read(ifs, version) || version != VERSION
+            || !read(ifs, keyLength) || keyLength != key.size()) {
+            return 0;
+        }
+        std::string storedKey(keyLength, '\0');
+        if (!ifs.read(&storedKey[0], keyLength) || storedKey != key
+            || !read(ifs, format) || !read(ifs, length)) {
+            return 0;
+        }
+        // a corrupt length must not get to size the allocation
+        const auto start = ifs.tellg();
+        ifs.seekg(0, std::ios::end);
+        const auto end = ifs.tellg();
+        ifs.seekg(start);
+        if (start < 0 || end < start || length > static_cast<std::uint64_t>(end - start)) {
+            return 0;
+        }
+        std::vector<char> binary(length);
+        if (!ifs.read(binary.data(), length)) {
+            return 0;
+        }
+
+        // the driver may still turn a binary down, e.g. after an update
+        // that kept its version string
+        const GLuint program = glCreateProgram();
+        glProgramBinary_(program, format, binary.data(), length);
+        GLint linkStatus;
+        glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+        if (linkStatus != GL_TRUE) {
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+    bool save(const std::string& filename, const std::string& key, GLuint program) const {
+        if (!isEnabled()) {
+            return false;
+        }
+
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) {
+            return false;
+        }
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary_(program, length, &length, &format, binary.data());
+
+        std::ofstream ofs(filename, std::ios::binary);
+        ofs.write(MAGIC, sizeof(MAGIC));
+        write(ofs, VERSION);
+        write(ofs, static_cast<std::uint32_t>(key.size()));
+        ofs.write(key.data(), key.size());
+        write(ofs, static_cast<std::uint32_t>(format));
+        write(ofs, static_cast<std::uint32_t>(length));
+        ofs.write(binary.data(), length);
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    static constexpr char MAGIC[4] = {'W', 'A', 'V', 'P'};
+    static const std::uint32_t VERSION = 1;
+
+    PFNGLGETPROGRAMBINARYPROC glGetProgramBinary_;
+    PFNGLPROGRAMBINARYPROC glProgramBinary_;
+    PFNGLPROGRAMPARAMETERIPROC glProgramParameteri_;
+    std::string driver_;
+
+    static bool read(std::istream& is, std::uint32_t& value) {
+        return static_cast<bool>(is.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    static void write(std::ostream& os, std::uint32_t value) {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+};
+
+constexpr char ProgramBinaryCache::MAGIC[4];
 
 class Shader {
 public:
@@ -41,16 +450,15 @@ public:
     Shader& operator=(const Shader&) = delete;
     Shader(Shader&&) = default;
 
-    Shader(const std::string& filename, GLenum type) : type_(type) {
+    Shader(const std::string& filename, GLenum type) :
+        Shader(type, readSource(filename)) {}
+
+    Shader(GLenum type, const std::string& source) : type_(type) {
+        TRACE_SCOPE("Shader");
         assert(type == GL_VERTEX_SHADER
                 || type == GL_FRAGMENT_SHADER
                 || type == GL_GEOMETRY_SHADER);
 
-        std::ifstream ifs(filename.c_str(), std::ios::in);
-        std::ostringstream ss;
-        ss << ifs.rdbuf();
-        const auto source = ss.str();
-
         const auto str = source.c_str();
         const auto length = static_cast<GLint>(source.size());
 
@@ -70,7 +478,7 @@ public:
 
         GLint compileStatus;
         glGetShaderiv(id_, GL_COMPILE_STATUS, &compileStatus);
-        assert(compileStatus == GL_TRUE);
+        compiled_ = compileStatus == GL_TRUE;
     }
 
     virtual ~Shader() {
@@ -81,22 +489,50 @@ public:
         return id_;
     }
 
+    bool isCompiled() const {
+        return compiled_;
+    }
+
+    static std::string readSource(const std::string& filename) {
+        std::ifstream ifs(filename.c_str(), std::ios::in);
+        std::ostringstream ss;
+        ss << ifs.rdbuf();
+        return ss.str();
+    }
+
 private:
     GLuint id_;
     GLenum type_;
+    bool compiled_;
+};
+
+// Location of a uniform of type T, resolved once by ShaderProgram::getUniform.
+template <typename T>
+class Uniform {
+public:
+    explicit Uniform(GLint location = -1) : location_(location) {}
+
+    GLint getLocation() const {
+        return location_;
+    }
+
+private:
+    GLint location_;
 };
 
 class ShaderProgram {
 public:
     ShaderProgram(const ShaderProgram&) = delete;
     ShaderProgram& operator=(const ShaderProgram&) = delete;
-    ShaderProgram(ShaderProgram&&) = default;
+    ShaderProgram(ShaderProgram&&) = delete;
 
     ShaderProgram(const std::vector<std::shared_ptr<Shader>>& shaders) {
+        TRACE_SCOPE("ShaderProgram");
         id_ = glCreateProgram();
         for (const auto& shader : shaders) {
             glAttachShader(id_, shader->getId());
         }
+        ProgramBinaryCache::getInstance().prepare(id_);
         glLinkProgram(id_);
         for (const auto& shader : shaders) {
             glDetachShader(id_, shader->getId());
@@ -114,27 +550,129 @@ public:
 
         GLint linkStatus;
         glGetProgramiv(id_, GL_LINK_STATUS, &linkStatus);
-        assert(linkStatus == GL_TRUE);
+        linked_ = linkStatus == GL_TRUE;
+
+        if (linked_) {
+            reflectUniforms();
+        }
+    }
+
+    // takes over a program that is already linked
+    explicit ShaderProgram(GLuint id) :
+        id_(id),
+        linked_(true) {
+
+        reflectUniforms();
+    }
+
+    virtual ~ShaderProgram() {
+        GLState::getInstance().deleteProgram(id_);
+    }
+
+    GLuint getId() const {
+        return id_;
+    }
+
+    bool isLinked() const {
+        return linked_;
     }
 
     void use() const {
-        glUseProgram(id_);
+        GLState::getInstance().useProgram(id_);
+    }
+
+    template <typename T>
+    Uniform<T> getUniform(const char* name) const {
+        return Uniform<T>(getUniformLocation(name));
+    }
+
+    void setUniform(const Uniform<GLint>& uniform, GLint value) const {
+        glUniform1i(uniform.getLocation(), value);
+    }
+
+    void setUniform(const Uniform<glm::fvec2>& uniform, const glm::fvec2& value) const {
+        glUniform2fv(uniform.getLocation(), 1, glm::value_ptr(value));
+    }
+
+    void setUniform(const Uniform<glm::fvec4>& uniform, const glm::fvec4& value) const {
+        glUniform4fv(uniform.getLocation(), 1, glm::value_ptr(value));
     }
 
-    void setUniform(const char* name, GLuint value) const {
-        glUniform1i(glGetUniformLocation(id_, name), value);
+    void setUniform(const char* name, GLint value) const {
+        setUniform(getUniform<GLint>(name), value);
     }
 
     void setUniform(const char* name, const glm::fvec2& value) const {
-        glUniform2fv(glGetUniformLocation(id_, name), 1, glm::value_ptr(value));
+        setUniform(getUniform<glm::fvec2>(name), value);
     }
 
     void setUniform(const char* name, const glm::fvec4& value) const {
-        glUniform4fv(glGetUniformLocation(id_, name), 1, glm::value_ptr(value));
+        setUniform(getUniform<glm::fvec4>(name), value);
+    }
+
+    // number of glGetUniformLocation calls made since the last reset
+    static int getDriverLookupCount() {
+        return driverLookupCount();
+    }
+
+    static void resetDriverLookupCount() {
+        driverLookupCount() = 0;
     }
 
 private:
     GLuint id_;
+    bool linked_;
+    std::vector<std::pair<std::string, GLint>> uniforms_; // sorted by name
+
+    static int& driverLookupCount() {
+        static int count = 0;
+        return count;
+    }
+
+    // caches the locations of all active uniforms so that setting them by
+    // name doesn't go through the driver
+    void reflectUniforms() {
+        GLint numUniforms, maxNameLength;
+        glGetProgramiv(id_, GL_ACTIVE_UNIFORMS, &numUniforms);
+        glGetProgramiv(id_, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+        std::vector<GLchar> nameBuffer(std::max(maxNameLength, 1));
+        for (GLint i = 0; i < numUniforms; ++i) {
+            GLsizei length;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(id_, i, nameBuffer.size(), &length, &size, &type, nameBuffer.data());
+
+            std::string name(nameBuffer.data(), length);
+            const GLint location = glGetUniformLocation(id_, name.c_str());
+            if (location < 0) {
+                continue; // uniform block member
+            }
+
+            // arrays are reported as "name[0]" but are usually set by their plain name
+            const auto bracket = name.find('[');
+            if (bracket != std::string::npos) {
+                uniforms_.emplace_back(name.substr(0, bracket), location);
+            }
+            uniforms_.emplace_back(std::move(name), location);
+        }
+        std::sort(uniforms_.begin(), uniforms_.end());
+    }
+
+    GLint getUniformLocation(const char* name) const {
+        const auto it = std::lower_bound(uniforms_.begin(), uniforms_.end(), name,
+                [](const std::pair<std::string, GLint>& uniform, const char* name) {
+            return uniform.first < name;
+        });
+        if (it != uniforms_.end() && it->first == name) {
+            return it->second;
+        }
+
+        // not an active uniform (e.g. an element of an array or optimized out);
+        // the driver knows best, and -1 is silently ignored by glUniform*
+        ++driverLookupCount();
+        return glGetUniformLocation(id_, name);
+    }
 };
 
 class Texture {
@@ -143,34 +681,66 @@ public:
     Texture& operator=(const Texture&) = delete;
     Texture(Texture&&) = default;
 
-    Texture(const std::string& filename) {
-        int numComponents;
-        const auto data = stbi_load(filename.c_str(), &width_, &height_, &numComponents, STBI_rgb_alpha);
-        assert(data);
-        assert(numComponents == 4);
+    // data is tightly packed RGBA; maxLevel limits the generated mipmap chain
+    Texture(int width, int height, const unsigned char* data, int maxLevel = 1000) :
+        width_(width),
+        height_(height) {
 
+        TRACE_SCOPE("Texture");
         glGenTextures(1, &id_);
-        glBindTexture(GL_TEXTURE_2D, id_);
+        auto& state = GLState::getInstance();
+        state.bindTexture(state.getActiveTextureUnit(), id_);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_, height_, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
 
-        stbi_image_free(data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, maxLevel);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+
+    // levels is the whole mipmap chain, tightly packed RGBA, where level i
+    // is (width >> i) by (height >> i)
+    Texture(int width, int height, const std::vector<const unsigned char*>& levels) :
+        width_(width),
+        height_(height) {
+
+        TRACE_SCOPE("Texture");
+        glGenTextures(1, &id_);
+        auto& state = GLState::getInstance();
+        state.bindTexture(state.getActiveTextureUnit(), id_);
+        for (std::size_t i = 0; i < levels.size(); ++i) {
+            glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, width_ >> i, height_ >> i, 0, GL_RGBA, GL_UNSIGNED_BYTE, levels[i]);
+        }
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+    }
+
+    // replaces a rectangle of level 0; the mipmaps are left stale until
+    // generateMipmap is called
+    void setSubImage(int x, int y, int width, int height, const unsigned char* data) {
+        auto& state = GLState::getInstance();
+        state.bindTexture(state.getActiveTextureUnit(), id_);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    }
+
+    void generateMipmap() {
+        auto& state = GLState::getInstance();
+        state.bindTexture(state.getActiveTextureUnit(), id_);
         glGenerateMipmap(GL_TEXTURE_2D);
     }
 
     virtual ~Texture() {
-        glDeleteTextures(1, &id_);
+        GLState::getInstance().deleteTexture(id_);
     }
 
     void bind(unsigned int textureUnit) const {
-        assert(textureUnit < 32);
-
-        glActiveTexture(GL_TEXTURE0 + textureUnit);
-        glBindTexture(GL_TEXTURE_2D, id_);
+        GLState::getInstance().bindTexture(textureUnit, id_);
     }
 
     int getWidth() const {
@@ -186,13 +756,224 @@ private:
     int width_, height_;
 };
 
+// Packs every sprite image into a single texture so that sprites can be drawn
+// without switching textures.
+//
+// If wave_bake has written an up to date cache, the atlas and its mipmaps
+// are uploaded straight from the mapped file. Otherwise only the image
+// headers are read on construction, which is enough to lay out the atlas;
+// the images are decoded on worker threads and uploaded to their cells by
+// update() on the render thread, and until then a cell shows a placeholder,
+// so the first frame does not wait for any decoding.
+class TextureAtlas {
+public:
+    struct Region {
+        const Texture* texture;
+        glm::vec4 uvRect; // offset in xy, extent in zw
+    };
+
+    TextureAtlas(const TextureAtlas&) = delete;
+    TextureAtlas& operator=(const TextureAtlas&) = delete;
+
+    TextureAtlas(const std::vector<std::string>& filenames) :
+        numUploaded_(0),
+        nextDecode_(0) {
+
+        TRACE_SCOPE("TextureAtlas");
+        GLint maxTextureSize;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+
+        AtlasCache cache;
+        if (cache.open(ATLAS_CACHE_FILENAME, filenames)) {
+            const auto size = cache.getSize();
+            assert(size.x <= maxTextureSize && size.y <= maxTextureSize);
+            images_ = cache.getImages();
+            imageData_.assign(images_.size(), nullptr);
+            numUploaded_ = images_.size();
+            texture_.reset(new Texture(size.x, size.y, cache.getLevels()));
+            addRegions(size);
+            return;
+        }
+
+        for (const auto& filename : filenames) {
+            AtlasImage image;
+            image.filename = filename;
+            int numComponents;
+            const int found = stbi_info(filename.c_str(), &image.width, &image.height, &numComponents);
+            assert(found && numComponents == 4);
+            static_cast<void>(found);
+            images_.push_back(image);
+        }
+        imageData_.assign(images_.size(), nullptr);
+
+        const auto size = packAtlas(images_);
+        assert(size.x <= maxTextureSize && size.y <= maxTextureSize);
+
+        std::vector<stbi_uc> pixels(4 * size.x * size.y, 0);
+        for (const auto& image : images_) {
+            for (int cy = 0; cy < atlasCellSize(image.height); ++cy) {
+                for (int cx = 0; cx < atlasCellSize(image.width); ++cx) {
+                    std::copy_n(PLACEHOLDER_COLOR, 4, pixels.begin() + 4 * ((image.y + cy) * size.x + image.x + cx));
+                }
+            }
+        }
+
+        texture_.reset(new Texture(size.x, size.y, pixels.data(), ATLAS_MAX_MIPMAP_LEVEL));
+        addRegions(size);
+
+        const auto numDecoders = std::min<std::size_t>(images_.size(),
+            std::max(1u, std::thread::hardware_concurrency()));
+        for (std::size_t i = 0; i < numDecoders; ++i) {
+            decoders_.emplace_back(&TextureAtlas::decode, this);
+        }
+    }
+
+    ~TextureAtlas() {
+        for (auto& decoder : decoders_) {
+            decoder.join();
+        }
+        for (const auto data : imageData_) {
+            stbi_image_free(data);
+        }
+    }
+
+    // uploads the images decoded since the last call
+    void update() {
+        std::vector<std::size_t> decoded;
+        {
+            std::lock_guard<std::mutex> lock(decodedMutex_);
+            decoded.swap(decoded_);
+        }
+        if (decoded.empty()) {
+            return;
+        }
+
+        TRACE_SCOPE("TextureAtlas::update");
+        std::vector<stbi_uc> cell;
+        for (const auto i : decoded) {
+            const auto& image = images_[i];
+            const int cellWidth = atlasCellSize(image.width), cellHeight = atlasCellSize(image.height);
+            cell.resize(4 * cellWidth * cellHeight);
+            fillAtlasCell(image, imageData_[i], cell.data(), cellWidth);
+            texture_->setSubImage(image.x, image.y, cellWidth, cellHeight, cell.data());
+
+            stbi_image_free(imageData_[i]);
+            imageData_[i] = nullptr;
+            ++numUploaded_;
+        }
+        texture_->generateMipmap();
+    }
+
+    // whether every image has been uploaded
+    bool isLoaded() const {
+        return numUploaded_ == images_.size();
+    }
+
+    static TextureAtlas& getInstance() {
+        static TextureAtlas instance(ATLAS_FILENAMES);
+        return instance;
+    }
+
+    const Region& getRegion(const std::string& filename) const {
+        const auto it = regions_.find(filename);
+        assert(it != regions_.end());
+        return it->second;
+    }
+
+    const Texture& getTexture() const {
+        return *texture_;
+    }
+
+private:
+    static constexpr stbi_uc PLACEHOLDER_COLOR[4] = {128, 128, 128, 255};
+
+    std::unique_ptr<Texture> texture_;
+    std::map<std::string, Region> regions_;
+
+    std::vector<AtlasImage> images_;
+    std::size_t numUploaded_;
+
+    // owned by the decoders until the index is in decoded_
+    std::vector<stbi_uc*> imageData_;
+    std::atomic<std::size_t> nextDecode_;
+    std::vector<std::thread> decoders_;
+    std::mutex decodedMutex_;
+    std::vector<std::size_t> decoded_;
+
+    void addRegions(glm::ivec2 size) {
+        for (const auto& image : images_) {
+            regions_[image.filename] = {texture_.get(), {
+                static_cast<float>(image.x + ATLAS_PADDING / 2) / size.x,
+                static_cast<float>(image.y + ATLAS_PADDING / 2) / size.y,
+                static_cast<float>(image.width) / size.x,
+                static_cast<float>(image.height) / size.y
+            }};
+        }
+    }
+
+    void decode() {
+        for (;;) {
+            const std::size_t i = nextDecode_++;
+            if (i >= images_.size()) {
+                return;
+            }
+
+            TRACE_SCOPE("decode");
+            const auto& image = images_[i];
+            int width, height, numComponents;
+            const auto data = stbi_load(image.filename.c_str(), &width, &height, &numComponents, STBI_rgb_alpha);
+            assert(data);
+            assert(width == image.width && height == image.height);
+
+            std::lock_guard<std::mutex> lock(decodedMutex_);
+            imageData_[i] = data;
+            decoded_.push_back(i);
+        }
+    }
+};
+
+constexpr stbi_uc TextureAtlas::PLACEHOLDER_COLOR[4];
+
+// Owns every shader program. With watchShaders, a program whose sources
+// change on disk is rebuilt and replaced, between frames, by update();
+// if it fails to compile or link, the one in use is kept.
 class ShaderProgramStore {
 public:
+    ShaderProgramStore(const ShaderProgramStore&) = delete;
+    ShaderProgramStore& operator=(const ShaderProgramStore&) = delete;
+
     ShaderProgramStore() :
-        spriteVert_(std::make_shared<Shader>("shaders/sprite.vert", GL_VERTEX_SHADER)),
-        spriteGeom_(std::make_shared<Shader>("shaders/sprite.geom", GL_GEOMETRY_SHADER)),
-        texFrag_(std::make_shared<Shader>("shaders/tex.frag", GL_FRAGMENT_SHADER)),
-        spriteProg_({spriteVert_, spriteGeom_, texFrag_}) {}
+        numCachedPrograms_(0),
+        generation_(0),
+        watchFd_(-1) {
+
+        TRACE_SCOPE("ShaderProgramStore");
+
+        // programs are deleted through GLState, so it has to outlive the store
+        GLState::getInstance();
+
+        programs_.push_back({"sprite", {
+            {"shaders/sprite.vert", GL_VERTEX_SHADER},
+            {"shaders/sprite.geom", GL_GEOMETRY_SHADER},
+            {"shaders/tex.frag", GL_FRAGMENT_SHADER}
+        }, nullptr});
+        programs_.push_back({"sprite_quad", {
+            {"shaders/sprite_quad.vert", GL_VERTEX_SHADER},
+            {"shaders/tex.frag", GL_FRAGMENT_SHADER}
+        }, nullptr});
+
+        std::map<std::string, std::shared_ptr<Shader>> shaders;
+        for (auto& program : programs_) {
+            program.program = loadProgram(program, shaders);
+            assert(program.program);
+        }
+    }
+
+    ~ShaderProgramStore() {
+        if (watchFd_ >= 0) {
+            close(watchFd_);
+        }
+    }
 
     static ShaderProgramStore& getInstance() {
         static ShaderProgramStore instance;
@@ -200,19 +981,153 @@ public:
     }
 
     const ShaderProgram& getSpriteProgram() const {
-        return spriteProg_;
+        return *programs_[SPRITE_PROGRAM].program;
+    }
+
+    const ShaderProgram& getQuadSpriteProgram() const {
+        return *programs_[QUAD_SPRITE_PROGRAM].program;
+    }
+
+    int getNumPrograms() const {
+        return static_cast<int>(programs_.size());
+    }
+
+    // number of programs that were loaded from their binary instead of linked
+    int getNumCachedPrograms() const {
+        return numCachedPrograms_;
+    }
+
+    // changes whenever a program is replaced, so that uniform locations
+    // resolved before can be resolved again
+    int getGeneration() const {
+        return generation_;
+    }
+
+    // Starts watching the directory of the sources for files that are
+    // written or moved in, which is how editors save.
+    bool watchShaders(const char* directory) {
+        watchFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watchFd_ < 0) {
+            return false;
+        }
+        if (inotify_add_watch(watchFd_, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(watchFd_);
+            watchFd_ = -1;
+            return false;
+        }
+        watchDirectory_ = std::string(directory) + '/';
+        return true;
+    }
+
+    // Rebuilds the programs whose sources changed since the last call. Does
+    // not block; without changes, it is a single read of the watch.
+    void update() {
+        if (watchFd_ < 0) {
+            return;
+        }
+
+        std::vector<std::string> changed;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(watchFd_, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < length; ) {
+                const auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                if (event->len > 0) {
+                    changed.push_back(watchDirectory_ + event->name);
+                }
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        std::map<std::string, std::shared_ptr<Shader>> shaders;
+        for (auto& program : programs_) {
+            const bool stale = std::any_of(program.files.begin(), program.files.end(),
+                    [&changed](const std::pair<std::string, GLenum>& file) {
+                return std::find(changed.begin(), changed.end(), file.first) != changed.end();
+            });
+            if (!stale) {
+                continue;
+            }
+
+            auto reloaded = loadProgram(program, shaders);
+            if (reloaded) {
+                program.program = std::move(reloaded);
+                ++generation_;
+                std::cerr << "reloaded the " << program.name << " program" << std::endl;
+            } else {
+                std::cerr << "keeping the previous " << program.name << " program" << std::endl;
+            }
+        }
     }
 
 private:
-    const std::shared_ptr<Shader> spriteVert_, spriteGeom_, texFrag_;
-    const ShaderProgram spriteProg_;
+    static const std::size_t SPRITE_PROGRAM = 0;
+    static const std::size_t QUAD_SPRITE_PROGRAM = 1;
+
+    struct Program {
+        std::string name; // the binary is saved to name.program.cache
+        std::vector<std::pair<std::string, GLenum>> files;
+        std::unique_ptr<ShaderProgram> program;
+    };
+
+    std::vector<Program> programs_;
+    int numCachedPrograms_;
+    int generation_;
+    int watchFd_;
+    std::string watchDirectory_;
+
+    // Loads the binary of a program made by this driver from these exact
+    // sources, or compiles and links the sources and saves the binary.
+    // shaders holds what has been compiled so far, by filename, so that a
+    // shader used by several programs is only compiled once. Returns null
+    // if a shader fails to compile or the program fails to link.
+    std::unique_ptr<ShaderProgram> loadProgram(const Program& program,
+                                               std::map<std::string, std::shared_ptr<Shader>>& shaders) {
+        auto& cache = ProgramBinaryCache::getInstance();
+        const auto cacheFilename = program.name + ".program.cache";
+
+        std::vector<std::string> sources;
+        std::string keySources;
+        for (const auto& file : program.files) {
+            sources.push_back(Shader::readSource(file.first));
+            keySources += file.first + '\n' + sources.back();
+        }
+        const auto key = cache.makeKey(keySources);
+
+        const GLuint id = cache.load(cacheFilename, key);
+        if (id != 0) {
+            ++numCachedPrograms_;
+            return std::unique_ptr<ShaderProgram>(new ShaderProgram(id));
+        }
+
+        std::vector<std::shared_ptr<Shader>> programShaders;
+        for (std::size_t i = 0; i < program.files.size(); ++i) {
+            auto& shader = shaders[program.files[i].first];
+            if (!shader) {
+                shader = std::make_shared<Shader>(program.files[i].second, sources[i]);
+            }
+            if (!shader->isCompiled()) {
+                return nullptr;
+            }
+            programShaders.push_back(shader);
+        }
+        std::unique_ptr<ShaderProgram> linked(new ShaderProgram(programShaders));
+        if (!linked->isLinked()) {
+            return nullptr;
+        }
+        if (cache.isEnabled() && !cache.save(cacheFilename, key, linked->getId())) {
+            std::cerr << "failed to save " << cacheFilename << std::endl;
+        }
+        return linked;
+    }
 };
 
 class Sprite {
 public:
-    Sprite(const std::string& filename, const glm::vec2& size) :
-        texture_(filename),
-        size_(size) {}
+    Sprite(const std::string& filename, const glm::vec2& size, int layer) :
+        region_(TextureAtlas::getInstance().getRegion(filename)),
+        size_(size),
+        layer_(layer) {}
 
     void setPos(const glm::vec2& pos) {
         pos_ = pos;
@@ -226,33 +1141,256 @@ public:
         return size_;
     }
 
-    const Texture& getTexture() const {
-        return texture_;
+    const TextureAtlas::Region& getRegion() const {
+        return region_;
     }
 
-    void draw() const {
-        const auto& spriteProg = ShaderProgramStore::getInstance().getSpriteProgram();
-        texture_.bind(0);
-        spriteProg.use();
-        spriteProg.setUniform("pos", pos_);
-        spriteProg.setUniform("size", size_);
-        spriteProg.setUniform("tex", 0);
-        glDrawArrays(GL_POINTS, 0, 1);
+    int getLayer() const {
+        return layer_;
     }
 
+    void draw() const;
+
 private:
-    const Texture texture_;
+    const TextureAtlas::Region region_;
     const glm::vec2 size_;
+    const int layer_;
     glm::vec2 pos_;
 };
 
+// Collects every sprite drawn during a frame into a single vertex buffer
+// and submits them with one draw call per texture within each layer.
+//
+// The buffer is consumed in one of three ways:
+//  - Mode::Geometry: one point per sprite, expanded by sprite.geom
+//  - Mode::Instanced: per-instance attributes of a 4-vertex triangle strip
+//    expanded by sprite_quad.vert
+//  - Mode::Quad: 4 vertices per sprite, indexed by a static unit-quad index
+//    buffer and expanded by sprite_quad.vert, for drivers where both geometry
+//    shaders and instancing are slow
+class SpriteBatch {
+public:
+    enum class Mode {
+        Geometry,
+        Instanced,
+        Quad
+    };
+
+    SpriteBatch(const SpriteBatch&) = delete;
+    SpriteBatch& operator=(const SpriteBatch&) = delete;
+
+    SpriteBatch() :
+        mode_(Mode::Geometry),
+        programGeneration_(-1),
+        instanceBufferCapacity_(0),
+        quadCapacity_(0),
+        drawCallCount_(0) {
+
+        glGenVertexArrays(NUM_MODES, vertexArrays_);
+        glGenBuffers(1, &instanceBuffer_);
+        glGenBuffers(1, &quadIndexBuffer_);
+
+        auto& state = GLState::getInstance();
+        for (int i = 0; i < NUM_MODES; ++i) {
+            state.bindVertexArray(vertexArrays_[i]);
+            state.bindBuffer(GL_ARRAY_BUFFER, instanceBuffer_);
+            setAttribPointers(0);
+            for (GLuint index = 0; index < 4; ++index) {
+                glEnableVertexAttribArray(index);
+                glVertexAttribDivisor(index, i == static_cast<int>(Mode::Instanced) ? 1 : 0);
+            }
+        }
+
+        state.bindVertexArray(vertexArrays_[static_cast<int>(Mode::Quad)]);
+        state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadIndexBuffer_);
+    }
+
+    virtual ~SpriteBatch() {
+        auto& state = GLState::getInstance();
+        state.deleteBuffer(quadIndexBuffer_);
+        state.deleteBuffer(instanceBuffer_);
+        for (const auto vertexArray : vertexArrays_) {
+            state.deleteVertexArray(vertexArray);
+        }
+    }
+
+    static SpriteBatch& getInstance() {
+        static SpriteBatch instance;
+        return instance;
+    }
+
+    Mode getMode() const {
+        return mode_;
+    }
+
+    void setMode(Mode mode) {
+        mode_ = mode;
+    }
+
+    void begin() {
+        entries_.clear();
+        drawCallCount_ = 0;
+    }
+
+    void add(const Texture& texture, const glm::vec2& pos, const glm::vec2& size,
+            const glm::vec4& uvRect, int layer) {
+
+        entries_.push_back({&texture, {pos, size, uvRect, static_cast<float>(layer)}});
+    }
+
+    void end() {
+        if (entries_.empty()) {
+            return;
+        }
+
+        // sprites within a layer don't overlap in a way that matters,
+        // so they can be grouped by texture without changing the picture
+        std::stable_sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+            if (a.instance.layer != b.instance.layer) {
+                return a.instance.layer < b.instance.layer;
+            }
+            return std::less<const Texture*>()(a.texture, b.texture);
+        });
+
+        // the quad path needs every sprite's attributes on each of its 4 vertices
+        const int verticesPerSprite = mode_ == Mode::Quad ? 4 : 1;
+
+        instances_.clear();
+        runs_.clear();
+        for (const auto& entry : entries_) {
+            if (runs_.empty() || runs_.back().texture != entry.texture) {
+                runs_.push_back({entry.texture, static_cast<GLint>(instances_.size() / verticesPerSprite), 0});
+            }
+            ++runs_.back().count;
+            instances_.insert(instances_.end(), verticesPerSprite, entry.instance);
+        }
+
+        auto& state = GLState::getInstance();
+        state.bindVertexArray(vertexArrays_[static_cast<int>(mode_)]);
+        state.bindBuffer(GL_ARRAY_BUFFER, instanceBuffer_);
+        if (mode_ == Mode::Quad) {
+            reserveQuads(entries_.size());
+        }
+
+        // orphan the previous frame's storage so the upload doesn't wait for the GPU
+        const auto size = static_cast<GLsizeiptr>(instances_.size() * sizeof(Instance));
+        instanceBufferCapacity_ = std::max(instanceBufferCapacity_, size);
+        glBufferData(GL_ARRAY_BUFFER, instanceBufferCapacity_, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, instances_.data());
+
+        const auto& store = ShaderProgramStore::getInstance();
+        if (programGeneration_ != store.getGeneration()) {
+            spriteTexUniform_ = store.getSpriteProgram().getUniform<GLint>("tex");
+            quadSpriteTexUniform_ = store.getQuadSpriteProgram().getUniform<GLint>("tex");
+            programGeneration_ = store.getGeneration();
+        }
+        if (mode_ == Mode::Geometry) {
+            store.getSpriteProgram().use();
+            store.getSpriteProgram().setUniform(spriteTexUniform_, 0);
+        } else {
+            store.getQuadSpriteProgram().use();
+            store.getQuadSpriteProgram().setUniform(quadSpriteTexUniform_, 0);
+        }
+
+        for (const auto& run : runs_) {
+            run.texture->bind(0);
+            switch (mode_) {
+            case Mode::Geometry:
+                glDrawArrays(GL_POINTS, run.first, run.count);
+                break;
+            case Mode::Instanced:
+                // GL 3.3 has no base instance, so point the attributes at the run instead
+                setAttribPointers(run.first * sizeof(Instance));
+                glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, run.count);
+                break;
+            case Mode::Quad:
+                glDrawElements(GL_TRIANGLES, run.count * INDICES_PER_QUAD, GL_UNSIGNED_INT,
+                        reinterpret_cast<const void*>(run.first * INDICES_PER_QUAD * sizeof(GLuint)));
+                break;
+            }
+            ++drawCallCount_;
+        }
+    }
+
+    int getDrawCallCount() const {
+        return drawCallCount_;
+    }
+
+private:
+    static const int NUM_MODES = 3;
+    static const int INDICES_PER_QUAD = 6;
+
+    struct Instance {
+        glm::vec2 pos;
+        glm::vec2 size;
+        glm::vec4 uvRect;
+        float layer;
+    };
+
+    struct Entry {
+        const Texture* texture;
+        Instance instance;
+    };
+
+    struct Run {
+        const Texture* texture;
+        GLint first;
+        GLsizei count;
+    };
+
+    static void setAttribPointers(std::size_t offset) {
+        const auto pointer = [offset](std::size_t member) {
+            return reinterpret_cast<const void*>(offset + member);
+        };
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Instance), pointer(offsetof(Instance, pos)));
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Instance), pointer(offsetof(Instance, size)));
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), pointer(offsetof(Instance, uvRect)));
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), pointer(offsetof(Instance, layer)));
+    }
+
+    // grows the index buffer so that it covers at least numQuads quads
+    void reserveQuads(std::size_t numQuads) {
+        if (numQuads <= quadCapacity_) {
+            return;
+        }
+        quadCapacity_ = std::max(numQuads, 2 * quadCapacity_);
+
+        std::vector<GLuint> indices;
+        indices.reserve(quadCapacity_ * INDICES_PER_QUAD);
+        for (GLuint i = 0; i < quadCapacity_; ++i) {
+            for (GLuint corner : {0, 1, 2, 2, 1, 3}) {
+                indices.push_back(4 * i + corner);
+            }
+        }
+
+        // the index buffer is part of the quad vertex array's state, which is bound by now
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    }
+
+    Mode mode_;
+    int programGeneration_; // of the programs the uniforms were resolved in
+    Uniform<GLint> spriteTexUniform_, quadSpriteTexUniform_;
+    GLuint vertexArrays_[NUM_MODES], instanceBuffer_, quadIndexBuffer_;
+    GLsizeiptr instanceBufferCapacity_;
+    std::size_t quadCapacity_;
+    std::vector<Entry> entries_;
+    std::vector<Instance> instances_;
+    std::vector<Run> runs_;
+    int drawCallCount_;
+};
+
+void Sprite::draw() const {
+    TRACE_SCOPE("Sprite::draw");
+    SpriteBatch::getInstance().add(*region_.texture, pos_, size_, region_.uvRect, layer_);
+}
+
 class SpriteStore {
 public:
     SpriteStore() :
-        spraySprite_("spray.png", {SPRAY_WIDTH, 0.5f}),
+        spraySprite_("spray.png", {SPRAY_WIDTH, 0.5f}, OBJECT_LAYER),
         pelicanSprites_{
-            std::make_shared<Sprite>("pelican0.png", glm::vec2(PELICAN_WIDTH, 0.2f)),
-            std::make_shared<Sprite>("pelican1.png", glm::vec2(PELICAN_WIDTH, 0.33f))
+            std::make_shared<Sprite>("pelican0.png", glm::vec2(PELICAN_WIDTH, 0.2f), OBJECT_LAYER),
+            std::make_shared<Sprite>("pelican1.png", glm::vec2(PELICAN_WIDTH, 0.33f), OBJECT_LAYER)
         } {}
 
     static SpriteStore& getInstance() {
@@ -273,206 +1411,952 @@ private:
     const std::vector<std::shared_ptr<Sprite>> pelicanSprites_;
 };
 
-class Object {
+void drawObstacles(const ObstacleQueue& sprays, const ObstacleQueue& pelicans, double t) {
+    auto& spriteStore = SpriteStore::getInstance();
+
+    auto& spraySprite = spriteStore.getSpraySprite();
+    for (std::size_t i = 0; i < sprays.size(); ++i) {
+        spraySprite.setPos(getSprayPos(sprays.getSpawnTimes()[i], t));
+        spraySprite.draw();
+    }
+
+    for (std::size_t i = 0; i < pelicans.size(); ++i) {
+        const double spawnTime = pelicans.getSpawnTimes()[i];
+        auto& sprite = *spriteStore.getPelicanSprites().at(getPelicanAnimIndex(spawnTime, t));
+        sprite.setPos(getPelicanPos(spawnTime, t));
+        sprite.draw();
+    }
+}
+
+// Obstacles for --benchmark, drawn along with those of the game but never
+// hit: half sprays and half pelicans, with spawn times evenly spaced over
+// their lifetime, so the same number is on screen every frame.
+class SyntheticLoad {
 public:
-    Object(double spawnTime) :
-        spawnTime_(spawnTime),
-        visible_(true) {}
+    explicit SyntheticLoad(std::size_t count) :
+        numSprays_(count / 2),
+        numPelicans_(count - count / 2),
+        sprays_(numSprays_),
+        pelicans_(numPelicans_) {}
+
+    void update(double t) {
+        fill(sprays_, numSprays_, SPRAY_LIFETIME, t);
+        fill(pelicans_, numPelicans_, PELICAN_LIFETIME, t);
+    }
 
-    bool isVisible() const {
-        return visible_;
+    const ObstacleQueue& getSprays() const {
+        return sprays_;
     }
 
-    double getSpawnTime() const {
-        return spawnTime_;
+    const ObstacleQueue& getPelicans() const {
+        return pelicans_;
     }
 
-    virtual void update(double t) = 0;
-    virtual void draw() const = 0;
-    virtual bool hit(float boatPosY) const = 0;
+private:
+    const std::size_t numSprays_, numPelicans_;
+    ObstacleQueue sprays_, pelicans_;
 
-protected:
-    double spawnTime_;
-    glm::vec2 pos_;
-    bool visible_;
+    static void fill(ObstacleQueue& queue, std::size_t count, double lifetime, double t) {
+        queue.clear();
+        if (count == 0) {
+            return;
+        }
+        // the newest is the last multiple of interval up to t
+        const double interval = lifetime / count;
+        const double newest = std::floor(t / interval) * interval;
+        for (std::size_t i = count; i-- > 0;) {
+            queue.push(newest - i * interval);
+        }
+    }
 };
 
-class Spray : public Object {
+// Measures every frame: the CPU time of each phase of the main loop, and
+// the GPU time of its rendering with a GL_TIME_ELAPSED query. Queries are
+// used in turns from a ring of NUM_QUERIES, so the result of a frame is only
+// looked at when its query comes up again. A result the GPU still hasn't
+// delivered by then is dropped rather than waited for, so reading never
+// stalls. Frames are kept for drawing a graph of the last ones and for
+// writing them all out as CSV; does nothing unless enabled.
+class Profiler {
 public:
-    using Object::Object;
+    enum class Phase {
+        Update,
+        Collision,
+        Draw,
+        Swap
+    };
+
+    static const int NUM_PHASES = 4;
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    explicit Profiler(bool enabled) :
+        enabled_(enabled) {
 
-    void update(double t) override {
-        pos_ = {0.9f - WAVE_SPEED * (t - spawnTime_), 0.75f + 0.25 * std::cos(2 * (t - spawnTime_))};
-        visible_ = t <= spawnTime_ + glm::pi<double>();
+        std::fill_n(queryFrames_, NUM_QUERIES, NO_FRAME);
+        if (!enabled_) {
+            return;
+        }
+        glGenQueries(NUM_QUERIES, queries_);
+
+        // a texel per color, sampled at its center
+        const unsigned char colors[4 * NUM_COLORS] = {
+            0, 0, 0, 160,       // background
+            64, 128, 255, 255,  // update
+            255, 64, 64, 255,   // collision
+            64, 224, 64, 255,   // draw
+            160, 160, 160, 255, // swap
+            255, 160, 0, 255,   // GPU
+            255, 255, 255, 255  // 60 fps
+        };
+        colors_.reset(new Texture(NUM_COLORS, 1, colors, 0));
     }
 
-    void draw() const override {
-        auto& sprite = SpriteStore::getInstance().getSpraySprite();
-        sprite.setPos(pos_);
-        sprite.draw();
+    virtual ~Profiler() {
+        if (enabled_) {
+            glDeleteQueries(NUM_QUERIES, queries_);
+        }
+    }
+
+    bool isEnabled() const {
+        return enabled_;
+    }
+
+    // starts the CPU clock and the GPU query of a new frame
+    void beginFrame() {
+        if (!enabled_) {
+            return;
+        }
+
+        const int query = frames_.size() % NUM_QUERIES;
+        readQuery(query, false);
+        glBeginQuery(GL_TIME_ELAPSED, queries_[query]);
+        queryFrames_[query] = frames_.size();
+
+        frames_.push_back(Frame());
+        frameStartTime_ = Clock::now();
+    }
+
+    void begin(Phase phase) {
+        if (enabled_) {
+            phaseStartTimes_[static_cast<int>(phase)] = Clock::now();
+        }
+    }
+
+    // a phase can run more than once a frame, e.g. a tick per update
+    void end(Phase phase) {
+        if (enabled_) {
+            const int i = static_cast<int>(phase);
+            frames_.back().phases[i] += milliseconds(phaseStartTimes_[i], Clock::now());
+        }
+    }
+
+    // ends the GPU query, after the last GL call of the frame that is to
+    // be counted
+    void endRendering() {
+        if (enabled_) {
+            glEndQuery(GL_TIME_ELAPSED);
+        }
+    }
+
+    void endFrame() {
+        if (enabled_) {
+            frames_.back().cpu = milliseconds(frameStartTime_, Clock::now());
+        }
+    }
+
+    // Adds a bar per recent frame, stacked by phase, with the GPU time as
+    // a narrower bar in front and a line at 60 fps.
+    void drawGraph() const {
+        if (!enabled_) {
+            return;
+        }
+
+        auto& spriteBatch = SpriteBatch::getInstance();
+        const auto add = [&](const glm::vec2& pos, const glm::vec2& size, int color) {
+            const glm::vec4 uvRect((color + 0.5f) / NUM_COLORS, 0.5f, 0.f, 0.f);
+            spriteBatch.add(*colors_, pos, size, uvRect, PROFILER_LAYER);
+        };
+        const auto height = [](double milliseconds) {
+            return static_cast<float>(std::min(milliseconds / GRAPH_MILLISECONDS, 1.0)) * GRAPH_SIZE.y;
+        };
+
+        add(GRAPH_POS, GRAPH_SIZE, BACKGROUND_COLOR);
+        const float barWidth = GRAPH_SIZE.x / GRAPH_FRAMES;
+        const std::size_t first = frames_.size() > GRAPH_FRAMES ? frames_.size() - GRAPH_FRAMES : 0;
+        for (std::size_t i = first; i < frames_.size(); ++i) {
+            const float x = GRAPH_POS.x + (i - first) * barWidth;
+            float y = GRAPH_POS.y + GRAPH_SIZE.y;
+            for (int phase = 0; phase < NUM_PHASES; ++phase) {
+                const float h = height(frames_[i].phases[phase]);
+                y -= h;
+                add({x, y}, {barWidth, h}, PHASE_COLORS[phase]);
+            }
+            if (frames_[i].gpu >= 0) {
+                const float h = height(frames_[i].gpu);
+                add({x + barWidth / 4, GRAPH_POS.y + GRAPH_SIZE.y - h}, {barWidth / 2, h}, GPU_COLOR);
+            }
+        }
+        add({GRAPH_POS.x, GRAPH_POS.y + GRAPH_SIZE.y - height(1000.0 / 60)}, {GRAPH_SIZE.x, 0.004f}, LINE_COLOR);
     }
 
-    bool hit(float boatPosY) const override {
-        return  BOAT_POS_X + BOAT_WIDTH > pos_.x + 0.5 * SPRAY_WIDTH
-            && BOAT_POS_X < pos_.x + SPRAY_WIDTH
-            && boatPosY > pos_.y;
+    // one line per frame, in milliseconds; the GPU time is left empty for
+    // frames without a result
+    bool writeCsv(const std::string& filename) {
+        for (int query = 0; query < NUM_QUERIES; ++query) {
+            readQuery(query, true);
+        }
+
+        std::ofstream ofs(filename);
+        ofs << "frame,update,collision,draw,swap,cpu,gpu\n";
+        for (std::size_t i = 0; i < frames_.size(); ++i) {
+            const auto& frame = frames_[i];
+            ofs << i;
+            for (const double phase : frame.phases) {
+                ofs << ',' << phase;
+            }
+            ofs << ',' << frame.cpu << ',';
+            if (frame.gpu >= 0) {
+                ofs << frame.gpu;
+            }
+            ofs << '\n';
+        }
+        return static_cast<bool>(ofs);
     }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Frame {
+        double phases[NUM_PHASES] = {0, 0, 0, 0};
+        double cpu = 0;  // from beginFrame to endFrame
+        double gpu = -1; // until the query is read
+    };
+
+    static const int NUM_QUERIES = 4;
+    static const std::size_t NO_FRAME = ~std::size_t(0);
+
+    enum {
+        BACKGROUND_COLOR,
+        UPDATE_COLOR,
+        COLLISION_COLOR,
+        DRAW_COLOR,
+        SWAP_COLOR,
+        GPU_COLOR,
+        LINE_COLOR,
+        NUM_COLORS
+    };
+    static constexpr int PHASE_COLORS[NUM_PHASES] = {UPDATE_COLOR, COLLISION_COLOR, DRAW_COLOR, SWAP_COLOR};
+
+    // in the top left corner; a full bar is two frames at 60 fps
+    static constexpr std::size_t GRAPH_FRAMES = 120;
+    static constexpr double GRAPH_MILLISECONDS = 2000.0 / 60;
+    static const glm::vec2 GRAPH_POS, GRAPH_SIZE;
+
+    const bool enabled_;
+    GLuint queries_[NUM_QUERIES];
+    std::size_t queryFrames_[NUM_QUERIES]; // whose result each query holds
+    std::unique_ptr<Texture> colors_;
+
+    std::vector<Frame> frames_;
+    Clock::time_point frameStartTime_;
+    Clock::time_point phaseStartTimes_[NUM_PHASES];
+
+    static double milliseconds(Clock::time_point start, Clock::time_point end) {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // unless wait, leaves the GPU time of the frame unknown if the result
+    // isn't available yet
+    void readQuery(int query, bool wait) {
+        if (queryFrames_[query] == NO_FRAME) {
+            return;
+        }
+        GLint available = GL_TRUE;
+        if (!wait) {
+            glGetQueryObjectiv(queries_[query], GL_QUERY_RESULT_AVAILABLE, &available);
+        }
+        if (!available) {
+            queryFrames_[query] = NO_FRAME;
+            return;
+        }
+        GLuint64 nanoseconds;
+        glGetQueryObjectui64v(queries_[query], GL_QUERY_RESULT, &nanoseconds);
+        frames_[queryFrames_[query]].gpu = nanoseconds / 1e6;
+        queryFrames_[query] = NO_FRAME;
+    }
+};
+
+constexpr int Profiler::PHASE_COLORS[NUM_PHASES];
+const std::size_t Profiler::NO_FRAME;
+const glm::vec2 Profiler::GRAPH_POS(0.01f, 0.01f);
+const glm::vec2 Profiler::GRAPH_SIZE(0.3f, 0.25f);
+
+// Where the main loop draws to, and where its time and input come from.
+// The context is current once constructed. Neither kind tears its context
+// down before exit, so that the stores can still delete their GL objects.
+class Platform {
+public:
+    virtual ~Platform() {}
+
+    virtual GLADloadproc getLoadProc() const = 0;
+
+    // in seconds
+    virtual double getTime() const = 0;
+
+    // key is a GLFW key code
+    virtual bool isKeyPressed(int key) const = 0;
+
+    virtual bool shouldClose() const = 0;
+    virtual void close() = 0;
+
+    virtual void swapBuffers() = 0;
+    virtual void pollEvents() = 0;
+
+    // in frames per vertical blank; 0 turns vsync off
+    virtual void setSwapInterval(int interval) = 0;
 };
 
-class Pelican : public Object {
+class WindowPlatform : public Platform {
 public:
-    Pelican(double spawnTime) :
-        Object(spawnTime), 
-        animIndex_(0) {}
+    WindowPlatform(int width, int height, bool debugContext, bool visible) {
+        std::atexit(glfwTerminate);
+        const int initialized = glfwInit();
+        assert(initialized);
+        static_cast<void>(initialized);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_SAMPLES, 4);
+        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, debugContext ? GLFW_TRUE : GLFW_FALSE);
+        glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
+
+        window_ = glfwCreateWindow(width, height, "Wave", nullptr, nullptr);
+        glfwMakeContextCurrent(window_);
+        glfwSetWindowAspectRatio(window_, 16, 9);
+        glfwSetFramebufferSizeCallback(window_, [](GLFWwindow*, int width, int height) {
+            glViewport(0, 0, width, height);
+        });
+
+        glfwSwapInterval(1);
+        glfwSetInputMode(window_, GLFW_STICKY_KEYS, GLFW_TRUE);
+    }
+
+    GLADloadproc getLoadProc() const override {
+        return reinterpret_cast<GLADloadproc>(glfwGetProcAddress);
+    }
+
+    double getTime() const override {
+        return glfwGetTime();
+    }
+
+    bool isKeyPressed(int key) const override {
+        return glfwGetKey(window_, key) == GLFW_PRESS;
+    }
+
+    bool shouldClose() const override {
+        return glfwWindowShouldClose(window_);
+    }
 
-    void update(double t) override {
-        pos_ = {1.f - 0.8f * (t - spawnTime_), 0.05f};
-        visible_ = pos_.x >= -PELICAN_WIDTH;
-        animIndex_ = static_cast<int>((t - spawnTime_) / 0.25) % 2;
+    void close() override {
+        glfwSetWindowShouldClose(window_, GLFW_TRUE);
     }
 
-    void draw() const override {
-        const auto& sprite = SpriteStore::getInstance().getPelicanSprites().at(animIndex_);
-        sprite->setPos(pos_);
-        sprite->draw();
+    void swapBuffers() override {
+        glfwSwapBuffers(window_);
+    }
 
+    void pollEvents() override {
+        glfwPollEvents();
     }
 
-    bool hit(float boatPosY) const override {
-        return  BOAT_POS_X + BOAT_WIDTH > pos_.x
-            && BOAT_POS_X < pos_.x + PELICAN_WIDTH
-            && boatPosY - 0.2f < pos_.y + 0.2f;
+    void setSwapInterval(int interval) override {
+        glfwSwapInterval(interval);
     }
 
 private:
-    int animIndex_;
+    GLFWwindow* window_;
 };
 
-int main() {
-    std::atexit(glfwTerminate);
-    assert(glfwInit());
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_SAMPLES, 4);
-
-    const auto window = glfwCreateWindow(1280, 720, "Wave", nullptr, nullptr);
-    glfwMakeContextCurrent(window);
-    glfwSetWindowAspectRatio(window, 16, 9);
-    glfwSetFramebufferSizeCallback(window, [](GLFWwindow*, int width, int height) {
-        glViewport(0, 0, width, height);
-    });
-
-    glfwSwapInterval(1);
-    glfwSetInputMode(window, GLFW_STICKY_KEYS, GLFW_TRUE);
-
-    assert(gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress)));
-    glad_set_post_callback(gladPostCallback);
+// Draws into a framebuffer object of an EGL context without a surface, so
+// that neither a display nor a GPU is needed: on Mesa, llvmpipe renders it
+// on the surfaceless platform. Where contexts without a surface are not
+// supported, a 1x1 pbuffer is made current instead. There is no input, and
+// time moves on by exactly a 60th of a second per frame, so that runs are
+// reproducible.
+class OffscreenPlatform : public Platform {
+public:
+    OffscreenPlatform(int width, int height, bool debugContext) :
+        width_(width),
+        height_(height),
+        display_(EGL_NO_DISPLAY),
+        frames_(0),
+        closed_(false) {
+
+        const auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if (getPlatformDisplay) {
+            display_ = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        }
+        if (display_ == EGL_NO_DISPLAY) {
+            display_ = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        }
+        assert(display_ != EGL_NO_DISPLAY);
+        // the calls are kept out of the asserts, which NDEBUG removes
+        EGLBoolean ok = eglInitialize(display_, nullptr, nullptr);
+        assert(ok);
+
+        const char* extensions = eglQueryString(display_, EGL_EXTENSIONS);
+        const bool surfaceless = extensions && std::strstr(extensions, "EGL_KHR_surfaceless_context");
+
+        const EGLint configAttribs[] = {
+            EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint numConfigs;
+        ok = eglChooseConfig(display_, configAttribs, &config, 1, &numConfigs);
+        assert(ok && numConfigs > 0);
+
+        ok = eglBindAPI(EGL_OPENGL_API);
+        assert(ok);
+        const EGLint contextAttribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_CONTEXT_OPENGL_DEBUG, debugContext ? EGL_TRUE : EGL_FALSE,
+            EGL_NONE
+        };
+        const auto context = eglCreateContext(display_, config, EGL_NO_CONTEXT, contextAttribs);
+        assert(context != EGL_NO_CONTEXT);
+
+        auto surface = EGL_NO_SURFACE;
+        if (!surfaceless) {
+            const EGLint surfaceAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+            surface = eglCreatePbufferSurface(display_, config, surfaceAttribs);
+            assert(surface != EGL_NO_SURFACE);
+        }
+        ok = eglMakeCurrent(display_, surface, surface, context);
+        assert(ok);
+
+        // the framebuffers need GL already
+        ok = gladLoadGLLoader(getLoadProc());
+        assert(ok);
+        static_cast<void>(ok);
+
+        // multisampled like the window, and resolved into a plain one to be read
+        GLint maxSamples;
+        glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+        glGenRenderbuffers(NUM_FRAMEBUFFERS, renderbuffers_);
+        glGenFramebuffers(NUM_FRAMEBUFFERS, framebuffers_);
+        for (int i = 0; i < NUM_FRAMEBUFFERS; ++i) {
+            glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers_[i]);
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, i == DRAW ? std::min(4, maxSamples) : 0,
+                GL_RGBA8, width_, height_);
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[i]);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers_[i]);
+            assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[DRAW]);
+        glViewport(0, 0, width_, height_);
+    }
 
-    GLuint vertexArray;
-    glGenVertexArrays(1, &vertexArray);
-    glBindVertexArray(vertexArray);
+    GLADloadproc getLoadProc() const override {
+        return reinterpret_cast<GLADloadproc>(eglGetProcAddress);
+    }
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glClearColor(0.627f, 0.847f, 0.937f, 1.f);
+    double getTime() const override {
+        return frames_ / 60.0;
+    }
 
-    Sprite waveBaseSprite("wave_base.png", {1.f, 0.3f});
-    Sprite boatSprite("boat.png", {BOAT_WIDTH, 0.4f});
-    Sprite gameOverSprite("game_over.png", {0.5f, 0.5f});
-    gameOverSprite.setPos((glm::vec2(1.f, 1.f) - gameOverSprite.getSize()) / 2.f);
+    bool isKeyPressed(int) const override {
+        return false;
+    }
+
+    bool shouldClose() const override {
+        return closed_;
+    }
+
+    void close() override {
+        closed_ = true;
+    }
+
+    // nothing is presented, but the frame is waited for like a swap would
+    void swapBuffers() override {
+        glFinish();
+        ++frames_;
+    }
+
+    void pollEvents() override {}
 
-    float boatPosY = SEA_LEVEL;
-    float boatVelY = 0;
-    bool grounded = true;
+    // there is no display to wait for
+    void setSwapInterval(int) override {}
 
-    std::deque<std::shared_ptr<Object>> objects;
+    // writes the last frame as binary PPM
+    bool writePpm(const std::string& filename) const {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers_[DRAW]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers_[RESOLVE]);
+        glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers_[RESOLVE]);
 
-    std::random_device randDevice;
-    std::mt19937 randEngine(randDevice());
-    std::uniform_real_distribution<double> intervalDist(1.0, 3.0);
-    std::bernoulli_distribution typeDist;
-    double interval = glfwGetTime();
+        std::vector<unsigned char> pixels(3 * width_ * height_);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width_, height_, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[DRAW]);
 
-    bool gameover = false;
+        // GL rows go bottom up, PPM rows top down
+        std::ofstream ofs(filename, std::ios::binary);
+        ofs << "P6\n" << width_ << " " << height_ << "\n255\n";
+        for (int y = height_ - 1; y >= 0; --y) {
+            ofs.write(reinterpret_cast<const char*>(&pixels[3 * width_ * y]), 3 * width_);
+        }
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    enum {
+        DRAW,
+        RESOLVE,
+        NUM_FRAMEBUFFERS
+    };
+
+    const int width_, height_;
+    EGLDisplay display_;
+    GLuint renderbuffers_[NUM_FRAMEBUFFERS], framebuffers_[NUM_FRAMEBUFFERS];
+    long frames_;
+    bool closed_;
+};
+
+// Microbenchmarks of the renderer: decoding each sprite image, compiling
+// each shader and building each program without the binary cache, and
+// drawing K small sprites in each mode, up to glFinish. The atlas is only
+// created after the loads, so that its decoder threads are not running.
+void runBench() {
+    for (const auto& filename : ATLAS_FILENAMES) {
+        printBench("load/" + filename, timePerCall([&] {
+            int width, height, numComponents;
+            stbi_image_free(stbi_load(filename.c_str(), &width, &height, &numComponents, STBI_rgb_alpha));
+        }));
+    }
 
-    double time = glfwGetTime();
-    while (!glfwWindowShouldClose(window)) {
-        const bool retryKeyPressed = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
-        if (gameover) {
-            if (retryKeyPressed) {
-                gameover = false;
-                objects.clear();
-                boatPosY = SEA_LEVEL;
-                boatVelY = 0;
-                grounded = true;
+    // every build gets a source of its own, so that drivers that cache
+    // compiled shaders by their source don't skip the work
+    int build = 0;
+    const auto uniqueSource = [&build](const std::string& source) {
+        return source + "// " + std::to_string(build++) + "\n";
+    };
+    const std::vector<std::pair<std::string, GLenum>> shaderFiles = {
+        {"shaders/sprite.vert", GL_VERTEX_SHADER},
+        {"shaders/sprite.geom", GL_GEOMETRY_SHADER},
+        {"shaders/sprite_quad.vert", GL_VERTEX_SHADER},
+        {"shaders/tex.frag", GL_FRAGMENT_SHADER}
+    };
+    std::map<std::string, std::string> sources;
+    for (const auto& file : shaderFiles) {
+        sources[file.first] = Shader::readSource(file.first);
+        printBench("compile/" + file.first, timePerCall([&] {
+            Shader shader(file.second, uniqueSource(sources[file.first]));
+            assert(shader.isCompiled());
+        }));
+    }
+    const std::vector<std::pair<std::string, std::vector<std::size_t>>> programs = {
+        {"sprite", {0, 1, 3}},
+        {"sprite_quad", {2, 3}}
+    };
+    for (const auto& program : programs) {
+        printBench("program/" + program.first, timePerCall([&] {
+            std::vector<std::shared_ptr<Shader>> shaders;
+            for (const auto i : program.second) {
+                shaders.push_back(std::make_shared<Shader>(shaderFiles[i].second,
+                    uniqueSource(sources[shaderFiles[i].first])));
             }
-        } else {
-            time = glfwGetTime();
+            ShaderProgram linked(shaders);
+            assert(linked.isLinked());
+        }));
+    }
+
+    auto& atlas = TextureAtlas::getInstance();
+    while (!atlas.isLoaded()) {
+        atlas.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const auto& region = atlas.getRegion("spray.png");
+
+    auto& spriteBatch = SpriteBatch::getInstance();
+    const std::vector<std::pair<std::string, SpriteBatch::Mode>> modes = {
+        {"geometry", SpriteBatch::Mode::Geometry},
+        {"instanced", SpriteBatch::Mode::Instanced},
+        {"quad", SpriteBatch::Mode::Quad}
+    };
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> posDist(0.f, 1.f);
+    for (int numSprites = 1000; numSprites <= 100000; numSprites *= 10) {
+        std::vector<glm::vec2> positions(numSprites);
+        for (auto& pos : positions) {
+            pos = {posDist(engine), posDist(engine)};
+        }
 
-            const bool jumpKeyPressed = glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS;
-            if (grounded) {
-                if (jumpKeyPressed) {
-                    boatVelY -= 0.03f;
-                    grounded = false;
+        for (const auto& mode : modes) {
+            spriteBatch.setMode(mode.second);
+            printBench("draw/" + mode.first + "/" + std::to_string(numSprites), timePerCall([&] {
+                glClear(GL_COLOR_BUFFER_BIT);
+                spriteBatch.begin();
+                for (const auto& pos : positions) {
+                    spriteBatch.add(*region.texture, pos, {0.01f, 0.01f}, region.uvRect, OBJECT_LAYER);
                 }
-            } else if (boatPosY > SEA_LEVEL) {
-                grounded = true;
-                boatPosY = SEA_LEVEL;
-                boatVelY = 0.f;
+                spriteBatch.end();
+                glFinish();
+            }));
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    TRACE_WRITE_AT_EXIT("trace.json");
+    const auto startTime = std::chrono::steady_clock::now();
+    const auto millisecondsSinceStart = [startTime] {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    };
+
+    bool showStats = false;
+    bool debugOutput = false;
+    bool watchShaders = false;
+    bool profile = false;
+    bool bench = false;
+    bool offscreen = false;
+    long benchmarkLoad = -1;
+    long maxFrames = 0;
+    std::string dumpFilename;
+    std::string profileFilename;
+    double maxFps = 0;
+    std::uint64_t seed = std::random_device()();
+    bool seedGiven = false;
+    std::string recordFilename, replayFilename;
+    auto spriteBatchMode = SpriteBatch::Mode::Geometry;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--stats") == 0) {
+            showStats = true;
+        } else if (std::strcmp(argv[i], "--gl-debug") == 0) {
+            debugOutput = true;
+        } else if (std::strcmp(argv[i], "--watch-shaders") == 0) {
+            watchShaders = true;
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (std::strcmp(argv[i], "--offscreen") == 0) {
+            offscreen = true;
+        } else if (std::strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+            benchmarkLoad = std::max(0L, std::atol(argv[++i]));
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            maxFrames = std::atol(argv[++i]);
+        } else if (std::strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dumpFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (std::strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+            profile = true;
+            profileFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc) {
+            maxFps = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+            seedGiven = true;
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayFilename = argv[++i];
+        } else if (std::strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+            const std::string renderer = argv[++i];
+            if (renderer == "geometry") {
+                spriteBatchMode = SpriteBatch::Mode::Geometry;
+            } else if (renderer == "instanced") {
+                spriteBatchMode = SpriteBatch::Mode::Instanced;
+            } else if (renderer == "quad") {
+                spriteBatchMode = SpriteBatch::Mode::Quad;
             } else {
-                boatPosY += boatVelY;
-                boatVelY += GRAVITY;
+                std::cerr << "unknown renderer: " << renderer << std::endl;
+                return EXIT_FAILURE;
             }
+        } else {
+            std::cerr << "usage: " << argv[0]
+                << " [--stats] [--gl-debug] [--watch-shaders] [--bench] [--profile] [--profile-csv FILE]"
+                << " [--offscreen [--dump FILE]] [--frames N] [--benchmark N] [--max-fps N] [--seed N]"
+                << " [--record FILE | --replay FILE] [--renderer geometry|instanced|quad]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const bool benchmark = benchmarkLoad >= 0;
+    if (benchmark && !seedGiven) {
+        seed = 0;
+    }
+
+    // a replay plays back its own seed and input instead of the keyboard
+    Recording replay;
+    if (!replayFilename.empty()) {
+        if (!replay.load(replayFilename)) {
+            std::cerr << "failed to load " << replayFilename << std::endl;
+            return EXIT_FAILURE;
+        }
+        seed = replay.getSeed();
+    }
+    Recording recording(seed);
+
+    if (!dumpFilename.empty() && !offscreen) {
+        std::cerr << "--dump needs --offscreen" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (maxFrames <= 0) {
+        maxFrames = benchmark ? 1000 : offscreen ? 600 : 0;
+    }
+
+    std::unique_ptr<Platform> platform;
+    OffscreenPlatform* offscreenPlatform = nullptr;
+    if (offscreen) {
+        offscreenPlatform = new OffscreenPlatform(1280, 720, debugOutput);
+        platform.reset(offscreenPlatform);
+    } else {
+        platform.reset(new WindowPlatform(1280, 720, debugOutput, !bench));
+    }
+
+    if (benchmark) {
+        platform->setSwapInterval(0);
+    }
+
+    const auto loadProc = platform->getLoadProc();
+    const int glLoaded = gladLoadGLLoader(loadProc);
+    assert(glLoaded);
+    static_cast<void>(glLoaded);
+#ifdef GLAD_DEBUG
+    glad_set_post_callback(gladPostCallback);
+#endif
+    if (debugOutput && !enableDebugOutput(loadProc)) {
+        std::cerr << "GL debug output is not supported" << std::endl;
+    }
+
+    ProgramBinaryCache::getInstance().init(loadProc);
+    const double shadersStartTime = millisecondsSinceStart();
+    auto& programs = ShaderProgramStore::getInstance();
+    if (showStats) {
+        std::cerr << "shaders ready in " << millisecondsSinceStart() - shadersStartTime << " ms, "
+            << programs.getNumCachedPrograms() << " of " << programs.getNumPrograms()
+            << " programs from cache" << std::endl;
+    }
+    if (watchShaders && !programs.watchShaders("shaders")) {
+        std::cerr << "failed to watch shaders" << std::endl;
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glClearColor(0.627f, 0.847f, 0.937f, 1.f);
+
+    // before the sprites create the atlas, whose decoder threads would
+    // compete with the load timings
+    if (bench) {
+        runBench();
+        return EXIT_SUCCESS;
+    }
+
+    {
+        TRACE_SCOPE("SpriteStore");
+        SpriteStore::getInstance();
+    }
+
+    Sprite waveBaseSprite("wave_base.png", {1.f, 0.3f}, BACKGROUND_LAYER);
+    Sprite boatSprite("boat.png", {BOAT_WIDTH, 0.4f}, BOAT_LAYER);
+    Sprite gameOverSprite("game_over.png", {0.5f, 0.5f}, OVERLAY_LAYER);
+    gameOverSprite.setPos((glm::vec2(1.f, 1.f) - gameOverSprite.getSize()) / 2.f);
 
-            for (const auto& object : objects) {
-                if (object->hit(boatPosY)) {
-                    gameover = true;
+    GameState game(deriveSeed(seed, 0));
+
+    auto& glState = GLState::getInstance();
+    auto& atlas = TextureAtlas::getInstance();
+    auto& spriteBatch = SpriteBatch::getInstance();
+    spriteBatch.setMode(spriteBatchMode);
+    Profiler profiler(profile);
+    SyntheticLoad syntheticLoad(benchmark ? benchmarkLoad : 0);
+    std::vector<double> benchmarkFrameTimes; // seconds, from the first frame with textures
+    long benchmarkDrawCalls = 0;
+    auto benchmarkFrameStart = std::chrono::steady_clock::now();
+    double statsTime = platform->getTime();
+    int statsFrames = 0;
+
+    // state of the previous tick, for interpolating between ticks when rendering
+    double prevTime = game.getTime();
+    float prevBoatPosY = game.getBoatPosY();
+
+    double accumulator = 0.0;
+    double frameTime = platform->getTime();
+    Input input = {false, false};
+    bool firstFrame = true;
+    bool loaded = false;
+    long frames = 0;
+    while (!platform->shouldClose()) {
+        TRACE_SCOPE("frame");
+        profiler.beginFrame();
+        programs.update();
+        if (!loaded) {
+            atlas.update();
+            loaded = atlas.isLoaded();
+            if (loaded && showStats) {
+                std::cerr << "textures loaded after " << millisecondsSinceStart() << " ms" << std::endl;
+            }
+        }
+
+        const double now = platform->getTime();
+        accumulator += std::min(now - frameTime, MAX_FRAME_TIME);
+        frameTime = now;
+
+        // a press seen by a frame without ticks is kept for the next tick
+        input.jump |= platform->isKeyPressed(GLFW_KEY_SPACE);
+        input.retry |= platform->isKeyPressed(GLFW_KEY_R);
+
+        while (accumulator >= TICK) {
+            accumulator -= TICK;
+            prevTime = game.getTime();
+            prevBoatPosY = game.getBoatPosY();
+
+            if (!replayFilename.empty()) {
+                if (recording.size() == replay.size()) {
+                    platform->close();
                     break;
                 }
+                input = replay.get(recording.size());
             }
-
-            while (!objects.empty() && !objects.front()->isVisible()) {
-                objects.pop_front();
+            recording.add(input);
+            {
+                TRACE_SCOPE("update");
+                profiler.begin(Profiler::Phase::Update);
+                game.advance(input, TICK);
+                profiler.end(Profiler::Phase::Update);
+            }
+            {
+                TRACE_SCOPE("collision");
+                profiler.begin(Profiler::Phase::Collision);
+                game.collide();
+                profiler.end(Profiler::Phase::Collision);
             }
+            input = {false, false};
+        }
 
-            if (objects.empty() || time > objects.back()->getSpawnTime() + interval) {
-                if (typeDist(randEngine)) {
-                    objects.emplace_back(std::make_shared<Spray>(time));
-                } else {
-                    objects.emplace_back(std::make_shared<Pelican>(time));
-                }
-                interval = intervalDist(randEngine);
+        const double alpha = accumulator / TICK;
+        const double renderTime = glm::mix(prevTime, game.getTime(), alpha);
+        const float renderBoatPosY = glm::mix(prevBoatPosY, game.getBoatPosY(), static_cast<float>(alpha));
+
+        ShaderProgram::resetDriverLookupCount();
+        glState.resetCounts();
+
+        {
+            TRACE_SCOPE("draw");
+            profiler.begin(Profiler::Phase::Draw);
+            glClear(GL_COLOR_BUFFER_BIT);
+            spriteBatch.begin();
+
+            float x;
+            const float wavePos = -std::modf(WAVE_SPEED * renderTime, &x);
+
+            for (int i = 0; i < 2; ++i) {
+                waveBaseSprite.setPos({wavePos + i, SEA_LEVEL + 0.05 * std::sin(3 * renderTime)});
+                waveBaseSprite.draw();
             }
 
-            for (const auto& object : objects) {
-                object->update(time);
+            boatSprite.setPos({BOAT_POS_X, renderBoatPosY - 0.3f + 0.05 * std::sin(3 * renderTime)});
+            boatSprite.draw();
+
+            drawObstacles(game.getSprays(), game.getPelicans(), renderTime);
+            if (benchmark) {
+                syntheticLoad.update(renderTime);
+                drawObstacles(syntheticLoad.getSprays(), syntheticLoad.getPelicans(), renderTime);
             }
-        }
 
-        glClear(GL_COLOR_BUFFER_BIT);
+            if (game.isGameOver()) {
+                gameOverSprite.draw();
+            }
 
-        float x;
-        const float wavePos = -std::modf(WAVE_SPEED * time, &x);
+            profiler.drawGraph();
+            spriteBatch.end();
+            profiler.end(Profiler::Phase::Draw);
+            profiler.endRendering();
+        }
 
-        for (int i = 0; i < 2; ++i) {
-            waveBaseSprite.setPos({wavePos + i, SEA_LEVEL + 0.05 * std::sin(3 * time)});
-            waveBaseSprite.draw();
+        if (showStats) {
+            ++statsFrames;
+            if (now - statsTime >= 1.0) {
+                std::cerr << "fps: " << statsFrames / (now - statsTime)
+                    << " draw calls: " << spriteBatch.getDrawCallCount()
+                    << " uniform lookups: " << ShaderProgram::getDriverLookupCount()
+                    << " binds issued: " << glState.getIssuedCount()
+                    << " skipped: " << glState.getSkippedCount() << std::endl;
+                statsTime = now;
+                statsFrames = 0;
+            }
         }
 
-        boatSprite.setPos({BOAT_POS_X, boatPosY - 0.3f + 0.05 * std::sin(3 * time)});
-        boatSprite.draw();
+        {
+            TRACE_SCOPE("swap");
+            profiler.begin(Profiler::Phase::Swap);
+            platform->swapBuffers();
+            profiler.end(Profiler::Phase::Swap);
+        }
+        platform->pollEvents();
+        profiler.endFrame();
+
+        // frames are timed by the wall clock even offscreen, where time is simulated
+        if (benchmark) {
+            const auto frameEnd = std::chrono::steady_clock::now();
+            if (loaded) {
+                benchmarkFrameTimes.push_back(std::chrono::duration<double>(frameEnd - benchmarkFrameStart).count());
+                benchmarkDrawCalls += spriteBatch.getDrawCallCount();
+            }
+            benchmarkFrameStart = frameEnd;
+        }
 
-        for (const auto& object : objects) {
-            object->draw();
+        if (firstFrame && showStats) {
+            std::cerr << "first frame after " << millisecondsSinceStart() << " ms" << std::endl;
+        }
+        firstFrame = false;
+        if (++frames == maxFrames) {
+            platform->close();
         }
 
-        if (gameover) {
-            gameOverSprite.draw();
+        if (maxFps > 0) {
+            const double remaining = frameTime + 1.0 / maxFps - platform->getTime();
+            if (remaining > 0) {
+                std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+            }
         }
+    }
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    if (benchmark && !benchmarkFrameTimes.empty()) {
+        const auto numFrames = benchmarkFrameTimes.size();
+        double total = 0.0;
+        for (const double t : benchmarkFrameTimes) {
+            total += t;
+        }
+        auto sorted = benchmarkFrameTimes;
+        std::sort(sorted.begin(), sorted.end());
+        const double p99 = sorted[(99 * numFrames + 99) / 100 - 1];
+        std::cout << "benchmark: " << benchmarkLoad << " obstacles, " << numFrames << " frames"
+            << " fps: " << numFrames / total
+            << " mean: " << 1e3 * total / numFrames << " ms"
+            << " p99: " << 1e3 * p99 << " ms"
+            << " draw calls: " << static_cast<double>(benchmarkDrawCalls) / numFrames << std::endl;
+    }
+    if (!dumpFilename.empty() && !offscreenPlatform->writePpm(dumpFilename)) {
+        std::cerr << "failed to save " << dumpFilename << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!profileFilename.empty() && !profiler.writeCsv(profileFilename)) {
+        std::cerr << "failed to save " << profileFilename << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!recordFilename.empty() && !recording.save(recordFilename)) {
+        std::cerr << "failed to save " << recordFilename << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!recordFilename.empty() || !replayFilename.empty()) {
+        std::cout << "ticks: " << recording.size() << " digest: " << std::hex << digest(game) << std::endl;
     }
 
     return EXIT_SUCCESS;
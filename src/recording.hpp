@@ -0,0 +1,143 @@
+#ifndef WAVE_RECORDING_HPP
+#define WAVE_RECORDING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "game.hpp"
+
+const char RECORDING_MAGIC[4] = {'W', 'A', 'V', 'R'};
+
+// The master seed and the input of every tick of a run. Since the game only
+// advances in fixed ticks, replaying a recording into a GameState seeded the
+// same way reproduces the run exactly, with or without a window.
+//
+// File format, little endian:
+//   "WAVR", version (u32), seed (u64), tick count (u64),
+//   then one byte per tick: bit 0 jump, bit 1 retry
+class Recording {
+public:
+    explicit Recording(std::uint64_t seed = 0) :
+        seed_(seed) {}
+
+    std::uint64_t getSeed() const {
+        return seed_;
+    }
+
+    std::size_t size() const {
+        return inputs_.size();
+    }
+
+    void reserve(std::size_t ticks) {
+        inputs_.reserve(ticks);
+    }
+
+    void add(const Input& input) {
+        inputs_.push_back((input.jump ? JUMP_BIT : 0) | (input.retry ? RETRY_BIT : 0));
+    }
+
+    Input get(std::size_t tick) const {
+        const auto bits = inputs_.at(tick);
+        return {(bits & JUMP_BIT) != 0, (bits & RETRY_BIT) != 0};
+    }
+
+    bool save(const std::string& filename) const {
+        std::ofstream ofs(filename, std::ios::binary);
+        ofs.write(RECORDING_MAGIC, sizeof(RECORDING_MAGIC));
+        writeInt(ofs, VERSION, 4);
+        writeInt(ofs, seed_, 8);
+        writeInt(ofs, inputs_.size(), 8);
+        ofs.write(reinterpret_cast<const char*>(inputs_.data()), inputs_.size());
+        return static_cast<bool>(ofs);
+    }
+
+    bool load(const std::string& filename) {
+        std::ifstream ifs(filename, std::ios::binary);
+        char magic[sizeof(RECORDING_MAGIC)];
+        if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0) {
+            return false;
+        }
+        std::uint64_t version, size;
+        if (!readInt(ifs, version, 4) || version != VERSION
+            || !readInt(ifs, seed_, 8) || !readInt(ifs, size, 8)) {
+            return false;
+        }
+        // a corrupt tick count must not get to size the allocation
+        const auto start = ifs.tellg();
+        ifs.seekg(0, std::ios::end);
+        const auto end = ifs.tellg();
+        ifs.seekg(start);
+        if (start < 0 || end < start || size > static_cast<std::uint64_t>(end - start)) {
+            return false;
+        }
+        inputs_.resize(size);
+        return static_cast<bool>(ifs.read(reinterpret_cast<char*>(inputs_.data()), size));
+    }
+
+private:
+    // version 2 came with continuous-time collisions, which play recordings
+    // of earlier versions differently
+    static const std::uint32_t VERSION = 2;
+    static const std::uint8_t JUMP_BIT = 1;
+    static const std::uint8_t RETRY_BIT = 2;
+
+    std::uint64_t seed_;
+    std::vector<std::uint8_t> inputs_;
+
+    static void writeInt(std::ostream& os, std::uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            os.put(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    static bool readInt(std::istream& is, std::uint64_t& value, int bytes) {
+        value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            const int c = is.get();
+            if (c == EOF) {
+                return false;
+            }
+            value |= static_cast<std::uint64_t>(c) << (8 * i);
+        }
+        return true;
+    }
+};
+
+// FNV-1a over the exact bits of the simulation state, for checking that two
+// runs ended up in the same state
+inline std::uint64_t digest(const GameState& game) {
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    const auto add = [&hash](const void* data, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+        }
+    };
+
+    const double time = game.getTime();
+    const float boatPosY = game.getBoatPosY(), boatVelY = game.getBoatVelY();
+    const bool grounded = game.isGrounded(), gameover = game.isGameOver();
+    add(&time, sizeof(time));
+    add(&boatPosY, sizeof(boatPosY));
+    add(&boatVelY, sizeof(boatVelY));
+    add(&grounded, sizeof(grounded));
+    add(&gameover, sizeof(gameover));
+    // in spawn order across both kinds
+    const auto& sprays = game.getSprays();
+    const auto& pelicans = game.getPelicans();
+    std::size_t i = 0, j = 0;
+    while (i < sprays.size() || j < pelicans.size()) {
+        const bool spray = j == pelicans.size()
+            || (i < sprays.size() && sprays.getSpawnTimes()[i] < pelicans.getSpawnTimes()[j]);
+        const auto type = spray ? ObstacleType::Spray : ObstacleType::Pelican;
+        const double spawnTime = spray ? sprays.getSpawnTimes()[i++] : pelicans.getSpawnTimes()[j++];
+        add(&type, sizeof(type));
+        add(&spawnTime, sizeof(spawnTime));
+    }
+    return hash;
+}
+
+#endif
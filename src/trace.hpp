@@ -0,0 +1,152 @@
+#ifndef WAVE_TRACE_HPP
+#define WAVE_TRACE_HPP
+
+// Scoped trace markers, compiled in only with -DWAVE_TRACE (make trace).
+//
+// TRACE_SCOPE(name) records the time from where it stands to the end of its
+// scope; name has to be a string literal. TRACE_WRITE_AT_EXIT(filename)
+// writes everything recorded as Chrome trace event JSON when the program
+// exits, for Perfetto or chrome://tracing.
+//
+// Every thread records into a ring buffer of its own, so recording takes no
+// lock; a buffer keeps the last Tracer::BUFFER_SIZE events of its thread.
+// Buffers are only read on exit, once the other threads are gone.
+
+#ifdef WAVE_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Tracer {
+public:
+    static const std::size_t BUFFER_SIZE = 1 << 16;
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    Tracer() :
+        epoch_(Clock::now()) {}
+
+    static Tracer& getInstance() {
+        static Tracer instance;
+        return instance;
+    }
+
+    // nanoseconds since the tracer was created
+    std::uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch_).count();
+    }
+
+    void record(const char* name, std::uint64_t start, std::uint64_t end) {
+        Buffer* const buffer = getThreadBuffer();
+        const auto count = buffer->count.load(std::memory_order_relaxed);
+        buffer->events[count % BUFFER_SIZE] = {name, start, end - start};
+        buffer->count.store(count + 1, std::memory_order_release);
+    }
+
+    // to be called from the main thread, which then comes first in the trace
+    void writeAtExit(const std::string& filename) {
+        getThreadBuffer();
+        filename_ = filename;
+        std::atexit([] {
+            auto& tracer = getInstance();
+            if (!tracer.write(tracer.filename_)) {
+                std::cerr << "failed to save " << tracer.filename_ << std::endl;
+            }
+        });
+    }
+
+    bool write(const std::string& filename) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ofstream ofs(filename);
+        ofs << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+        const char* separator = "\n";
+        for (std::size_t thread = 0; thread < buffers_.size(); ++thread) {
+            ofs << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+                << ",\"args\":{\"name\":\"" << (thread == 0 ? "main" : "worker") << "\"}}";
+            separator = ",\n";
+
+            const auto& buffer = *buffers_[thread];
+            const auto count = buffer.count.load(std::memory_order_acquire);
+            for (auto i = count > BUFFER_SIZE ? count - BUFFER_SIZE : 0; i < count; ++i) {
+                const auto& event = buffer.events[i % BUFFER_SIZE];
+                ofs << separator << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+                    << ",\"ts\":" << event.start / 1e3 << ",\"dur\":" << event.duration / 1e3 << "}";
+            }
+        }
+        ofs << "\n]}\n";
+        return static_cast<bool>(ofs);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Event {
+        const char* name;
+        std::uint64_t start, duration; // nanoseconds
+    };
+
+    struct Buffer {
+        std::atomic<std::uint64_t> count; // of events ever recorded
+        Event events[BUFFER_SIZE];
+    };
+
+    const Clock::time_point epoch_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Buffer>> buffers_; // by thread, in order of their first event
+    std::string filename_;
+
+    Buffer* getThreadBuffer() {
+        thread_local Buffer* const buffer = addBuffer();
+        return buffer;
+    }
+
+    Buffer* addBuffer() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_.emplace_back(new Buffer);
+        buffers_.back()->count = 0;
+        return buffers_.back().get();
+    }
+};
+
+class TraceScope {
+public:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    explicit TraceScope(const char* name) :
+        name_(name),
+        start_(Tracer::getInstance().now()) {}
+
+    ~TraceScope() {
+        auto& tracer = Tracer::getInstance();
+        tracer.record(name_, start_, tracer.now());
+    }
+
+private:
+    const char* const name_;
+    const std::uint64_t start_;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_WRITE_AT_EXIT(filename) Tracer::getInstance().writeAtExit(filename)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_WRITE_AT_EXIT(filename) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef WAVE_VEC_ENV_HPP
+#define WAVE_VEC_ENV_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "game.hpp"
+
+// Steps many independent games at once, for reinforcement learning rollouts.
+//
+// The rules are those of GameState sampled once per step: the boat is
+// integrated per step, obstacles spawn on steps and collisions are tested
+// at the end of each step instead of over it, which is close enough at a
+// fixed step of TICK. The state of all games is kept as structure of arrays
+// and every per-step pass is a branch-free loop over all games (or all
+// obstacle slots), which GCC vectorizes at -O2 with -fno-trapping-math, as
+// -fopt-info-vec-optimized shows. A game that is lost is restarted within
+// the same step.
+//
+// Instead of spawn times, obstacles keep their age, and a spray keeps the
+// cosine and sine of its bobbing phase, which are advanced by a rotation
+// instead of calling std::cos every step.
+class VecEnv {
+public:
+    // obstacles are dropped at the end of the step they leave the screen in,
+    // so with spawns at least 1 s apart no more than 4 are kept at once
+    static const int MAX_OBJECTS = 4;
+    static_assert(MAX_OBJECTS == 4, "the hit reduction in step() is unrolled");
+
+    // boat y, boat velocity, grounded, then per obstacle slot in spawn
+    // order: present, is pelican, x, y
+    static const int OBSERVATION_SIZE = 3 + 4 * MAX_OBJECTS;
+
+    VecEnv(int numEnvs, std::uint64_t seed, double dt = TICK) :
+        numEnvs_(numEnvs),
+        dt_(static_cast<float>(dt)),
+        phaseCos_(std::cos(2 * dt_)),
+        phaseSin_(std::sin(2 * dt_)),
+        boatPosY_(paddedSize(numEnvs), SEA_LEVEL),
+        boatVelY_(paddedSize(numEnvs)),
+        grounded_(paddedSize(numEnvs), 1.f),
+        jumps_(paddedSize(numEnvs)),
+        numObjects_(numEnvs),
+        interval_(numEnvs),
+        randState_(numEnvs),
+        isPelican_(paddedSize(numEnvs) * MAX_OBJECTS),
+        active_(paddedSize(numEnvs) * MAX_OBJECTS),
+        age_(paddedSize(numEnvs) * MAX_OBJECTS),
+        cos_(paddedSize(numEnvs) * MAX_OBJECTS),
+        sin_(paddedSize(numEnvs) * MAX_OBJECTS),
+        slotBoatPosY_(paddedSize(numEnvs) * MAX_OBJECTS),
+        visible_(paddedSize(numEnvs) * MAX_OBJECTS),
+        hit_(paddedSize(numEnvs) * MAX_OBJECTS),
+        envHit_(paddedSize(numEnvs)),
+        rewards_(numEnvs),
+        dones_(numEnvs),
+        observations_(numEnvs * OBSERVATION_SIZE) {
+
+        for (int i = 0; i < numEnvs_; ++i) {
+            // decorrelate the streams of neighbouring games
+            randState_[i] = seed + 0x9e3779b97f4a7c15ull * (i + 1);
+            resetEnv(i);
+        }
+        updateObservations();
+    }
+
+    int size() const {
+        return numEnvs_;
+    }
+
+    // actions[i] != 0 makes the boat of game i jump
+    void step(const std::uint8_t* actions) {
+        // the padding keeps the loop counts multiples of the vector width,
+        // so that -O2 vectorizes them without a scalar epilogue
+        const int numEnvs = paddedSize(numEnvs_);
+        const int numSlots = numEnvs * MAX_OBJECTS;
+
+        for (int i = 0; i < numEnvs_; ++i) {
+            jumps_[i] = actions[i] != 0 ? 1.f : 0.f;
+        }
+        stepBoats(boatPosY_.data(), boatVelY_.data(), grounded_.data(), jumps_.data(), dt_, numEnvs);
+
+        // collision and visibility of every obstacle slot, as of the last step
+        spreadBoats(boatPosY_.data(), slotBoatPosY_.data(), numEnvs);
+        testSlots(slotBoatPosY_.data(), isPelican_.data(), active_.data(), age_.data(), cos_.data(),
+                  hit_.data(), visible_.data(), numSlots);
+        sumHits(hit_.data(), envHit_.data(), numEnvs);
+        for (int i = 0; i < numEnvs_; ++i) {
+            dones_[i] = envHit_[i] > 0.f;
+            rewards_[i] = envHit_[i] > 0.f ? 0.f : 1.f;
+        }
+
+        // empty slots are aged too; they are overwritten on spawn anyway
+        ageSlots(age_.data(), cos_.data(), sin_.data(), dt_, phaseCos_, phaseSin_, numSlots);
+
+        // removal, spawning and restarts are rare, so they are left scalar
+        for (int i = 0; i < numEnvs_; ++i) {
+            if (dones_[i]) {
+                resetEnv(i);
+                continue;
+            }
+
+            const int base = i * MAX_OBJECTS;
+            int numPopped = 0;
+            while (numPopped < numObjects_[i] && visible_[base + numPopped] == 0.f) {
+                ++numPopped;
+            }
+            if (numPopped > 0) {
+                for (int k = numPopped; k < numObjects_[i]; ++k) {
+                    moveObject(base + k, base + k - numPopped);
+                }
+                for (int k = numObjects_[i] - numPopped; k < numObjects_[i]; ++k) {
+                    active_[base + k] = 0.f;
+                }
+                numObjects_[i] -= numPopped;
+            }
+
+            if (numObjects_[i] == 0 || age_[base + numObjects_[i] - 1] > interval_[i]) {
+                spawn(i);
+            }
+        }
+
+        updateObservations();
+    }
+
+    const float* getObservations() const {
+        return observations_.data();
+    }
+
+    const float* getRewards() const {
+        return rewards_.data();
+    }
+
+    const std::uint8_t* getDones() const {
+        return dones_.data();
+    }
+
+private:
+    // floats per SSE register
+    static const int VECTOR_WIDTH = 4;
+
+    const int numEnvs_;
+    const float dt_;
+    const float phaseCos_, phaseSin_;
+
+    // per game, padded with idle games up to a multiple of VECTOR_WIDTH
+    std::vector<float> boatPosY_, boatVelY_;
+    std::vector<float> grounded_; // 0 or 1
+    std::vector<float> jumps_; // the actions, as 0 or 1
+    std::vector<int> numObjects_;
+    std::vector<float> interval_;
+    std::vector<std::uint64_t> randState_;
+
+    // per obstacle slot, MAX_OBJECTS consecutive slots per game in spawn
+    // order; flags are 0 or 1 floats so that the slot loop is all floats
+    std::vector<float> isPelican_, active_;
+    std::vector<float> age_, cos_, sin_;
+    std::vector<float> slotBoatPosY_;
+    std::vector<float> visible_, hit_;
+    std::vector<float> envHit_; // sum of hit_ per game
+
+    std::vector<float> rewards_;
+    std::vector<std::uint8_t> dones_;
+    std::vector<float> observations_;
+
+    // The passes of step() over all games or all slots. Arrays are restrict
+    // parameters, which GCC honours where it ignores restrict locals, so no
+    // loop needs a runtime aliasing check, which -O2 won't add. Without
+    // -fno-trapping-math the blends aren't if-converted, as arithmetic is
+    // moved into the branch it feeds. n is a multiple of VECTOR_WIDTH.
+
+    // the three cases are exclusive 0 or 1 weights
+    static void stepBoats(float* __restrict posY, float* __restrict velY, float* __restrict grounded,
+                          const float* __restrict jumps, float dt, int n) {
+        for (int i = 0; i < n; ++i) {
+            const float g = grounded[i];
+            const float pos = posY[i];
+            const float vel = velY[i];
+            const float jump = g * jumps[i];
+            const float airborne = 1.f - g;
+            const float land = pos > SEA_LEVEL ? airborne : 0.f;
+            const float fly = airborne - land;
+
+            posY[i] = land * SEA_LEVEL + (1.f - land) * (pos + fly * vel * dt);
+            velY[i] = (1.f - land) * (vel - jump * JUMP_SPEED + fly * GRAVITY * dt);
+            grounded[i] = g - jump + land;
+        }
+    }
+
+    static void spreadBoats(const float* __restrict posY, float* __restrict slotPosY, int n) {
+        for (int i = 0; i < n; ++i) {
+            for (int k = 0; k < MAX_OBJECTS; ++k) {
+                slotPosY[i * MAX_OBJECTS + k] = posY[i];
+            }
+        }
+    }
+
+    // both kinds of obstacle are evaluated and blended by the 0 or 1 flag
+    static void testSlots(const float* __restrict boatPosY, const float* __restrict isPelican,
+                          const float* __restrict active, const float* __restrict age,
+                          const float* __restrict cos, float* __restrict hit, float* __restrict visible, int n) {
+        for (int j = 0; j < n; ++j) {
+            const float pelican = isPelican[j];
+            const float a = age[j];
+            const float sprayX = 0.9f - WAVE_SPEED * a;
+            const float sprayY = 0.75f + 0.25f * cos[j];
+            const float pelicanX = 1.f - 0.8f * a;
+            const float pelicanY = 0.05f;
+
+            const bool hitSpray = (BOAT_POS_X + BOAT_WIDTH > sprayX + 0.5f * SPRAY_WIDTH)
+                & (BOAT_POS_X < sprayX + SPRAY_WIDTH)
+                & (boatPosY[j] > sprayY);
+            const bool hitPelican = (BOAT_POS_X + BOAT_WIDTH > pelicanX)
+                & (BOAT_POS_X < pelicanX + PELICAN_WIDTH)
+                & (boatPosY[j] - 0.2f < pelicanY + 0.2f);
+            const float hitSprayWeight = hitSpray ? 1.f : 0.f;
+            const float hitPelicanWeight = hitPelican ? 1.f : 0.f;
+            const float visibleSpray = a <= glm::pi<float>() ? 1.f : 0.f;
+            const float visiblePelican = pelicanX >= -PELICAN_WIDTH ? 1.f : 0.f;
+
+            hit[j] = active[j] * (hitSprayWeight + pelican * (hitPelicanWeight - hitSprayWeight));
+            visible[j] = visibleSpray + pelican * (visiblePelican - visibleSpray);
+        }
+    }
+
+    static void sumHits(const float* __restrict hit, float* __restrict envHit, int n) {
+        for (int i = 0; i < n; ++i) {
+            const int base = i * MAX_OBJECTS;
+            envHit[i] = hit[base] + hit[base + 1] + hit[base + 2] + hit[base + 3];
+        }
+    }
+
+    // the bobbing phase is advanced by a rotation
+    static void ageSlots(float* __restrict age, float* __restrict cos, float* __restrict sin,
+                         float dt, float phaseCos, float phaseSin, int n) {
+        for (int j = 0; j < n; ++j) {
+            const float c = cos[j], s = sin[j];
+            age[j] += dt;
+            cos[j] = c * phaseCos - s * phaseSin;
+            sin[j] = s * phaseCos + c * phaseSin;
+        }
+    }
+
+    static int paddedSize(int numEnvs) {
+        return (numEnvs + VECTOR_WIDTH - 1) & ~(VECTOR_WIDTH - 1);
+    }
+
+    // splitmix64, uniform in [0, 1)
+    float random(int i) {
+        std::uint64_t z = (randState_[i] += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        return (z >> 40) * (1.f / (1 << 24));
+    }
+
+    void resetEnv(int i) {
+        boatPosY_[i] = SEA_LEVEL;
+        boatVelY_[i] = 0.f;
+        grounded_[i] = 1.f;
+        numObjects_[i] = 0;
+        interval_[i] = 0.f;
+        std::fill_n(active_.begin() + i * MAX_OBJECTS, MAX_OBJECTS, 0.f);
+    }
+
+    void spawn(int i) {
+        assert(numObjects_[i] < MAX_OBJECTS);
+
+        const int j = i * MAX_OBJECTS + numObjects_[i]++;
+        active_[j] = 1.f;
+        isPelican_[j] = random(i) < 0.5f ? 1.f : 0.f;
+        age_[j] = 0.f;
+        cos_[j] = 1.f;
+        sin_[j] = 0.f;
+        interval_[i] = 1.f + 2.f * random(i);
+    }
+
+    void moveObject(int from, int to) {
+        isPelican_[to] = isPelican_[from];
+        age_[to] = age_[from];
+        cos_[to] = cos_[from];
+        sin_[to] = sin_[from];
+    }
+
+    void updateObservations() {
+        for (int i = 0; i < numEnvs_; ++i) {
+            float* obs = &observations_[i * OBSERVATION_SIZE];
+            obs[0] = boatPosY_[i];
+            obs[1] = boatVelY_[i];
+            obs[2] = grounded_[i];
+            for (int k = 0; k < MAX_OBJECTS; ++k) {
+                const int j = i * MAX_OBJECTS + k;
+                const bool present = k < numObjects_[i];
+                const bool pelican = isPelican_[j] != 0.f;
+                const float age = age_[j];
+                float* slot = obs + 3 + 4 * k;
+                slot[0] = present;
+                slot[1] = present && pelican;
+                slot[2] = present ? (pelican ? 1.f - 0.8f * age : 0.9f - WAVE_SPEED * age) : 0.f;
+                slot[3] = present ? (pelican ? 0.05f : 0.75f + 0.25f * cos_[j]) : 0.f;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef WAVE_WORK_STEALING_POOL_HPP
+#define WAVE_WORK_STEALING_POOL_HPP
+
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run batches of indexed tasks.
+//
+// Each worker has its own queue. A batch is dealt round-robin over the
+// queues; a worker takes tasks from the front of its own queue and, once it
+// is empty, steals from the back of the others, so uneven tasks still keep
+// every worker busy until the batch is done. Every worker takes part in
+// every batch, so that none is still looking for tasks when the next one
+// is dealt.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int numThreads) :
+        queues_(numThreads),
+        task_(nullptr),
+        finished_(0),
+        batch_(0),
+        quit_(false) {
+
+        assert(numThreads > 0);
+        for (auto& queue : queues_) {
+            queue.reset(new Queue);
+        }
+        for (int i = 0; i < numThreads; ++i) {
+            threads_.emplace_back(&WorkStealingPool::work, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        batchStarted_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    int size() const {
+        return static_cast<int>(threads_.size());
+    }
+
+    // calls task(index, worker) for every index in [0, numTasks) and returns
+    // once all of them have finished; worker is in [0, size())
+    void run(int numTasks, const std::function<void(int, int)>& task) {
+        if (numTasks <= 0) {
+            return;
+        }
+
+        for (int i = 0; i < numTasks; ++i) {
+            auto& queue = *queues_[i % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(i);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ = &task;
+        finished_ = 0;
+        ++batch_;
+        batchStarted_.notify_all();
+        batchFinished_.wait(lock, [this] { return finished_ == size(); });
+        task_ = nullptr;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable batchStarted_, batchFinished_;
+    const std::function<void(int, int)>* task_;
+    int finished_;
+    unsigned long batch_;
+    bool quit_;
+
+    bool pop(int worker, int& index) {
+        {
+            auto& own = *queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                index = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < queues_.size(); ++i) {
+            auto& victim = *queues_[(worker + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                index = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int worker) {
+        unsigned long batch = 0;
+        for (;;) {
+            const std::function<void(int, int)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                batchStarted_.wait(lock, [&] { return quit_ || batch_ != batch; });
+                if (quit_) {
+                    return;
+                }
+                batch = batch_;
+                task = task_;
+            }
+
+            int index;
+            while (pop(worker, index)) {
+                (*task)(index, worker);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (++finished_ == size()) {
+                batchFinished_.notify_one();
+            }
+        }
+    }
+};
+
+#endif